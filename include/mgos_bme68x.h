@@ -25,6 +25,8 @@
 #include "bme68x.h"
 #include "bsec_interface.h"
 
+#include "mgos_bme68x_frame.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,9 +35,20 @@ extern "C" {
 enum mgos_bme68x_event {
   MGOS_EV_BME68X_BSEC_OUTPUT =
       MGOS_EV_BME68X_BASE, /* ev_data: struct mgos_bsec_output */
+  MGOS_EV_BME68X_ROLLUP, /* ev_data: struct mgos_bme68x_rollup_ev */
+  MGOS_EV_BME68X_ALARM,  /* ev_data: struct mgos_bme68x_alarm_ev */
+  MGOS_EV_BME68X_BSEC_BATCH, /* ev_data: struct mgos_bsec_batch */
+  MGOS_EV_BME68X_DATA_VALID, /* ev_data: struct mgos_bsec_runin_status */
 };
 
+// Sensor output, published once per BSEC cycle.
+// Outputs live in a persistent double-buffered slot owned by the library:
+// event handlers receive a const pointer to it and must not modify it.
+// The slot stays intact until the next-but-one cycle; readers that hold on
+// to the pointer (or read it outside the event) should remember |gen| and
+// check it is unchanged after use, see mgos_bsec_output_is_current().
 struct mgos_bsec_output {
+  uint32_t gen;  // Generation, incremented with every output. 0 = updating.
   bsec_output_t outputs[BSEC_NUMBER_OUTPUTS];
   uint8_t num_outputs;  // Actual number of outputs.
   // Outputs pre-parsed for convenience.
@@ -46,8 +59,402 @@ struct mgos_bsec_output {
   bsec_output_t temp;  // BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE
   bsec_output_t rh;    // BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY
   bsec_output_t ps;    // BSEC_OUTPUT_RAW_PRESSURE
+  bsec_output_t static_iaq;  // BSEC_OUTPUT_STATIC_IAQ
+  bsec_output_t gas;         // BSEC_OUTPUT_RAW_GAS
+  bsec_output_t stab;        // BSEC_OUTPUT_STABILIZATION_STATUS
+  bsec_output_t run_in;      // BSEC_OUTPUT_RUN_IN_STATUS
+};
+
+// Size of the per-output dispatch table, sensor ids are below this value.
+#define MGOS_BSEC_NUM_SENSOR_IDS (BSEC_OUTPUT_RAW_GAS_INDEX + 1)
+
+// Per-output handler, receives a single output of the sensor it was
+// registered for. |out| points into the published output slot.
+typedef void (*mgos_bsec_output_cb_t)(const bsec_output_t *out, void *arg);
+
+// Register handler for outputs of a particular virtual sensor.
+// Handlers are only invoked for outputs that are present in a cycle,
+// the sensor still needs to be subscribed to (see sample rate settings).
+bool mgos_bsec_add_output_handler(bsec_virtual_sensor_t sensor_id,
+                                  mgos_bsec_output_cb_t cb, void *arg);
+
+// Remove handler previously added with mgos_bsec_add_output_handler().
+bool mgos_bsec_remove_output_handler(bsec_virtual_sensor_t sensor_id,
+                                     mgos_bsec_output_cb_t cb, void *arg);
+
+// Returns the most recently published output or NULL if there isn't one yet.
+const struct mgos_bsec_output *mgos_bsec_get_output(void);
+
+// Returns true if |out| still holds data of generation |gen|.
+// Use after reading from a slot obtained via mgos_bsec_get_output().
+bool mgos_bsec_output_is_current(const struct mgos_bsec_output *out,
+                                 uint32_t gen);
+
+// Receives the first output with IAQ measured after the request.
+// |latency_ms| is the time from the request to the result.
+// |out| is NULL if the request failed: no output arrived within two IAQ
+// periods plus MGOS_BSEC_MEAS_REQ_TIMEOUT_MARGIN_MS, or IAQ was disabled.
+typedef void (*mgos_bsec_measurement_cb_t)(const struct mgos_bsec_output *out,
+                                           uint32_t latency_ms, void *arg);
+
+// Request a measurement now. At ULP, an extra on-demand (ULP plus)
+// measurement is requested from BSEC and the cycle is run immediately.
+// At higher rates, the next regular output is delivered.
+// IAQ must be subscribed to. |cb| is invoked exactly once, on the main task.
+bsec_library_return_t mgos_bsec_request_measurement(
+    mgos_bsec_measurement_cb_t cb, void *arg);
+
+// Format outputs present in |out| as a compact JSON object, e.g.
+// {"ts":123456,"iaq":25.3,"iaq_acc":1,"temp":23.45,"rh":41.20,"ps":100325}
+// Timestamp is in milliseconds. Does not allocate memory.
+// Returns length of the string written to |buf| (NUL-terminated), or -1 if
+// it does not fit in |size| bytes.
+int mgos_bsec_output_to_json(const struct mgos_bsec_output *out, char *buf,
+                             size_t size);
+
+struct mgos_bsec_json_stats {
+  uint32_t num_encodes;
+  uint32_t num_overflows;
+  uint32_t last_bytes, max_bytes;
+  uint32_t last_cycles, max_cycles;  // CPU cycles per encode.
+  uint64_t total_bytes, total_cycles;
+};
+
+void mgos_bsec_get_json_stats(struct mgos_bsec_json_stats *stats);
+
+// Fill binary frame values (see mgos_bme68x_frame.h) from |out|.
+void mgos_bsec_output_to_frame(const struct mgos_bsec_output *out,
+                               uint16_t seq,
+                               struct mgos_bme68x_frame_values *v);
+
+// Main output signals, used by history and statistics.
+enum mgos_bme68x_signal {
+  MGOS_BME68X_SIG_IAQ = 0,   // BSEC_OUTPUT_IAQ
+  MGOS_BME68X_SIG_CO2 = 1,   // BSEC_OUTPUT_CO2_EQUIVALENT
+  MGOS_BME68X_SIG_VOC = 2,   // BSEC_OUTPUT_BREATH_VOC_EQUIVALENT
+  MGOS_BME68X_SIG_TEMP = 3,  // BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE
+  MGOS_BME68X_SIG_RH = 4,    // BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY
+  MGOS_BME68X_SIG_PS = 5,    // BSEC_OUTPUT_RAW_PRESSURE
+  MGOS_BME68X_SIG_GAS = 6,   // BSEC_OUTPUT_RAW_GAS
+  MGOS_BME68X_SIG_MAX,
+};
+
+// Returns signal corresponding to the BSEC output or -1.
+int mgos_bme68x_signal_from_sensor_id(uint8_t sensor_id);
+
+// Returns short name of the signal ("iaq", "co2", ...).
+const char *mgos_bme68x_signal_name(enum mgos_bme68x_signal sig);
+
+// One sample of signal history. Signals absent in the output are NaN.
+struct mgos_bme68x_ring_sample {
+  int64_t ts;  // Output timestamp, ns.
+  float v[MGOS_BME68X_SIG_MAX];
+  uint8_t iaq_acc;  // IAQ accuracy.
+};
+
+// Number of samples in the in-memory history ring (bme68x.ring_size).
+int mgos_bme68x_ring_count(void);
+
+// Copy up to |max| samples with from_ts <= ts < to_ts, oldest first.
+// Returns number of samples copied. To continue, repeat with from_ts set
+// to the timestamp of the last returned sample + 1.
+int mgos_bme68x_ring_get_range(int64_t from_ts, int64_t to_ts,
+                               struct mgos_bme68x_ring_sample *samples,
+                               int max);
+
+// Copy up to |n| most recent samples, oldest first. Returns number copied.
+int mgos_bme68x_ring_get_last(int n, struct mgos_bme68x_ring_sample *samples);
+
+// Rollup resolutions.
+enum mgos_bme68x_rollup_res {
+  MGOS_BME68X_ROLLUP_MIN = 0,   // 1 minute
+  MGOS_BME68X_ROLLUP_HOUR = 1,  // 1 hour
+  MGOS_BME68X_ROLLUP_DAY = 2,   // 1 day
+  MGOS_BME68X_ROLLUP_MAX,
+};
+
+// Running statistics of a signal, updated incrementally (Welford).
+struct mgos_bme68x_stats {
+  uint32_t count;
+  float min, max;
+  float mean;
+  float m2;  // Sum of squares of differences from the mean.
+};
+
+// Sample variance, 0 if there are fewer than 2 samples.
+float mgos_bme68x_stats_variance(const struct mgos_bme68x_stats *st);
+
+// Statistics of all the signals over one period.
+// Periods are aligned to UTC minutes, hours and days once the wall clock
+// is set, before that to BSEC time, which counts from boot.
+struct mgos_bme68x_rollup {
+  int64_t start_ts;  // Start of the period, ns.
+  bool wall_time;    // start_ts is UNIX time, otherwise BSEC time.
+  struct mgos_bme68x_stats sig[MGOS_BME68X_SIG_MAX];
+};
+
+// MGOS_EV_BME68X_ROLLUP data, triggered when a period is complete.
+struct mgos_bme68x_rollup_ev {
+  enum mgos_bme68x_rollup_res res;
+  const struct mgos_bme68x_rollup *r;
+};
+
+// Get rollup for the resolution: n = 0 is the current (incomplete) period,
+// 1 is the last complete one and so on, up to bme68x.rollup.keep_*.
+bool mgos_bme68x_rollup_get(enum mgos_bme68x_rollup_res res, int n,
+                            struct mgos_bme68x_rollup *r);
+
+// Compressed in-memory history (bme68x.hist).
+// Timestamps are stored with millisecond resolution as delta-of-delta,
+// signal values XOR-ed with the previous value of the same signal, IAQ
+// accuracy as a repeat flag.
+// Storage is split into blocks that are evicted oldest first.
+
+struct mgos_bme68x_hist_stats {
+  uint32_t num_samples;   // Samples currently stored.
+  uint32_t num_blocks;    // Blocks in use.
+  uint32_t num_evicted;   // Blocks evicted since init.
+  uint32_t bytes_used;    // Compressed size, including block headers.
+  uint32_t raw_bytes;     // Size of the same samples stored uncompressed.
+  float ratio;            // raw_bytes / bytes_used.
+  float bits_per_sample;
+};
+
+bool mgos_bme68x_hist_get_stats(struct mgos_bme68x_hist_stats *stats);
+
+// Sequential decoder state. Initialize with mgos_bme68x_hist_iter_init().
+struct mgos_bme68x_hist_iter {
+  uint32_t seq;       // Sequence number of the current block.
+  int block;          // Index of the current block.
+  int sample;         // Index of the next sample in the block.
+  uint32_t bit_pos;
+  int64_t ts, delta;  // Previous timestamp and delta, ms.
+  uint32_t v[MGOS_BME68X_SIG_MAX];
+  uint8_t lead[MGOS_BME68X_SIG_MAX], trail[MGOS_BME68X_SIG_MAX];
+  uint8_t iaq_acc;
+  int64_t from_ts;
+};
+
+// Position iterator at the oldest sample with ts >= from_ts (ns).
+void mgos_bme68x_hist_iter_init(struct mgos_bme68x_hist_iter *it,
+                                int64_t from_ts);
+
+// Decode next sample. Returns false when there are no more.
+// If blocks being read were evicted in the meantime, iteration continues
+// from the oldest remaining sample.
+bool mgos_bme68x_hist_iter_next(struct mgos_bme68x_hist_iter *it,
+                                struct mgos_bme68x_ring_sample *s);
+
+// On-flash output log (bme68x.log), for store-and-forward.
+// Records are appended to a circular log on a flash device, each protected
+// by a CRC, and drained in order with mgos_bme68x_log_read() followed by
+// mgos_bme68x_log_ack() once they have been delivered. Delivery is
+// at-least-once: records read but not acknowledged before a reboot, or
+// acknowledged in a page that has not been drained completely, are
+// returned again. If the log fills up, oldest pages are overwritten.
+
+enum mgos_bme68x_log_rec_type {
+  MGOS_BME68X_LOG_REC_SAMPLE = 1,  // rec.sample
+  MGOS_BME68X_LOG_REC_ROLLUP = 2,  // rec.rollup, rec.res
+};
+
+struct mgos_bme68x_log_record {
+  uint32_t seq;
+  uint16_t boot;  // Boot count (low bits), sample ts are relative to boot.
+  uint32_t time;  // UNIX time when written, s, or 0 if clock was not set.
+  enum mgos_bme68x_log_rec_type type;
+  enum mgos_bme68x_rollup_res res;
+  union {
+    struct mgos_bme68x_ring_sample sample;
+    struct mgos_bme68x_rollup rollup;
+  };
+};
+
+// Read the next record. Returns false if there are no more.
+bool mgos_bme68x_log_read(struct mgos_bme68x_log_record *rec);
+
+// Mark all the records read so far as delivered.
+void mgos_bme68x_log_ack(void);
+
+// Go back to the first record not acknowledged yet.
+void mgos_bme68x_log_rewind(void);
+
+struct mgos_bme68x_log_stats {
+  uint32_t num_pages;
+  uint32_t page_size;
+  uint32_t num_records;     // Written since boot.
+  uint32_t num_lost;        // Undelivered pages overwritten.
+  uint32_t num_corrupted;   // Records skipped due to CRC errors.
+  uint32_t num_erases;
+  uint32_t num_dropped;     // Next page was not erased in time.
+  uint32_t payload_bytes;   // Record payload written.
+  uint32_t flash_bytes;     // Bytes written, incl. headers and padding.
+  float write_amp;          // flash_bytes / payload_bytes.
+};
+
+bool mgos_bme68x_log_get_stats(struct mgos_bme68x_log_stats *stats);
+
+// Alarm rules (bme68x.alarm.rules), see README for syntax.
+// MGOS_EV_BME68X_ALARM is triggered when an alarm is raised or cleared.
+struct mgos_bme68x_alarm_ev {
+  int idx;           // Rule index.
+  const char *name;  // Rule name.
+  enum mgos_bme68x_signal sig;
+  bool active;
+  float value;  // Value (or rate, per minute) that caused the transition.
+  int64_t ts;
+};
+
+// Number of alarm rules.
+int mgos_bme68x_alarm_count(void);
+
+// Returns state of the alarm |idx|, false if there is no such rule.
+bool mgos_bme68x_alarm_get(int idx, struct mgos_bme68x_alarm_ev *state);
+
+// Batched outputs (bme68x.batch).
+enum mgos_bsec_batch_reason {
+  MGOS_BSEC_BATCH_FULL = 0,
+  MGOS_BSEC_BATCH_INTERVAL = 1,
+  MGOS_BSEC_BATCH_ALARM = 2,
+  MGOS_BSEC_BATCH_REBOOT = 3,
+  MGOS_BSEC_BATCH_REQUEST = 4,  // mgos_bsec_batch_flush()
+};
+
+struct mgos_bsec_batch {
+  enum mgos_bsec_batch_reason reason;
+  int num_samples;
+  // Oldest first. Valid only for the duration of the event.
+  const struct mgos_bme68x_ring_sample *samples;
+};
+
+// Trigger MGOS_EV_BME68X_BSEC_BATCH now if there are pending samples.
+void mgos_bsec_batch_flush(void);
+
+// Deadband filtering of output events (bme68x.deadband).
+struct mgos_bme68x_deadband_stats {
+  uint32_t num_forwarded;
+  uint32_t num_suppressed;
+};
+
+bool mgos_bme68x_get_deadband_stats(struct mgos_bme68x_deadband_stats *stats);
+
+// Latency of the measurement cycle stages (bme68x.latency_hist).
+enum mgos_bme68x_stage {
+  MGOS_BME68X_STAGE_CONTROL = 0,     // bsec_sensor_control()
+  MGOS_BME68X_STAGE_CONFIG = 1,      // Sensor configuration and trigger.
+  MGOS_BME68X_STAGE_READ = 2,        // Polling and reading data.
+  MGOS_BME68X_STAGE_DO_STEPS = 3,    // bsec_do_steps()
+  MGOS_BME68X_STAGE_PARSE = 4,       // Output parsing, calibration.
+  MGOS_BME68X_STAGE_STORE = 5,       // History, rollups, log, alarms.
+  MGOS_BME68X_STAGE_DISPATCH = 6,    // Output handlers and event.
+  MGOS_BME68X_STAGE_STATE_SAVE = 7,  // Saving BSEC state.
+  MGOS_BME68X_STAGE_MAX,
+};
+
+// All times are in microseconds. Percentiles are approximate, to 25%.
+struct mgos_bme68x_latency {
+  uint32_t count;
+  uint32_t min, max, mean;
+  uint32_t p50, p90, p99, p999;
 };
 
+bool mgos_bme68x_get_latency(enum mgos_bme68x_stage stage,
+                             struct mgos_bme68x_latency *lat);
+
+void mgos_bme68x_reset_latency(void);
+
+const char *mgos_bme68x_stage_name(enum mgos_bme68x_stage stage);
+
+// Energy accounting of the measurement cycle (bme68x.energy).
+// Times are cumulative since start or reset, energy is estimated from them
+// and the configured currents.
+struct mgos_bme68x_energy {
+  uint32_t num_cycles;   // Measurements triggered.
+  uint32_t num_outputs;  // Outputs published.
+  uint64_t heater_us;    // Gas heater on-time.
+  uint64_t meas_us;      // T/P/H conversion time.
+  uint64_t i2c_us;       // Time spent on the I2C bus.
+  uint64_t awake_us;     // Host time spent running the cycle.
+  float heater_mj, meas_mj, i2c_mj, host_mj;
+  float total_mj;
+  float output_mj;       // Average per output.
+  float last_output_mj;  // Spent since the output before the last one.
+  float hour_mj;         // Average per hour.
+};
+
+bool mgos_bme68x_get_energy(struct mgos_bme68x_energy *energy);
+
+void mgos_bme68x_reset_energy(void);
+
+// Binary trace of the measurement cycle (bme68x.trace_size records).
+// Records are kept in a RAM ring, see BME68x.GetTrace and
+// tools/bme68x_trace.py.
+enum mgos_bme68x_trace_type {
+  // a: trigger | run_gas << 1, b: heater temp, c: process_data,
+  // d: heater dur | os_temp << 16 | os_pres << 20 | os_hum << 24.
+  MGOS_BME68X_TRACE_CTL = 1,
+  MGOS_BME68X_TRACE_INPUT = 2,   // a: sensor_id, c: signal (float).
+  MGOS_BME68X_TRACE_OUTPUT = 3,  // a: sensor_id, b: accuracy, c: signal.
+  MGOS_BME68X_TRACE_STATUS = 4,  // a: enum mgos_bme68x_trace_op, c: status.
+  MGOS_BME68X_TRACE_TIMING = 5,  // a: enum mgos_bme68x_stage, c: us.
+};
+
+enum mgos_bme68x_trace_op {
+  MGOS_BME68X_TRACE_OP_SENSOR_CONTROL = 1,  // d: next call, ms.
+  MGOS_BME68X_TRACE_OP_SET_CONF = 2,
+  MGOS_BME68X_TRACE_OP_SET_OP_MODE = 3,
+  MGOS_BME68X_TRACE_OP_GET_DATA = 4,  // d: data status.
+  MGOS_BME68X_TRACE_OP_DO_STEPS = 5,  // b: inputs, d: outputs.
+  MGOS_BME68X_TRACE_OP_SUBSCRIPTION = 6,
+  MGOS_BME68X_TRACE_OP_STATE_SAVE = 7,
+};
+
+struct mgos_bme68x_trace_rec {
+  uint32_t ts;  // Uptime, ms.
+  uint8_t type;
+  uint8_t a;
+  uint16_t b;
+  uint32_t c;
+  uint32_t d;
+};
+
+// Copy up to |max| records, starting with sequence number |*seq|.
+// If that record has already been overwritten, |*seq| is advanced to the
+// oldest one available. Returns the number of records copied or -1 if
+// the trace is not enabled.
+int mgos_bme68x_trace_get(uint32_t *seq, struct mgos_bme68x_trace_rec *recs,
+                          int max);
+
+// Snapshot of the latest sensor data.
+struct mgos_bme68x_latest {
+  uint32_t gen;             // Generation of the output, 0 = no data yet.
+  struct bme68x_data raw;   // Raw sample the outputs were computed from.
+  uint8_t num_outputs;
+  bsec_output_t outputs[BSEC_NUMBER_OUTPUTS];
+};
+
+// Get a consistent copy of the latest data.
+// Can be called from any task: the snapshot is protected by a sequence lock,
+// reader retries if it races with an update and never blocks the writer.
+// Returns false if there is no data yet or a stable copy could not be
+// obtained (writer updated it several times in a row).
+bool mgos_bme68x_get_latest(struct mgos_bme68x_latest *latest);
+
+// Statistics of the dedicated measurement task (bme68x.task.enable).
+struct mgos_bme68x_task_stats {
+  uint32_t num_queued;   // Outputs passed to the main task.
+  uint32_t num_dropped;  // Outputs dropped because the queue was full.
+  uint32_t depth;        // Current queue depth.
+  uint32_t max_depth;    // Queue depth high watermark.
+  // Time between output being queued and dispatched on the main task.
+  uint32_t last_latency_us;
+  uint32_t max_latency_us;
+  uint64_t total_latency_us;
+};
+
+// Returns false if measurement task is not running.
+bool mgos_bme68x_get_task_stats(struct mgos_bme68x_task_stats *stats);
+
 // Load BSEC library configuration from a file.
 bsec_library_return_t mgos_bsec_set_configuration_from_file(const char *file);
 
@@ -60,7 +467,136 @@ bsec_library_return_t mgos_bsec_save_state_to_file(const char *file);
 // Set temperature heat compensation (BSEC_INPUT_HEATSOURCE) value.
 void mgos_bsec_set_input_heat_source_value(float value);
 
+// Sensors whose sample rate can be set. Each covers a group of outputs.
+enum mgos_bsec_sensor {
+  MGOS_BSEC_SENSOR_IAQ = 0,   // IAQ, static IAQ, CO2, VOC, gas, status.
+  MGOS_BSEC_SENSOR_TEMP = 1,  // Compensated and raw temperature.
+  MGOS_BSEC_SENSOR_RH = 2,    // Compensated and raw humidity.
+  MGOS_BSEC_SENSOR_PS = 3,    // Pressure.
+  MGOS_BSEC_SENSOR_MAX,
+};
+
+// Sample rate multiplexer.
+// Each client requests the rate it needs for each of the sensors, BSEC is
+// subscribed at the highest rate that is requested (rounded up to the
+// nearest rate supported by BSEC: ULP, LP or continuous). If client has a
+// callback, it receives outputs decimated to the rate it requested.
+// Rate is dropped automatically once clients that need it go away.
+struct mgos_bsec_rate_client;
+
+// Create a rate client. |cb| is optional, |name| must remain valid.
+struct mgos_bsec_rate_client *mgos_bsec_rate_client_create(
+    const char *name, mgos_bsec_output_cb_t cb, void *arg);
+
+// Set rate requested by the client for the sensor, in Hz.
+// Any rate can be requested, e.g. 1/60.0f for every minute.
+// BSEC_SAMPLE_RATE_DISABLED withdraws the request.
+bsec_library_return_t mgos_bsec_rate_client_set(
+    struct mgos_bsec_rate_client *c, enum mgos_bsec_sensor sensor, float sr);
+
+// Withdraw all the client's requests and free it.
+void mgos_bsec_rate_client_free(struct mgos_bsec_rate_client *c);
+
+// Returns the rate sensor is currently subscribed at.
+float mgos_bsec_get_sample_rate(enum mgos_bsec_sensor sensor);
+
+// IAQ calibration scheduler (bme68x.bsec.iaq_auto_cal).
+struct mgos_bsec_cal_day {
+  uint32_t lp_ms;        // Time in forced LP.
+  uint32_t switches;     // Forced LP turned on or off.
+  uint32_t sub_commits;  // All subscription changes.
+};
+
+struct mgos_bsec_cal_stats {
+  bool calibrating;
+  uint32_t progress;  // Samples at accuracy 3 so far.
+  uint32_t num_switches;
+  uint32_t lp_ms;
+  // Days are counted from library init.
+  struct mgos_bsec_cal_day today, yesterday;
+};
+
+bool mgos_bsec_get_cal_stats(struct mgos_bsec_cal_stats *stats);
+
+// Sensor stabilization and run-in. MGOS_EV_BME68X_DATA_VALID is triggered
+// once both are complete. Times are since library init.
+struct mgos_bsec_runin_status {
+  bool stable;
+  bool run_in;
+  bool valid;  // Both of the above.
+  bool boost;  // Fast start is in effect (bme68x.bsec.fast_start).
+  uint32_t time_to_stable_ms;
+  uint32_t time_to_run_in_ms;
+};
+
+bool mgos_bsec_get_runin_status(struct mgos_bsec_runin_status *status);
+
+// Predict timestamps (ns, same time base as outputs) of the next |n| BSEC
+// wakeups at the current subscription. Returns the number filled in.
+int mgos_bsec_predict_wakeups(int64_t *ts, int n);
+
+// Adaptive IAQ sample rate controller (bme68x.ratectl).
+enum mgos_bsec_ratectl_level {
+  MGOS_BSEC_RATECTL_ULP = 0,  // Configured rate, no boost.
+  MGOS_BSEC_RATECTL_LP = 1,
+  MGOS_BSEC_RATECTL_CONT = 2,
+  MGOS_BSEC_RATECTL_MAX,
+};
+
+struct mgos_bsec_ratectl_stats {
+  enum mgos_bsec_ratectl_level level;
+  uint32_t num_switches;
+  uint32_t level_ms[MGOS_BSEC_RATECTL_MAX];  // Time spent at each level.
+  float rate;            // Last IAQ change, per minute.
+  float credit_mj;       // Energy budget credit left.
+  float predicted_mj_h;  // At the current rate, 0 if unknown.
+};
+
+bool mgos_bsec_ratectl_get_stats(struct mgos_bsec_ratectl_stats *stats);
+
+const char *mgos_bsec_ratectl_level_name(enum mgos_bsec_ratectl_level level);
+
+// Subscription builder: collects requested virtual sensors and rates and
+// commits them with a single bsec_update_subscription() call.
+struct mgos_bsec_subscription {
+  bsec_sensor_configuration_t rvs[MGOS_BSEC_NUM_SENSOR_IDS];
+  uint8_t num_rvs;
+  // Required physical sensor settings, filled in by commit.
+  bsec_sensor_configuration_t rss[BSEC_MAX_PHYSICAL_SENSOR];
+  uint8_t num_rss;
+};
+
+void mgos_bsec_subscription_init(struct mgos_bsec_subscription *sub);
+
+// Add virtual sensor to the subscription, replaces rate if already added.
+bool mgos_bsec_subscription_add(struct mgos_bsec_subscription *sub,
+                                uint8_t sensor_id, float sr);
+
+// Apply the subscription. Note that rate multiplexer is not aware of the
+// changes made this way, so this is best used with sensors that are not
+// under its control.
+bsec_library_return_t mgos_bsec_subscription_commit(
+    struct mgos_bsec_subscription *sub);
+
+// Returns physical sensor settings required by the current subscription.
+const bsec_sensor_configuration_t *mgos_bsec_get_required_sensor_settings(
+    uint8_t *num);
+
+struct mgos_bsec_subscription_stats {
+  uint32_t num_commits;  // bsec_update_subscription() calls.
+  uint32_t num_errors;
+  uint32_t num_sensors;  // Virtual sensors updated, total.
+  uint32_t last_us;      // Duration of the last call.
+  uint32_t max_us;
+  uint32_t total_us;
+};
+
+void mgos_bsec_get_subscription_stats(
+    struct mgos_bsec_subscription_stats *stats);
+
 // Set sample rate for the IAQ sensors.
+// This and the functions below set requests of the default client that
+// is configured from bme68x.bsec.*_sample_rate settings.
 bsec_library_return_t mgos_bsec_set_iaq_sample_rate(float sr);
 
 // Set sample rate for the temperature sensor.
@@ -70,7 +606,7 @@ bsec_library_return_t mgos_bsec_set_temp_sample_rate(float sr);
 bsec_library_return_t mgos_bsec_set_rh_sample_rate(float sr);
 
 // Set sample rate for the pressure sensor.
-bsec_library_return_t mgos_bsec_set_rh_sample_rate(float sr);
+bsec_library_return_t mgos_bsec_set_ps_sample_rate(float sr);
 
 // Start sensor update loop. Should be called after desired outputs are
 // requested via bsec_update_subscription();
@@ -85,6 +621,40 @@ bool mgos_bme68x_init_cfg(const struct mgos_config_bme68x *cfg);
 // 0x77).
 int8_t mgos_bme68x_init_dev_i2c(struct bme68x_dev *dev, int bus_no, int addr);
 
+// I2C traffic accounting, by phase of the measurement cycle.
+enum mgos_bme68x_i2c_phase {
+  MGOS_BME68X_I2C_PHASE_OTHER = 0,    // Init, self-test, etc.
+  MGOS_BME68X_I2C_PHASE_CONTROL = 1,  // Sensor configuration.
+  MGOS_BME68X_I2C_PHASE_TRIGGER = 2,  // Starting the measurement.
+  MGOS_BME68X_I2C_PHASE_POLL = 3,     // Waiting for the measurement.
+  MGOS_BME68X_I2C_PHASE_READ = 4,     // Reading results.
+  MGOS_BME68X_I2C_PHASE_MAX,
+};
+
+struct mgos_bme68x_i2c_counters {
+  uint32_t num_xfers;
+  uint32_t num_errors;   // Failed after all retries.
+  uint32_t num_retries;
+  uint32_t bytes_read;
+  uint32_t bytes_written;  // Incl. register addresses.
+  uint64_t bus_time_us;
+};
+
+struct mgos_bme68x_i2c_stats {
+  uint32_t num_cycles;  // Measurements triggered.
+  struct mgos_bme68x_i2c_counters total;
+  struct mgos_bme68x_i2c_counters phase[MGOS_BME68X_I2C_PHASE_MAX];
+};
+
+// Get stats of a device initialized with mgos_bme68x_init_dev_i2c(),
+// NULL for the library's own device.
+bool mgos_bme68x_get_i2c_stats(const struct bme68x_dev *dev,
+                               struct mgos_bme68x_i2c_stats *stats);
+
+void mgos_bme68x_reset_i2c_stats(const struct bme68x_dev *dev);
+
+const char *mgos_bme68x_i2c_phase_name(enum mgos_bme68x_i2c_phase phase);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compact binary frame for low-bandwidth links.
+// Has no dependencies on Mongoose OS, can be built on the host to decode.
+//
+// Layout (little-endian):
+//   u8  version << 4 | flags
+//   u16 sequence number
+//   u8  bitmap of present fields
+//   u8  accuracy of IAQ, CO2, VOC and static IAQ, 2 bits each, in this order
+//       starting from LSB (only if any of them is present)
+//   values of present fields, in field order:
+//     full frame: fixed-point, 2 bytes (3 for gas resistance),
+//     delta frame: zigzag varint of the difference from the previous frame.
+// A delta frame can only follow a frame with the same set of fields and
+// the previous sequence number.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MGOS_BME68X_FRAME_VERSION 1
+#define MGOS_BME68X_FRAME_F_DELTA 0x01
+
+// Maximum size of the encoded frame.
+#define MGOS_BME68X_FRAME_MAX_LEN 22
+
+enum mgos_bme68x_frame_field {
+  MGOS_BME68X_FRAME_IAQ = 0,   // 0.1, 0 - 6553.5
+  MGOS_BME68X_FRAME_CO2 = 1,   // 1 ppm
+  MGOS_BME68X_FRAME_VOC = 2,   // 0.01 ppm
+  MGOS_BME68X_FRAME_TEMP = 3,  // 0.01 C, signed
+  MGOS_BME68X_FRAME_RH = 4,    // 0.01 %
+  MGOS_BME68X_FRAME_PS = 5,    // 2 Pa, 30000 - 161070 Pa
+  MGOS_BME68X_FRAME_GAS = 6,   // 10 Ohm
+  MGOS_BME68X_FRAME_SIAQ = 7,  // 0.1, static IAQ
+  MGOS_BME68X_FRAME_MAX,
+};
+
+struct mgos_bme68x_frame_values {
+  uint16_t seq;
+  uint8_t present;  // Bitmap, 1 << field.
+  uint8_t acc[MGOS_BME68X_FRAME_MAX];
+  float v[MGOS_BME68X_FRAME_MAX];
+};
+
+// State of the encoder or decoder, required for delta frames.
+// Zero-initialize before use.
+struct mgos_bme68x_frame_ctx {
+  bool valid;
+  uint16_t seq;
+  uint8_t present;
+  int32_t q[MGOS_BME68X_FRAME_MAX];  // Quantized values.
+};
+
+// Encode |v| into |buf|. If |delta| is set and |ctx| allows it, a delta frame
+// is produced, otherwise a full one. |ctx| may be NULL.
+// Returns length of the frame or -1 if |size| is too small.
+int mgos_bme68x_frame_encode(struct mgos_bme68x_frame_ctx *ctx,
+                             const struct mgos_bme68x_frame_values *v,
+                             bool delta, uint8_t *buf, size_t size);
+
+// Decode a frame. |ctx| is required to decode delta frames, may be NULL.
+// Returns false if the frame is invalid or the base of a delta frame is
+// missing.
+bool mgos_bme68x_frame_decode(struct mgos_bme68x_frame_ctx *ctx,
+                              const uint8_t *buf, size_t len,
+                              struct mgos_bme68x_frame_values *v);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,66 +18,160 @@
 #include "mgos_bme68x.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
+#include "common/queue.h"
+
 #include "mgos.h"
 #include "mgos_i2c.h"
 
 #include "bme68x.h"
 #include "bsec_interface.h"
 
-#ifndef MGOS_BME68X_BSEC_MIN_CAL_CYCLES
-#define MGOS_BME68X_BSEC_MIN_CAL_CYCLES 50
+#include "mgos_bme68x_internal.h"
+
+#ifndef MGOS_BME68X_LATEST_MAX_TRIES
+#define MGOS_BME68X_LATEST_MAX_TRIES 10
 #endif
 
+// Measurement requests time out after two IAQ periods plus this.
+#ifndef MGOS_BSEC_MEAS_REQ_TIMEOUT_MARGIN_MS
+#define MGOS_BSEC_MEAS_REQ_TIMEOUT_MARGIN_MS 10000
+#endif
+
+struct mgos_bsec_output_handler {
+  mgos_bsec_output_cb_t cb;
+  void *arg;
+  SLIST_ENTRY(mgos_bsec_output_handler) next;
+};
+
+struct mgos_bsec_meas_req {
+  mgos_bsec_measurement_cb_t cb;
+  void *arg;
+  int64_t start_us;
+  int64_t min_ts;  // Outputs measured before this do not count.
+  mgos_timer_id timer_id;
+  SLIST_ENTRY(mgos_bsec_meas_req) next;
+};
+
+struct mgos_bsec_rate_client {
+  const char *name;
+  bool boost;  // Only raises rate of sensors requested by someone else.
+  float sr[MGOS_BSEC_SENSOR_MAX];
+  int64_t last_ts[MGOS_BSEC_SENSOR_MAX];
+  uint8_t due;  // Sensors to deliver in the current cycle.
+  mgos_bsec_output_cb_t cb;
+  void *arg;
+  SLIST_ENTRY(mgos_bsec_rate_client) next;
+};
+
 struct mgos_bme68x_state {
   struct mgos_config_bme68x cfg;
   struct bme68x_dev dev;
   struct bme68x_conf tph_sett;
   struct bme68x_heatr_conf gas_sett;
+  struct mgos_rlock_type *bsec_lock;
   mgos_timer_id bsec_timer_id;
   mgos_timer_id meas_timer_id;
   int64_t next_ts;
+  int64_t next_due_us;  // Uptime when |next_ts| is due.
+  bool early;  // Run the next cycle now, see mgos_bsec_request_measurement().
   int state_save_delay_ms;
   float input_heat_source_value;
-  float prev_iaq_sr;
-  int iaq_cal_cycles;
+  // Rate multiplexer: clients and currently subscribed rates.
+  SLIST_HEAD(rate_clients, mgos_bsec_rate_client) rate_clients;
+  float sub_sr[MGOS_BSEC_SENSOR_MAX];
+  struct mgos_bsec_rate_client *cfg_client;
+  // Result of the last subscription update.
+  bsec_sensor_configuration_t rss[BSEC_MAX_PHYSICAL_SENSOR];
+  uint8_t num_rss;
+  struct mgos_bsec_subscription_stats sub_stats;
+  // Latest data snapshot, protected by |latest_seq| (odd = being updated).
+  volatile uint32_t latest_seq;
+  struct mgos_bme68x_latest latest;
+  // Double-buffered output, |cur_out| points to the last published slot.
+  struct mgos_bsec_output outputs[2];
+  struct mgos_bsec_output *volatile cur_out;
+  uint32_t out_gen;
+  // Per-output handlers, indexed by sensor_id.
+  SLIST_HEAD(output_handlers, mgos_bsec_output_handler)
+  output_handlers[MGOS_BSEC_NUM_SENSOR_IDS];
+  // Pending measurement requests.
+  SLIST_HEAD(meas_reqs, mgos_bsec_meas_req) meas_reqs;
+};
+
+// Offsets of the pre-parsed fields of struct mgos_bsec_output, by sensor_id.
+// 0 means the output is not pre-parsed.
+static const uint16_t s_parsed_fields[MGOS_BSEC_NUM_SENSOR_IDS] = {
+    [BSEC_OUTPUT_IAQ] = offsetof(struct mgos_bsec_output, iaq),
+    [BSEC_OUTPUT_STATIC_IAQ] = offsetof(struct mgos_bsec_output, static_iaq),
+    [BSEC_OUTPUT_CO2_EQUIVALENT] = offsetof(struct mgos_bsec_output, co2),
+    [BSEC_OUTPUT_BREATH_VOC_EQUIVALENT] =
+        offsetof(struct mgos_bsec_output, voc),
+    [BSEC_OUTPUT_RAW_PRESSURE] = offsetof(struct mgos_bsec_output, ps),
+    [BSEC_OUTPUT_RAW_GAS] = offsetof(struct mgos_bsec_output, gas),
+    [BSEC_OUTPUT_STABILIZATION_STATUS] =
+        offsetof(struct mgos_bsec_output, stab),
+    [BSEC_OUTPUT_RUN_IN_STATUS] = offsetof(struct mgos_bsec_output, run_in),
+    [BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE] =
+        offsetof(struct mgos_bsec_output, temp),
+    [BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY] =
+        offsetof(struct mgos_bsec_output, rh),
 };
 
 static struct mgos_bme68x_state *s_state;
 
-static void mgos_bsec_timer_cb(void *arg);
+static const char *s_signal_names[MGOS_BME68X_SIG_MAX] = {
+    "iaq", "co2", "voc", "temp", "rh", "ps", "gas",
+};
 
-static BME68X_INTF_RET_TYPE bme68x_i2c_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t length, void *intf_ptr)
-{
-  (void)intf_ptr;   // Suppress compiler warning
-  // TODO check bus
-  struct mgos_i2c *bus = mgos_i2c_get_bus(BME68X_I2C_ADDR_LOW); 
-  // TODO get 'bus' and 'addr' (DONE)
-  return mgos_i2c_read_reg_n(bus, BME68X_I2C_ADDR_LOW, reg_addr, length, reg_data) ? 0 : -1;
+int mgos_bme68x_signal_from_sensor_id(uint8_t sensor_id) {
+  switch (sensor_id) {
+    case BSEC_OUTPUT_IAQ:
+      return MGOS_BME68X_SIG_IAQ;
+    case BSEC_OUTPUT_CO2_EQUIVALENT:
+      return MGOS_BME68X_SIG_CO2;
+    case BSEC_OUTPUT_BREATH_VOC_EQUIVALENT:
+      return MGOS_BME68X_SIG_VOC;
+    case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE:
+      return MGOS_BME68X_SIG_TEMP;
+    case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY:
+      return MGOS_BME68X_SIG_RH;
+    case BSEC_OUTPUT_RAW_PRESSURE:
+      return MGOS_BME68X_SIG_PS;
+    case BSEC_OUTPUT_RAW_GAS:
+      return MGOS_BME68X_SIG_GAS;
+  }
+  return -1;
 }
 
-static BME68X_INTF_RET_TYPE bme68x_i2c_write(uint8_t reg_addr, const uint8_t *reg_data, uint32_t length, void *intf_ptr)
-{
-  (void)intf_ptr;   // Suppress compiler warning
-  // TODO check bus
-  struct mgos_i2c *bus = mgos_i2c_get_bus(BME68X_I2C_ADDR_LOW); 
-  // TODO get 'bus' and 'addr' (DONE)
-  return mgos_i2c_write_reg_n(bus, BME68X_I2C_ADDR_LOW, reg_addr, length, reg_data) ? 0 : -1;
+const char *mgos_bme68x_signal_name(enum mgos_bme68x_signal sig) {
+  if (sig >= MGOS_BME68X_SIG_MAX) return "";
+  return s_signal_names[sig];
 }
 
-/* TODO remove this 
-static int8_t bme68x_i2c_write(uint8_t dev_id, uint8_t reg_addr, uint8_t *data, uint16_t len)
-{
-  struct mgos_i2c *bus = mgos_i2c_get_bus(dev_id >> 1);
-  int addr = BME68X_I2C_ADDR_LOW + (dev_id & 1);
-  return mgos_i2c_write_reg_n(bus, addr, reg_addr, len, data) ? 0 : -1;
+int mgos_bme68x_signal_from_name(const char *name, size_t len) {
+  for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+    if (strlen(s_signal_names[i]) == len &&
+        strncmp(s_signal_names[i], name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void mgos_bsec_timer_cb(void *arg);
+static void mgos_bsec_meas_req_fail_all(void);
+
+void mgos_bsec_lock(void) {
+  if (s_state == NULL) return;
+  mgos_rlock(s_state->bsec_lock);
 }
-*/
 
-static void bme68x_delay_us(uint32_t period, void *intf_ptr) {
-  mgos_msleep(period * 1000);
-  (void)intf_ptr;               // Suppress compiler warning
+void mgos_bsec_unlock(void) {
+  if (s_state == NULL) return;
+  mgos_runlock(s_state->bsec_lock);
 }
 
 bsec_library_return_t mgos_bsec_set_configuration_from_file(const char *file) {
@@ -111,8 +205,10 @@ bsec_library_return_t mgos_bsec_save_state_to_file(const char *file) {
   uint8_t state[BSEC_MAX_STATE_BLOB_SIZE] = {0};
   uint8_t work_buffer[BSEC_MAX_PROPERTY_BLOB_SIZE] = {0};
   uint32_t size = 0;
+  mgos_bsec_lock();
   ret = bsec_get_state(0, state, sizeof(state), work_buffer,
                        sizeof(work_buffer), &size);
+  mgos_bsec_unlock();
   if (ret != BSEC_OK) return ret;
   FILE *f = fopen(file, "w");
   if (f == NULL) return BSEC_E_CONFIG_FAIL;
@@ -129,58 +225,500 @@ void mgos_bsec_set_input_heat_source_value(float value) {
   s_state->input_heat_source_value = value;
 }
 
-static bsec_library_return_t mgos_bsec_set_iaq_sample_rate_int(float sr) {
-  bsec_sensor_configuration_t rvs[] = {
-      {.sensor_id = BSEC_OUTPUT_IAQ, .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_STATIC_IAQ, .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_CO2_EQUIVALENT, .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_BREATH_VOC_EQUIVALENT, .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_STABILIZATION_STATUS, .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_RUN_IN_STATUS, .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_RAW_GAS, .sample_rate = sr},
-  };
-  uint8_t num_rss = BSEC_MAX_PHYSICAL_SENSOR;
-  bsec_sensor_configuration_t rss[BSEC_MAX_PHYSICAL_SENSOR];
-  return bsec_update_subscription(rvs, ARRAY_SIZE(rvs), rss, &num_rss);
+// Virtual sensors subscribed for each of the multiplexed sensors.
+static const uint8_t s_iaq_ids[] = {
+    BSEC_OUTPUT_IAQ,
+    BSEC_OUTPUT_STATIC_IAQ,
+    BSEC_OUTPUT_CO2_EQUIVALENT,
+    BSEC_OUTPUT_BREATH_VOC_EQUIVALENT,
+    BSEC_OUTPUT_STABILIZATION_STATUS,
+    BSEC_OUTPUT_RUN_IN_STATUS,
+    BSEC_OUTPUT_RAW_GAS,
+};
+// IAQ outputs that support ULP plus (on-demand) measurements.
+static const uint8_t s_iaq_on_demand_ids[] = {
+    BSEC_OUTPUT_IAQ,
+    BSEC_OUTPUT_STATIC_IAQ,
+    BSEC_OUTPUT_CO2_EQUIVALENT,
+    BSEC_OUTPUT_BREATH_VOC_EQUIVALENT,
+};
+static const uint8_t s_temp_ids[] = {
+    BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE,
+    BSEC_OUTPUT_RAW_TEMPERATURE,
+};
+static const uint8_t s_rh_ids[] = {
+    BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY,
+    BSEC_OUTPUT_RAW_HUMIDITY,
+};
+static const uint8_t s_ps_ids[] = {
+    BSEC_OUTPUT_RAW_PRESSURE,
 };
 
-bsec_library_return_t mgos_bsec_set_iaq_sample_rate(float sr) {
-  bsec_library_return_t ret = mgos_bsec_set_iaq_sample_rate_int(sr);
-  if (ret == BSEC_OK) {
-    s_state->prev_iaq_sr = sr;
+static const struct {
+  const uint8_t *ids;
+  uint8_t num_ids;
+  const char *name;
+} s_sensors[MGOS_BSEC_SENSOR_MAX] = {
+    [MGOS_BSEC_SENSOR_IAQ] = {s_iaq_ids, ARRAY_SIZE(s_iaq_ids), "IAQ"},
+    [MGOS_BSEC_SENSOR_TEMP] = {s_temp_ids, ARRAY_SIZE(s_temp_ids), "temp"},
+    [MGOS_BSEC_SENSOR_RH] = {s_rh_ids, ARRAY_SIZE(s_rh_ids), "RH"},
+    [MGOS_BSEC_SENSOR_PS] = {s_ps_ids, ARRAY_SIZE(s_ps_ids), "pressure"},
+};
+
+static int mgos_bsec_sensor_of(uint8_t sensor_id) {
+  for (int s = 0; s < MGOS_BSEC_SENSOR_MAX; s++) {
+    for (int i = 0; i < s_sensors[s].num_ids; i++) {
+      if (s_sensors[s].ids[i] == sensor_id) return s;
+    }
+  }
+  return -1;
+}
+
+static bool mgos_bsec_sr_enabled(float sr) {
+  return (sr > 0 && sr != BSEC_SAMPLE_RATE_DISABLED);
+}
+
+// Smallest rate supported by BSEC that satisfies the requested rate.
+static float mgos_bsec_sr_quantize(float sr) {
+  if (!mgos_bsec_sr_enabled(sr)) return BSEC_SAMPLE_RATE_DISABLED;
+  if (sr <= BSEC_SAMPLE_RATE_ULP * 1.01f) return BSEC_SAMPLE_RATE_ULP;
+  if (sr <= BSEC_SAMPLE_RATE_LP * 1.01f) return BSEC_SAMPLE_RATE_LP;
+  return BSEC_SAMPLE_RATE_CONT;
+}
+
+void mgos_bsec_subscription_init(struct mgos_bsec_subscription *sub) {
+  memset(sub, 0, sizeof(*sub));
+}
+
+bool mgos_bsec_subscription_add(struct mgos_bsec_subscription *sub,
+                                uint8_t sensor_id, float sr) {
+  for (uint8_t i = 0; i < sub->num_rvs; i++) {
+    if (sub->rvs[i].sensor_id == sensor_id) {
+      sub->rvs[i].sample_rate = sr;
+      return true;
+    }
+  }
+  if (sub->num_rvs >= ARRAY_SIZE(sub->rvs)) return false;
+  sub->rvs[sub->num_rvs].sensor_id = sensor_id;
+  sub->rvs[sub->num_rvs].sample_rate = sr;
+  sub->num_rvs++;
+  return true;
+}
+
+bsec_library_return_t mgos_bsec_subscription_commit(
+    struct mgos_bsec_subscription *sub) {
+  if (sub->num_rvs == 0) return BSEC_OK;
+  int64_t start = mgos_uptime_micros();
+  sub->num_rss = BSEC_MAX_PHYSICAL_SENSOR;
+  mgos_bsec_lock();
+  bsec_library_return_t ret = bsec_update_subscription(
+      sub->rvs, sub->num_rvs, sub->rss, &sub->num_rss);
+  mgos_bsec_unlock();
+  uint32_t took = (uint32_t)(mgos_uptime_micros() - start);
+  if (s_state != NULL) {
+    struct mgos_bsec_subscription_stats *st = &s_state->sub_stats;
+    st->num_commits++;
+    st->num_sensors += sub->num_rvs;
+    st->last_us = took;
+    st->total_us += took;
+    if (took > st->max_us) st->max_us = took;
+    if (ret == BSEC_OK) {
+      memcpy(s_state->rss, sub->rss, sub->num_rss * sizeof(sub->rss[0]));
+      s_state->num_rss = sub->num_rss;
+    } else {
+      st->num_errors++;
+    }
   }
+  mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS,
+                    MGOS_BME68X_TRACE_OP_SUBSCRIPTION, sub->num_rvs, ret, took);
+  MGOS_BME68X_LOG(LL_DEBUG,
+                  ("BSEC subscription: %d virtual, %d physical, %d, %u us",
+                   sub->num_rvs, sub->num_rss, ret, (unsigned) took));
   return ret;
 }
 
+const bsec_sensor_configuration_t *mgos_bsec_get_required_sensor_settings(
+    uint8_t *num) {
+  *num = 0;
+  if (s_state == NULL) return NULL;
+  *num = s_state->num_rss;
+  return s_state->rss;
+}
+
+void mgos_bsec_get_subscription_stats(
+    struct mgos_bsec_subscription_stats *stats) {
+  if (s_state == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  *stats = s_state->sub_stats;
+}
+
+// Recompute subscription from the requests of all the clients.
+// BSEC is subscribed at the highest rate anyone needs, clients that want
+// less get decimated outputs. All the changes are committed at once.
+static bsec_library_return_t mgos_bsec_rate_update(void) {
+  float new_sr[MGOS_BSEC_SENSOR_MAX];
+  struct mgos_bsec_subscription sub;
+  mgos_bsec_subscription_init(&sub);
+  for (int s = 0; s < MGOS_BSEC_SENSOR_MAX; s++) {
+    float want = 0;
+    bool primary = false;
+    struct mgos_bsec_rate_client *c;
+    SLIST_FOREACH(c, &s_state->rate_clients, next) {
+      if (!mgos_bsec_sr_enabled(c->sr[s])) continue;
+      if (c->sr[s] > want) want = c->sr[s];
+      if (!c->boost) primary = true;
+    }
+    new_sr[s] = mgos_bsec_sr_quantize(primary ? want : 0);
+    if (new_sr[s] == s_state->sub_sr[s]) continue;
+    for (int i = 0; i < s_sensors[s].num_ids; i++) {
+      mgos_bsec_subscription_add(&sub, s_sensors[s].ids[i], new_sr[s]);
+    }
+  }
+  if (sub.num_rvs == 0) return BSEC_OK;
+  bsec_library_return_t ret = mgos_bsec_subscription_commit(&sub);
+  if (ret != BSEC_OK) {
+    LOG(LL_ERROR, ("Failed to update subscription: %d", ret));
+    return ret;
+  }
+  for (int s = 0; s < MGOS_BSEC_SENSOR_MAX; s++) {
+    if (new_sr[s] == s_state->sub_sr[s]) continue;
+    MGOS_BME68X_LOG(LL_DEBUG,
+                    ("%s sample rate %.5f -> %.5f", s_sensors[s].name,
+                     s_state->sub_sr[s], new_sr[s]));
+    s_state->sub_sr[s] = new_sr[s];
+  }
+  if (!mgos_bsec_sr_enabled(s_state->sub_sr[MGOS_BSEC_SENSOR_IAQ])) {
+    mgos_bsec_meas_req_fail_all();
+  }
+  return BSEC_OK;
+}
+
+struct mgos_bsec_rate_client *mgos_bsec_rate_client_create_int(
+    const char *name, bool boost, mgos_bsec_output_cb_t cb, void *arg) {
+  if (s_state == NULL) return NULL;
+  struct mgos_bsec_rate_client *c =
+      (struct mgos_bsec_rate_client *) calloc(1, sizeof(*c));
+  if (c == NULL) return NULL;
+  c->name = name;
+  c->boost = boost;
+  c->cb = cb;
+  c->arg = arg;
+  for (int s = 0; s < MGOS_BSEC_SENSOR_MAX; s++) {
+    c->sr[s] = BSEC_SAMPLE_RATE_DISABLED;
+  }
+  SLIST_INSERT_HEAD(&s_state->rate_clients, c, next);
+  return c;
+}
+
+struct mgos_bsec_rate_client *mgos_bsec_rate_client_create(
+    const char *name, mgos_bsec_output_cb_t cb, void *arg) {
+  return mgos_bsec_rate_client_create_int(name, false /* boost */, cb, arg);
+}
+
+bsec_library_return_t mgos_bsec_rate_client_set(
+    struct mgos_bsec_rate_client *c, enum mgos_bsec_sensor sensor, float sr) {
+  if (c == NULL || sensor >= MGOS_BSEC_SENSOR_MAX) return BSEC_E_CONFIG_FAIL;
+  c->sr[sensor] = sr;
+  c->last_ts[sensor] = 0;
+  return mgos_bsec_rate_update();
+}
+
+void mgos_bsec_rate_client_free(struct mgos_bsec_rate_client *c) {
+  if (c == NULL) return;
+  SLIST_REMOVE(&s_state->rate_clients, c, mgos_bsec_rate_client, next);
+  free(c);
+  mgos_bsec_rate_update();
+}
+
+float mgos_bsec_get_sample_rate(enum mgos_bsec_sensor sensor) {
+  if (s_state == NULL || sensor >= MGOS_BSEC_SENSOR_MAX) {
+    return BSEC_SAMPLE_RATE_DISABLED;
+  }
+  return s_state->sub_sr[sensor];
+}
+
+int mgos_bsec_predict_wakeups(int64_t *ts, int n) {
+  if (s_state == NULL) return 0;
+  float sr = 0;
+  for (int s = 0; s < MGOS_BSEC_SENSOR_MAX; s++) {
+    if (mgos_bsec_sr_enabled(s_state->sub_sr[s]) && s_state->sub_sr[s] > sr) {
+      sr = s_state->sub_sr[s];
+    }
+  }
+  if (sr <= 0) return 0;
+  int64_t period = (int64_t)(1e9f / sr);
+  for (int i = 0; i < n; i++) ts[i] = s_state->next_ts + i * period;
+  return n;
+}
+
+static bsec_library_return_t mgos_bsec_set_cfg_sample_rate(
+    enum mgos_bsec_sensor sensor, float sr) {
+  if (s_state == NULL) return BSEC_E_CONFIG_FAIL;
+  return mgos_bsec_rate_client_set(s_state->cfg_client, sensor, sr);
+}
+
+bsec_library_return_t mgos_bsec_set_iaq_sample_rate(float sr) {
+  return mgos_bsec_set_cfg_sample_rate(MGOS_BSEC_SENSOR_IAQ, sr);
+}
+
 bsec_library_return_t mgos_bsec_set_temp_sample_rate(float sr) {
-  bsec_sensor_configuration_t rvs[] = {
-      {.sensor_id = BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE,
-       .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_RAW_TEMPERATURE, .sample_rate = sr},
-  };
-  uint8_t num_rss = BSEC_MAX_PHYSICAL_SENSOR;
-  bsec_sensor_configuration_t rss[BSEC_MAX_PHYSICAL_SENSOR];
-  return bsec_update_subscription(rvs, ARRAY_SIZE(rvs), rss, &num_rss);
+  return mgos_bsec_set_cfg_sample_rate(MGOS_BSEC_SENSOR_TEMP, sr);
 }
 
 bsec_library_return_t mgos_bsec_set_rh_sample_rate(float sr) {
-  bsec_sensor_configuration_t rvs[] = {
-      {.sensor_id = BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY,
-       .sample_rate = sr},
-      {.sensor_id = BSEC_OUTPUT_RAW_HUMIDITY, .sample_rate = sr},
-  };
-  uint8_t num_rss = BSEC_MAX_PHYSICAL_SENSOR;
-  bsec_sensor_configuration_t rss[BSEC_MAX_PHYSICAL_SENSOR];
-  return bsec_update_subscription(rvs, ARRAY_SIZE(rvs), rss, &num_rss);
+  return mgos_bsec_set_cfg_sample_rate(MGOS_BSEC_SENSOR_RH, sr);
 }
 
 bsec_library_return_t mgos_bsec_set_ps_sample_rate(float sr) {
-  bsec_sensor_configuration_t rvs[] = {
-      {.sensor_id = BSEC_OUTPUT_RAW_PRESSURE, .sample_rate = sr},
-  };
-  uint8_t num_rss = BSEC_MAX_PHYSICAL_SENSOR;
-  bsec_sensor_configuration_t rss[BSEC_MAX_PHYSICAL_SENSOR];
-  return bsec_update_subscription(rvs, ARRAY_SIZE(rvs), rss, &num_rss);
+  return mgos_bsec_set_cfg_sample_rate(MGOS_BSEC_SENSOR_PS, sr);
+}
+
+// Deliver outputs to rate clients, each at its own rate.
+static void mgos_bsec_rate_dispatch(const struct mgos_bsec_output *out) {
+  int64_t ts[MGOS_BSEC_SENSOR_MAX] = {0};
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    int s = mgos_bsec_sensor_of(out->outputs[i].sensor_id);
+    if (s >= 0) ts[s] = out->outputs[i].time_stamp;
+  }
+  struct mgos_bsec_rate_client *c;
+  SLIST_FOREACH(c, &s_state->rate_clients, next) {
+    c->due = 0;
+    if (c->cb == NULL) continue;
+    for (int s = 0; s < MGOS_BSEC_SENSOR_MAX; s++) {
+      if (ts[s] == 0 || !mgos_bsec_sr_enabled(c->sr[s])) continue;
+      // Allow half of the subscribed period of jitter.
+      int64_t period = (int64_t)(1e9f / c->sr[s]);
+      int64_t slack = (int64_t)(0.5e9f / s_state->sub_sr[s]);
+      if (c->last_ts[s] != 0 && ts[s] - c->last_ts[s] < period - slack) {
+        continue;
+      }
+      c->last_ts[s] = ts[s];
+      c->due |= (1 << s);
+    }
+  }
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    int s = mgos_bsec_sensor_of(o->sensor_id);
+    if (s < 0) continue;
+    struct mgos_bsec_rate_client *tc;
+    SLIST_FOREACH_SAFE(c, &s_state->rate_clients, next, tc) {
+      if (c->due & (1 << s)) c->cb(o, c->arg);
+    }
+  }
+}
+
+// BSEC timestamp corresponding to |now| (uptime).
+static int64_t mgos_bsec_ts_at(int64_t now) {
+  int64_t ts = s_state->next_ts;
+  if (s_state->next_due_us > now) ts -= (s_state->next_due_us - now) * 1000;
+  return ts;
+}
+
+// Run the next cycle as soon as possible.
+static void mgos_bsec_wake(void) {
+  if (mgos_bme68x_task_wake()) return;
+  // If a measurement is in progress, we'll be back once it's done.
+  if (s_state->meas_timer_id != MGOS_INVALID_TIMER_ID) return;
+  mgos_clear_timer(s_state->bsec_timer_id);
+  s_state->bsec_timer_id = mgos_set_timer(0, 0, mgos_bsec_timer_cb, NULL);
+}
+
+// Removes |r| and delivers the result, |out| is NULL if the request failed.
+static void mgos_bsec_meas_req_done(struct mgos_bsec_meas_req *r,
+                                    const struct mgos_bsec_output *out) {
+  SLIST_REMOVE(&s_state->meas_reqs, r, mgos_bsec_meas_req, next);
+  mgos_clear_timer(r->timer_id);
+  int64_t now = mgos_uptime_micros();
+  uint32_t latency_ms = (uint32_t)((now - r->start_us) / 1000);
+  if (out != NULL) {
+    LOG(LL_INFO,
+        ("Requested measurement done in %u ms", (unsigned) latency_ms));
+  } else {
+    LOG(LL_ERROR,
+        ("Requested measurement failed after %u ms", (unsigned) latency_ms));
+  }
+  r->cb(out, latency_ms, r->arg);
+  free(r);
+}
+
+static void mgos_bsec_meas_req_timer_cb(void *arg) {
+  struct mgos_bsec_meas_req *r = (struct mgos_bsec_meas_req *) arg;
+  r->timer_id = MGOS_INVALID_TIMER_ID;
+  mgos_bsec_meas_req_done(r, NULL);
+}
+
+static void mgos_bsec_meas_req_fail_all(void) {
+  while (!SLIST_EMPTY(&s_state->meas_reqs)) {
+    mgos_bsec_meas_req_done(SLIST_FIRST(&s_state->meas_reqs), NULL);
+  }
+}
+
+bsec_library_return_t mgos_bsec_request_measurement(
+    mgos_bsec_measurement_cb_t cb, void *arg) {
+  if (s_state == NULL || cb == NULL) return BSEC_E_CONFIG_FAIL;
+  float sr = s_state->sub_sr[MGOS_BSEC_SENSOR_IAQ];
+  if (!mgos_bsec_sr_enabled(sr)) return BSEC_E_CONFIG_FAIL;
+  struct mgos_bsec_meas_req *r =
+      (struct mgos_bsec_meas_req *) calloc(1, sizeof(*r));
+  if (r == NULL) return BSEC_E_CONFIG_FAIL;
+  r->cb = cb;
+  r->arg = arg;
+  r->start_us = mgos_uptime_micros();
+  bool on_demand = (sr == BSEC_SAMPLE_RATE_ULP);
+  bsec_library_return_t ret = BSEC_OK;
+  mgos_bsec_lock();
+  r->min_ts = mgos_bsec_ts_at(r->start_us);
+  if (on_demand) {
+    // Rate stays at ULP, BSEC adds a single measurement.
+    struct mgos_bsec_subscription sub;
+    mgos_bsec_subscription_init(&sub);
+    for (size_t i = 0; i < ARRAY_SIZE(s_iaq_on_demand_ids); i++) {
+      mgos_bsec_subscription_add(&sub, s_iaq_on_demand_ids[i],
+                                 BSEC_SAMPLE_RATE_ULP_MEASUREMENT_ON_DEMAND);
+    }
+    ret = mgos_bsec_subscription_commit(&sub);
+  }
+  if (ret == BSEC_OK) {
+    int timeout_ms = (int)(2000 / sr) + MGOS_BSEC_MEAS_REQ_TIMEOUT_MARGIN_MS;
+    r->timer_id = mgos_set_timer(timeout_ms, 0, mgos_bsec_meas_req_timer_cb, r);
+    SLIST_INSERT_HEAD(&s_state->meas_reqs, r, next);
+    if (on_demand) s_state->early = true;
+  }
+  mgos_bsec_unlock();
+  if (ret != BSEC_OK) {
+    LOG(LL_ERROR, ("On-demand measurement request failed: %d", ret));
+    free(r);
+    return ret;
+  }
+  if (on_demand) mgos_bsec_wake();
+  return BSEC_OK;
+}
+
+static void mgos_bsec_meas_req_dispatch(const struct mgos_bsec_output *out) {
+  if (SLIST_EMPTY(&s_state->meas_reqs)) return;
+  const bsec_output_t *iaq = NULL;
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    if (out->outputs[i].sensor_id == BSEC_OUTPUT_IAQ) iaq = &out->outputs[i];
+  }
+  if (iaq == NULL) return;
+  // Callbacks may change the list, e.g. by disabling IAQ, so restart the
+  // scan after each one.
+  struct mgos_bsec_meas_req *r;
+  do {
+    SLIST_FOREACH(r, &s_state->meas_reqs, next) {
+      if (iaq->time_stamp >= r->min_ts) break;
+    }
+    if (r != NULL) mgos_bsec_meas_req_done(r, out);
+  } while (r != NULL);
+}
+
+const struct mgos_bsec_output *mgos_bsec_get_output(void) {
+  if (s_state == NULL) return NULL;
+  return s_state->cur_out;
+}
+
+bool mgos_bsec_output_is_current(const struct mgos_bsec_output *out,
+                                 uint32_t gen) {
+  __sync_synchronize();
+  return (out != NULL && gen != 0 && out->gen == gen);
+}
+
+void mgos_bsec_output_to_frame(const struct mgos_bsec_output *out,
+                               uint16_t seq,
+                               struct mgos_bme68x_frame_values *v) {
+  memset(v, 0, sizeof(*v));
+  v->seq = seq;
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    int f;
+    switch (o->sensor_id) {
+      case BSEC_OUTPUT_IAQ:
+        f = MGOS_BME68X_FRAME_IAQ;
+        break;
+      case BSEC_OUTPUT_CO2_EQUIVALENT:
+        f = MGOS_BME68X_FRAME_CO2;
+        break;
+      case BSEC_OUTPUT_BREATH_VOC_EQUIVALENT:
+        f = MGOS_BME68X_FRAME_VOC;
+        break;
+      case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE:
+        f = MGOS_BME68X_FRAME_TEMP;
+        break;
+      case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY:
+        f = MGOS_BME68X_FRAME_RH;
+        break;
+      case BSEC_OUTPUT_RAW_PRESSURE:
+        f = MGOS_BME68X_FRAME_PS;
+        break;
+      case BSEC_OUTPUT_RAW_GAS:
+        f = MGOS_BME68X_FRAME_GAS;
+        break;
+      case BSEC_OUTPUT_STATIC_IAQ:
+        f = MGOS_BME68X_FRAME_SIAQ;
+        break;
+      default:
+        continue;
+    }
+    v->present |= (1 << f);
+    v->v[f] = o->signal;
+    v->acc[f] = o->accuracy;
+  }
+}
+
+// Writer side of the sequence lock, never waits for readers.
+static void mgos_bme68x_update_latest(const struct bme68x_data *raw,
+                                      const struct mgos_bsec_output *out) {
+  struct mgos_bme68x_latest *l = &s_state->latest;
+  s_state->latest_seq++;
+  __sync_synchronize();
+  l->gen = out->gen;
+  l->raw = *raw;
+  l->num_outputs = out->num_outputs;
+  memcpy(l->outputs, out->outputs, out->num_outputs * sizeof(l->outputs[0]));
+  __sync_synchronize();
+  s_state->latest_seq++;
+}
+
+bool mgos_bme68x_get_latest(struct mgos_bme68x_latest *latest) {
+  if (s_state == NULL) return false;
+  for (int i = 0; i < MGOS_BME68X_LATEST_MAX_TRIES; i++) {
+    uint32_t seq = s_state->latest_seq;
+    if (seq & 1) continue;
+    __sync_synchronize();
+    memcpy(latest, &s_state->latest, sizeof(*latest));
+    __sync_synchronize();
+    if (s_state->latest_seq == seq) return (latest->gen != 0);
+  }
+  return false;
+}
+
+bool mgos_bsec_add_output_handler(bsec_virtual_sensor_t sensor_id,
+                                  mgos_bsec_output_cb_t cb, void *arg) {
+  if (s_state == NULL || sensor_id >= MGOS_BSEC_NUM_SENSOR_IDS) return false;
+  struct mgos_bsec_output_handler *h =
+      (struct mgos_bsec_output_handler *) calloc(1, sizeof(*h));
+  if (h == NULL) return false;
+  h->cb = cb;
+  h->arg = arg;
+  SLIST_INSERT_HEAD(&s_state->output_handlers[sensor_id], h, next);
+  return true;
+}
+
+bool mgos_bsec_remove_output_handler(bsec_virtual_sensor_t sensor_id,
+                                     mgos_bsec_output_cb_t cb, void *arg) {
+  if (s_state == NULL || sensor_id >= MGOS_BSEC_NUM_SENSOR_IDS) return false;
+  struct mgos_bsec_output_handler *h;
+  SLIST_FOREACH(h, &s_state->output_handlers[sensor_id], next) {
+    if (h->cb == cb && h->arg == arg) {
+      SLIST_REMOVE(&s_state->output_handlers[sensor_id], h,
+                   mgos_bsec_output_handler, next);
+      free(h);
+      return true;
+    }
+  }
+  return false;
 }
 
 bool mgos_bsec_start(void) {
@@ -188,45 +726,53 @@ bool mgos_bsec_start(void) {
     LOG(LL_ERROR, ("BME68X sensor not initialized"));
     return false;
   }
+  if (s_state->cfg.task.enable) {
+    if (mgos_bme68x_task_start(&s_state->cfg.task)) return true;
+    LOG(LL_WARN, ("Failed to start task, using timers"));
+  }
   mgos_bsec_timer_cb(NULL);
   return true;
 }
 
-int8_t mgos_bme68x_init_dev_i2c(struct bme68x_dev *dev, int bus_no, int addr) {
-  dev->intf = BME68X_I2C_INTF;
-  // dev->dev_id = (bus_no << 1) | (addr & 1);
-  dev->read = bme68x_i2c_read;
-  dev->write = bme68x_i2c_write;
-  dev->delay_us = bme68x_delay_us;
-  return bme68x_init(dev);
+static bsec_output_t *mgos_bsec_parsed_field(struct mgos_bsec_output *out,
+                                             uint8_t sensor_id) {
+  if (sensor_id >= MGOS_BSEC_NUM_SENSOR_IDS) return NULL;
+  if (s_parsed_fields[sensor_id] == 0) return NULL;
+  return (bsec_output_t *) ((uint8_t *) out + s_parsed_fields[sensor_id]);
 }
 
-static void mgos_bsec_meas_timer_cb(void *arg) {
+bool mgos_bsec_process(const bsec_bme_settings_t *ss,
+                       struct bme68x_data *data,
+                       struct mgos_bsec_output *out) {
   int8_t bme68x_status;
   uint8_t power_mode = 0;
   uint8_t n_data = 0;
-  const bsec_bme_settings_t *ss = (bsec_bme_settings_t *) arg;
   int64_t ts = ss->next_call;
-  s_state->meas_timer_id = MGOS_INVALID_TIMER_ID;
+  int64_t start = mgos_uptime_micros();
   if (ss->trigger_measurement) {
+    mgos_bme68x_i2c_set_phase(&s_state->dev, MGOS_BME68X_I2C_PHASE_POLL);
     while (power_mode != BME68X_SLEEP_MODE) {         // TODO inspect why we need to in sleep
-      if (bme68x_get_op_mode(&power_mode, &s_state->dev) != 0) return;
+      if (bme68x_get_op_mode(&power_mode, &s_state->dev) != 0) return false;
     }
   }
-  if (ss->process_data == 0) return;
+  if (ss->process_data == 0) return false;
   uint8_t num_inputs = 0;           // TODO check id 'n_data' can be used in place of this
   bsec_input_t inputs[BSEC_MAX_PHYSICAL_SENSOR];
-  static struct bme68x_data data;
   // reading in forced mode
-  bme68x_status = bme68x_get_data(BME68X_FORCED_MODE, &data, &n_data, &s_state->dev);
+  mgos_bme68x_i2c_set_phase(&s_state->dev, MGOS_BME68X_I2C_PHASE_READ);
+  bme68x_status = bme68x_get_data(BME68X_FORCED_MODE, data, &n_data, &s_state->dev);
+  mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS, MGOS_BME68X_TRACE_OP_GET_DATA,
+                    n_data, bme68x_status, data->status);
+  mgos_bme68x_i2c_set_phase(&s_state->dev, MGOS_BME68X_I2C_PHASE_OTHER);
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_READ, start);
   if (bme68x_status != 0) {
     LOG(LL_ERROR, ("Failed to read sensor data: %d", bme68x_status));
-    return;
+    return false;
   }
-  if (data.status & BME68X_NEW_DATA_MSK) {
+  if (data->status & BME68X_NEW_DATA_MSK) {
     if (ss->process_data & BSEC_PROCESS_PRESSURE) {
       inputs[num_inputs].sensor_id = BSEC_INPUT_PRESSURE;
-      inputs[num_inputs].signal = data.pressure;
+      inputs[num_inputs].signal = data->pressure;
       inputs[num_inputs].time_stamp = ts;
       num_inputs++;
     }
@@ -234,9 +780,9 @@ static void mgos_bsec_meas_timer_cb(void *arg) {
       /* Place temperature sample into input struct */
       inputs[num_inputs].sensor_id = BSEC_INPUT_TEMPERATURE;
 #ifdef BME68X_USE_FPU
-      inputs[num_inputs].signal = data.temperature;
+      inputs[num_inputs].signal = data->temperature;
 #else
-      inputs[num_inputs].signal = data.temperature / 100.0f;
+      inputs[num_inputs].signal = data->temperature / 100.0f;
 #endif
       inputs[num_inputs].time_stamp = ts;
       num_inputs++;
@@ -248,102 +794,160 @@ static void mgos_bsec_meas_timer_cb(void *arg) {
     if (ss->process_data & BSEC_PROCESS_HUMIDITY) {
       inputs[num_inputs].sensor_id = BSEC_INPUT_HUMIDITY;
 #ifdef BME68X_USE_FPU
-      inputs[num_inputs].signal = data.humidity;
+      inputs[num_inputs].signal = data->humidity;
 #else
-      inputs[num_inputs].signal = data.humidity / 1000.0f;
+      inputs[num_inputs].signal = data->humidity / 1000.0f;
 #endif
       inputs[num_inputs].time_stamp = ts;
       num_inputs++;
     }
     if (ss->process_data & BSEC_PROCESS_GAS &&
-        data.status & BME68X_GASM_VALID_MSK) {
+        data->status & BME68X_GASM_VALID_MSK) {
       inputs[num_inputs].sensor_id = BSEC_INPUT_GASRESISTOR;
-      inputs[num_inputs].signal = data.gas_resistance;
+      inputs[num_inputs].signal = data->gas_resistance;
       inputs[num_inputs].time_stamp = ts;
       num_inputs++;
     }
   }
   for (uint8_t i = 0; i < num_inputs; i++) {
-    LOG(LL_VERBOSE_DEBUG,
-        ("in : %d %.2f", inputs[i].sensor_id, inputs[i].signal));
+    mgos_bme68x_trace_f(MGOS_BME68X_TRACE_INPUT, inputs[i].sensor_id, 0,
+                        inputs[i].signal);
+    MGOS_BME68X_LOG(LL_VERBOSE_DEBUG,
+                    ("in : %d %.2f", inputs[i].sensor_id, inputs[i].signal));
   }
-  struct mgos_bsec_output ev_arg = {.num_outputs = 0};
-  ev_arg.num_outputs = BSEC_NUMBER_OUTPUTS;
+  // Generation 0 marks the slot as being updated.
+  out->gen = 0;
+  __sync_synchronize();
+  out->num_outputs = BSEC_NUMBER_OUTPUTS;
+  start = mgos_uptime_micros();
   bsec_library_return_t bsec_status =
-      bsec_do_steps(inputs, num_inputs, ev_arg.outputs, &ev_arg.num_outputs);
-  LOG(LL_DEBUG, ("BSEC %lld run: %d inputs, status %d, %d outputs", ts,
-                 num_inputs, bsec_status, ev_arg.num_outputs));
-  for (uint8_t i = 0; i < ev_arg.num_outputs; i++) {
-    const bsec_output_t *out = &ev_arg.outputs[i];
-    LOG(LL_VERBOSE_DEBUG,
-        ("out: %d %.2f %d", out->sensor_id, out->signal, out->accuracy));
-    switch (out->sensor_id) {
-      case BSEC_OUTPUT_IAQ:
-        ev_arg.iaq = *out;
-        break;
-      case BSEC_OUTPUT_CO2_EQUIVALENT:
-        ev_arg.co2 = *out;
-        break;
-      case BSEC_OUTPUT_BREATH_VOC_EQUIVALENT:
-        ev_arg.voc = *out;
-        break;
-      case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE:
-        ev_arg.temp = *out;
-        break;
-      case BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY:
-        ev_arg.rh = *out;
-        break;
-      case BSEC_OUTPUT_RAW_PRESSURE:
-        ev_arg.ps = *out;
-        break;
+      bsec_do_steps(inputs, num_inputs, out->outputs, &out->num_outputs);
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_DO_STEPS, start);
+  mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS, MGOS_BME68X_TRACE_OP_DO_STEPS,
+                    num_inputs, bsec_status, out->num_outputs);
+  MGOS_BME68X_LOG(LL_DEBUG,
+                  ("BSEC %lld run: %d inputs, status %d, %d outputs", ts,
+                   num_inputs, bsec_status, out->num_outputs));
+  return true;
+}
+
+void mgos_bsec_publish(struct mgos_bsec_output *out,
+                       const struct bme68x_data *data) {
+  int64_t start = mgos_uptime_micros();
+  bool parse = s_state->cfg.bsec.output_event;
+  if (parse) {
+    for (uint8_t id = 0; id < MGOS_BSEC_NUM_SENSOR_IDS; id++) {
+      bsec_output_t *f = mgos_bsec_parsed_field(out, id);
+      if (f != NULL) f->time_stamp = 0;
     }
   }
-  if (s_state->cfg.bsec.iaq_auto_cal && ev_arg.iaq.time_stamp > 0) {
-    if (ev_arg.iaq.accuracy < 3 &&
-        s_state->iaq_cal_cycles < MGOS_BME68X_BSEC_MIN_CAL_CYCLES) {
-      if (s_state->iaq_cal_cycles == 0) {
-        if (ev_arg.iaq.accuracy == 2) {
-          LOG(LL_INFO, ("IAQ sensor is calibrating"));
-        } else {
-          LOG(LL_INFO, ("IAQ sensor needs calibration"));
-        }
-        mgos_bsec_set_iaq_sample_rate_int(BSEC_SAMPLE_RATE_LP);
-      }
-      s_state->iaq_cal_cycles = MGOS_BME68X_BSEC_MIN_CAL_CYCLES;
-    }
-    if (ev_arg.iaq.accuracy == 3 && s_state->iaq_cal_cycles > 0) {
-      s_state->iaq_cal_cycles--;
-      if (s_state->iaq_cal_cycles == 0) {
-        LOG(LL_INFO, ("IAQ sensor calibration complete"));
-        mgos_bsec_set_iaq_sample_rate(s_state->prev_iaq_sr);
-      }
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    mgos_bme68x_trace_f(MGOS_BME68X_TRACE_OUTPUT, o->sensor_id, o->accuracy,
+                        o->signal);
+    MGOS_BME68X_LOG(LL_VERBOSE_DEBUG, ("out: %d %.2f %d", o->sensor_id,
+                                       o->signal, o->accuracy));
+    bsec_output_t *f = (parse ? mgos_bsec_parsed_field(out, o->sensor_id)
+                              : NULL);
+    if (f != NULL) *f = *o;
+  }
+  mgos_bsec_cal_update(out);
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_PARSE, start);
+  start = mgos_uptime_micros();
+  if (++s_state->out_gen == 0) s_state->out_gen = 1;
+  out->gen = s_state->out_gen;
+  __sync_synchronize();
+  s_state->cur_out = out;
+  mgos_bme68x_update_latest(data, out);
+  mgos_bme68x_ring_append(out);
+  mgos_bme68x_rollup_update(out);
+  mgos_bme68x_hist_append(out);
+  mgos_bme68x_log_append(out);
+  // Batch first, so that flush on alarm includes the output that caused it.
+  mgos_bme68x_batch_append(out);
+  mgos_bme68x_alarm_update(out);
+  mgos_bme68x_energy_output();
+  mgos_bsec_runin_update(out);
+  mgos_bsec_ratectl_update(out);
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_STORE, start);
+  start = mgos_uptime_micros();
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    if (o->sensor_id >= MGOS_BSEC_NUM_SENSOR_IDS) continue;
+    struct mgos_bsec_output_handler *h, *th;
+    SLIST_FOREACH_SAFE(h, &s_state->output_handlers[o->sensor_id], next, th) {
+      h->cb(o, h->arg);
     }
   }
-  mgos_event_trigger(MGOS_EV_BME68X_BSEC_OUTPUT, &ev_arg);
+  mgos_bsec_rate_dispatch(out);
+  mgos_bsec_meas_req_dispatch(out);
+  if (parse && mgos_bme68x_deadband_check(out)) {
+    mgos_event_trigger(MGOS_EV_BME68X_BSEC_OUTPUT, out);
+  }
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_DISPATCH, start);
+}
+
+struct mgos_bsec_output *mgos_bsec_free_slot(void) {
+  return (s_state->cur_out == &s_state->outputs[0] ? &s_state->outputs[1]
+                                                   : &s_state->outputs[0]);
+}
+
+static void mgos_bsec_meas_timer_cb(void *arg) {
+  const bsec_bme_settings_t *ss = (bsec_bme_settings_t *) arg;
+  static struct bme68x_data data;
+  int64_t start = mgos_uptime_micros();
+  s_state->meas_timer_id = MGOS_INVALID_TIMER_ID;
+  // Fill the slot that is not currently published, readers of the other one
+  // are not disturbed.
+  struct mgos_bsec_output *out = mgos_bsec_free_slot();
+  if (mgos_bsec_process(ss, &data, out)) mgos_bsec_publish(out, &data);
+  mgos_bme68x_energy_awake(start);
+  if (s_state->early) mgos_bsec_wake();
 }
 
-static int mgos_bme68x_run_once(int *delay_ms) {
+int mgos_bme68x_run_once(bsec_bme_settings_t *ss, int *delay_ms,
+                         int *meas_delay_ms) {
   int8_t bme68x_status;
+  *meas_delay_ms = 0;
+  int64_t start = mgos_uptime_micros();
   int64_t ts = s_state->next_ts;
-  static bsec_bme_settings_t ss = {0};
-  bsec_library_return_t ret = bsec_sensor_control(ts, &ss);
-  LOG(LL_DEBUG,
+  if (s_state->early) {
+    ts = mgos_bsec_ts_at(start);
+    s_state->early = false;
+  }
+  int64_t cycle_start = start;
+  bsec_library_return_t ret = bsec_sensor_control(ts, ss);
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_CONTROL, start);
+  mgos_bme68x_trace(
+      MGOS_BME68X_TRACE_CTL, ss->trigger_measurement | (ss->run_gas << 1),
+      ss->heater_temperature, ss->process_data,
+      ss->heater_duration | (ss->temperature_oversampling << 16) |
+          (ss->pressure_oversampling << 20) |
+          ((uint32_t) ss->humidity_oversampling << 24));
+  mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS,
+                    MGOS_BME68X_TRACE_OP_SENSOR_CONTROL, 0, ret,
+                    (uint32_t)((ss->next_call - ts) / 1000000));
+  MGOS_BME68X_LOG(
+      LL_DEBUG,
       ("BSEC %lld ctl: process 0x%x, ht %u dur %u ms, gas %d, po %d, to %d, ho "
        "%d, tm %d, next %lld",
-       ts, (unsigned) ss.process_data, ss.heater_temperature,
-       ss.heater_duration, ss.run_gas, ss.pressure_oversampling,
-       ss.temperature_oversampling, ss.humidity_oversampling,
-       ss.trigger_measurement, ss.next_call));
+       ts, (unsigned) ss->process_data, ss->heater_temperature,
+       ss->heater_duration, ss->run_gas, ss->pressure_oversampling,
+       ss->temperature_oversampling, ss->humidity_oversampling,
+       ss->trigger_measurement, ss->next_call));
   if (ret != BSEC_OK) return ret;
-  s_state->next_ts = ss.next_call;
-  *delay_ms = (ss.next_call - ts) / 1000000;
-  if (ss.trigger_measurement) {
-    s_state->tph_sett.os_hum = ss.humidity_oversampling;
-    s_state->tph_sett.os_pres = ss.pressure_oversampling;
-    s_state->tph_sett.os_temp = ss.temperature_oversampling;
-    s_state->gas_sett.enable = ss.run_gas;
-    s_state->gas_sett.heatr_temp = ss.heater_temperature;
-    s_state->gas_sett.heatr_dur = ss.heater_duration;
+  s_state->next_ts = ss->next_call;
+  s_state->next_due_us = cycle_start + (ss->next_call - ts) / 1000;
+  *delay_ms = (ss->next_call - ts) / 1000000;
+  if (ss->trigger_measurement) {
+    s_state->tph_sett.os_hum = ss->humidity_oversampling;
+    s_state->tph_sett.os_pres = ss->pressure_oversampling;
+    s_state->tph_sett.os_temp = ss->temperature_oversampling;
+    s_state->gas_sett.enable = ss->run_gas;
+    s_state->gas_sett.heatr_temp = ss->heater_temperature;
+    s_state->gas_sett.heatr_dur = ss->heater_duration;
+    start = mgos_uptime_micros();
+    mgos_bme68x_i2c_set_phase(&s_state->dev, MGOS_BME68X_I2C_PHASE_CONTROL);
     bme68x_status = bme68x_set_op_mode(BME68X_FORCED_MODE, &s_state->dev);
     if (bme68x_status != BME68X_OK)
     {
@@ -352,6 +956,12 @@ static int mgos_bme68x_run_once(int *delay_ms) {
     }
   
     bme68x_status = bme68x_set_conf(&s_state->tph_sett, &s_state->dev);
+    if (bme68x_status == BME68X_OK) {
+      bme68x_status = bme68x_set_heatr_conf(
+          BME68X_FORCED_MODE, &s_state->gas_sett, &s_state->dev);
+    }
+    mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS, MGOS_BME68X_TRACE_OP_SET_CONF,
+                      0, bme68x_status, 0);
     // TODO check if we set the correct fields with the new method
     // maybe: BME680_OST_SEL=BME68X_OST_MSK ,BME68X_OSP_SEL=BME68X_OSP_MSK ,
     //        BME68X_OSH_SEL=BME68X_OSH_MSK ,BME68X_GAS_SENSOR_SEL=BME68X_GAS_RANGE_MSK
@@ -363,48 +973,70 @@ static int mgos_bme68x_run_once(int *delay_ms) {
       LOG(LL_ERROR, ("Failed to set BME68X %s: %d", "settings", bme68x_status));
       return -1000;
     }
+    mgos_bme68x_i2c_set_phase(&s_state->dev, MGOS_BME68X_I2C_PHASE_TRIGGER);
     bme68x_status = bme68x_set_op_mode(BME68X_FORCED_MODE, &s_state->dev);
+    mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS,
+                      MGOS_BME68X_TRACE_OP_SET_OP_MODE, BME68X_FORCED_MODE,
+                      bme68x_status, 0);
     if (bme68x_status != BME68X_OK) {
       LOG(LL_ERROR, ("Failed to set BME68X %s: %d", "mode", bme68x_status));
       return -1001;
     }
-    // Gets the meas_period as 's_state->gas_sett.heatr_dur'
-    bme68x_status =  bme68x_get_heatr_conf(&s_state->gas_sett, &s_state->dev);
-    if (bme68x_status != BME68X_OK) {
-      LOG(LL_ERROR, ("Failed to set BME68X %s: %d", "heater duration", bme68x_status));
-      return -1002;
-    }
-    ss.next_call = ts;
-    s_state->meas_timer_id =
-        mgos_set_timer(s_state->gas_sett.heatr_dur, 0, mgos_bsec_meas_timer_cb, &ss);
-  } else {
-    mgos_bsec_meas_timer_cb(&ss);
+    mgos_bme68x_i2c_set_phase(&s_state->dev, MGOS_BME68X_I2C_PHASE_OTHER);
+    uint32_t meas_us = bme68x_get_meas_dur(BME68X_FORCED_MODE,
+                                           &s_state->tph_sett, &s_state->dev);
+    mgos_bme68x_lat_record(MGOS_BME68X_STAGE_CONFIG, start);
+    mgos_bme68x_energy_cycle(ss, meas_us);
+    ss->next_call = ts;
+    *meas_delay_ms = meas_us / 1000 + (ss->run_gas ? ss->heater_duration : 0);
   }
   return BSEC_OK;
 }
 
+bool mgos_bsec_state_save_due(int delay_ms) {
+  const char *sf = s_state->cfg.bsec.state_file;
+  if (sf == NULL || s_state->cfg.bsec.state_save_interval < 0) return false;
+  s_state->state_save_delay_ms += delay_ms;
+  if (s_state->state_save_delay_ms / 1000 <
+      s_state->cfg.bsec.state_save_interval) {
+    return false;
+  }
+  s_state->state_save_delay_ms = 0;
+  return true;
+}
+
+void mgos_bsec_save_state(void) {
+  const char *sf = s_state->cfg.bsec.state_file;
+  int64_t start = mgos_uptime_micros();
+  bsec_library_return_t ret = mgos_bsec_save_state_to_file(sf);
+  mgos_bme68x_lat_record(MGOS_BME68X_STAGE_STATE_SAVE, start);
+  mgos_bme68x_trace(MGOS_BME68X_TRACE_STATUS, MGOS_BME68X_TRACE_OP_STATE_SAVE,
+                    0, ret, 0);
+  if (ret == BSEC_OK) {
+    mgos_bsec_cal_save();
+    LOG(LL_INFO, ("BSEC state saved (%s)", sf));
+  } else {
+    LOG(LL_INFO, ("Failed to save BSEC state (%s): %d", sf, ret));
+  }
+}
+
 static void mgos_bsec_timer_cb(void *arg) {
+  static bsec_bme_settings_t ss;
   s_state->bsec_timer_id = MGOS_INVALID_TIMER_ID;
-  int delay_ms = 0;
-  int ret = mgos_bme68x_run_once(&delay_ms);
+  int delay_ms = 0, meas_delay_ms = 0;
+  int64_t start = mgos_uptime_micros();
+  int ret = mgos_bme68x_run_once(&ss, &delay_ms, &meas_delay_ms);
+  mgos_bme68x_energy_awake(start);
   if (ret != BSEC_OK) {
     LOG(LL_ERROR, ("BSEC run failed: %d", ret));
     delay_ms = 10000;
+  } else if (ss.trigger_measurement) {
+    s_state->meas_timer_id =
+        mgos_set_timer(meas_delay_ms, 0, mgos_bsec_meas_timer_cb, &ss);
+  } else {
+    mgos_bsec_meas_timer_cb(&ss);
   }
-  const char *sf = s_state->cfg.bsec.state_file;
-  if (sf != NULL && s_state->cfg.bsec.state_save_interval >= 0) {
-    s_state->state_save_delay_ms += delay_ms;
-    if (s_state->state_save_delay_ms / 1000 >=
-        s_state->cfg.bsec.state_save_interval) {
-      bsec_library_return_t ret = mgos_bsec_save_state_to_file(sf);
-      if (ret == BSEC_OK) {
-        LOG(LL_INFO, ("BSEC state saved (%s)", sf));
-      } else {
-        LOG(LL_INFO, ("Failed to save BSEC state (%s): %d", sf, ret));
-      }
-      s_state->state_save_delay_ms = 0;
-    }
-  }
+  if (mgos_bsec_state_save_due(delay_ms)) mgos_bsec_save_state();
   s_state->bsec_timer_id =
       mgos_set_timer(delay_ms, 0, mgos_bsec_timer_cb, NULL);
   (void) arg;
@@ -421,6 +1053,7 @@ static float sr_from_str(const char *sr_str) {
 bool mgos_bme68x_bsec_init(void) {
   bsec_version_t v;
   bsec_library_return_t ret;
+  int64_t start = mgos_uptime_micros();
   if (bsec_init() != BSEC_OK || bsec_get_version(&v) != BSEC_OK) {
     LOG(LL_ERROR, ("BSEC init failed"));
     return false;
@@ -448,29 +1081,29 @@ bool mgos_bme68x_bsec_init(void) {
     }
   }
 
-  float iaq_sr = sr_from_str(s_state->cfg.bsec.iaq_sample_rate);
-  if ((ret = mgos_bsec_set_iaq_sample_rate(iaq_sr)) != BSEC_OK) {
-    LOG(LL_ERROR, ("Failed to set %s sample rate: %d", "IAQ", ret));
-    return false;
+  s_state->cfg_client = mgos_bsec_rate_client_create("config", NULL, NULL);
+  if (s_state->cfg_client == NULL) return false;
+  if (s_state->cfg.bsec.iaq_auto_cal &&
+      !mgos_bsec_cal_init(&s_state->cfg.bsec.cal)) {
+    LOG(LL_ERROR, ("Invalid calibration config"));
   }
-
+  if (!mgos_bsec_runin_init(s_state->cfg.bsec.fast_start)) return false;
+  // Set all the configured rates first and subscribe once.
+  struct mgos_bsec_rate_client *cc = s_state->cfg_client;
+  float iaq_sr = sr_from_str(s_state->cfg.bsec.iaq_sample_rate);
   float temp_sr = sr_from_str(s_state->cfg.bsec.temp_sample_rate);
-  if ((ret = mgos_bsec_set_temp_sample_rate(temp_sr)) != BSEC_OK) {
-    LOG(LL_ERROR, ("Failed to set %s sample rate: %d", "temp", ret));
-    return false;
-  }
-
   float rh_sr = sr_from_str(s_state->cfg.bsec.rh_sample_rate);
-  if ((ret = mgos_bsec_set_rh_sample_rate(rh_sr)) != BSEC_OK) {
-    LOG(LL_ERROR, ("Failed to set %s sample rate: %d", "RH", ret));
-    return false;
-  }
-
   float ps_sr = sr_from_str(s_state->cfg.bsec.ps_sample_rate);
-  if ((ret = mgos_bsec_set_ps_sample_rate(ps_sr)) != BSEC_OK) {
-    LOG(LL_ERROR, ("Failed to set %s sample rate: %d", "pressure", ret));
+  cc->sr[MGOS_BSEC_SENSOR_IAQ] = iaq_sr;
+  cc->sr[MGOS_BSEC_SENSOR_TEMP] = temp_sr;
+  cc->sr[MGOS_BSEC_SENSOR_RH] = rh_sr;
+  cc->sr[MGOS_BSEC_SENSOR_PS] = ps_sr;
+  if ((ret = mgos_bsec_rate_update()) != BSEC_OK) {
     return false;
   }
+  LOG(LL_INFO, ("BSEC init done in %u ms, subscription %u us",
+                (unsigned) ((mgos_uptime_micros() - start) / 1000),
+                (unsigned) s_state->sub_stats.total_us));
 
   if (iaq_sr != BSEC_SAMPLE_RATE_DISABLED ||
       temp_sr != BSEC_SAMPLE_RATE_DISABLED ||
@@ -486,20 +1119,71 @@ bool mgos_bme68x_init_cfg(const struct mgos_config_bme68x *cfg) {
 
   s_state = (struct mgos_bme68x_state *) calloc(1, sizeof(*s_state));
   if (s_state == NULL) return false;
-  s_state->prev_iaq_sr = BSEC_SAMPLE_RATE_DISABLED;
+  for (int i = 0; i < MGOS_BSEC_SENSOR_MAX; i++) {
+    s_state->sub_sr[i] = BSEC_SAMPLE_RATE_DISABLED;
+  }
   s_state->cfg = *cfg;
+  s_state->bsec_lock = mgos_rlock_create();
 
-  int8_t bme68x_status =
-      mgos_bme68x_init_dev_i2c(&s_state->dev, cfg->i2c_bus, cfg->i2c_addr);
+  int8_t bme68x_status = mgos_bme68x_i2c_init_dev(
+      &s_state->dev, cfg->i2c_bus, cfg->i2c_addr, cfg->i2c_retries, true);
 
   LOG(LL_INFO, ("BME68x @ %d/0x%x init %s", cfg->i2c_bus, cfg->i2c_addr,
                 (bme68x_status == BME68X_OK ? "ok" : "failed")));
   if (bme68x_status != BME68X_OK) return false;
 
+  mgos_bme68x_i2c_stats_log_start(cfg->i2c_stats_interval);
+
+  if (cfg->trace_size > 0 && !mgos_bme68x_trace_init(cfg->trace_size)) {
+    LOG(LL_ERROR, ("Failed to allocate trace"));
+  }
+
+  if (cfg->latency_hist && !mgos_bme68x_lat_init()) {
+    LOG(LL_ERROR, ("Failed to allocate latency histograms"));
+  }
+
   if (cfg->bsec.enable && !mgos_bme68x_bsec_init()) {
     return false;
   }
 
+  if (cfg->ring_size > 0 && !mgos_bme68x_ring_init(cfg->ring_size)) {
+    LOG(LL_ERROR, ("Failed to allocate history ring"));
+  }
+
+  if (cfg->rollup.enable && !mgos_bme68x_rollup_init(&cfg->rollup)) {
+    LOG(LL_ERROR, ("Failed to allocate rollups"));
+  }
+
+  if (cfg->hist.enable && !mgos_bme68x_hist_init(&cfg->hist)) {
+    LOG(LL_ERROR, ("Failed to init compressed history"));
+  }
+
+  if (cfg->log.enable && !mgos_bme68x_log_init(&cfg->log)) {
+    LOG(LL_ERROR, ("Failed to init flash log"));
+  }
+
+  if (cfg->deadband.enable && !mgos_bme68x_deadband_init(&cfg->deadband)) {
+    LOG(LL_ERROR, ("Invalid deadband config"));
+  }
+
+  if (cfg->alarm.enable && !mgos_bme68x_alarm_init(&cfg->alarm)) {
+    LOG(LL_ERROR, ("Invalid alarm config"));
+  }
+
+  if (cfg->batch.enable && !mgos_bme68x_batch_init(&cfg->batch)) {
+    LOG(LL_ERROR, ("Failed to init batching"));
+  }
+
+  if (cfg->energy.enable && !mgos_bme68x_energy_init(&cfg->energy)) {
+    LOG(LL_ERROR, ("Invalid energy config"));
+  }
+
+  if (cfg->ratectl.enable && !mgos_bsec_ratectl_init(&cfg->ratectl)) {
+    LOG(LL_ERROR, ("Invalid rate controller config"));
+  }
+
+  if (cfg->rpc_enable) mgos_bme68x_rpc_init();
+
   return true;
 }
 
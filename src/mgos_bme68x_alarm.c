@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Alarm rules. Rules are parsed once at init into a flat array and
+// evaluated for every output, the event is only triggered on transitions.
+//
+// Rule syntax: name=signal[.rate](>|<)threshold[,hyst=X][,hold=S]
+//  - rate: rate of change per minute instead of the value,
+//  - hyst: alarm clears only once the value is back beyond threshold -/+ X,
+//  - hold: condition must hold for S seconds before the alarm is raised.
+
+#include "mgos_bme68x_internal.h"
+
+#include <stdlib.h>
+
+#include "mgos.h"
+
+struct mgos_bme68x_alarm_rule {
+  const char *name;
+  uint8_t sig;
+  bool rate;
+  bool above;  // true for >, false for <.
+  float threshold;
+  float hyst;
+  int64_t hold_ns;
+  // State.
+  bool active;
+  int64_t pending_since;  // -1 if the condition is not met.
+  float prev_v;
+  int64_t prev_ts;  // -1 if there is no previous value.
+  float value;
+  int64_t ts;
+};
+
+struct mgos_bme68x_alarms {
+  int num_rules;
+  struct mgos_bme68x_alarm_rule *rules;
+  char *names;
+};
+
+static struct mgos_bme68x_alarms s_alarms;
+
+static bool mgos_bme68x_alarm_parse_rule(char *s,
+                                         struct mgos_bme68x_alarm_rule *r) {
+  char *eq = strchr(s, '=');
+  if (eq == NULL || eq == s) return false;
+  *eq = '\0';
+  r->name = s;
+  s = eq + 1;
+  char *op = strpbrk(s, "<>");
+  if (op == NULL) return false;
+  size_t len = op - s;
+  if (len > 5 && strncmp(op - 5, ".rate", 5) == 0) {
+    r->rate = true;
+    len -= 5;
+  }
+  int sig = mgos_bme68x_signal_from_name(s, len);
+  if (sig < 0) return false;
+  r->sig = sig;
+  r->above = (*op == '>');
+  char *end;
+  r->threshold = strtof(op + 1, &end);
+  if (end == op + 1) return false;
+  while (*end == ',') {
+    s = end + 1;
+    if (strncmp(s, "hyst=", 5) == 0) {
+      r->hyst = strtof(s + 5, &end);
+      if (end == s + 5) return false;
+    } else if (strncmp(s, "hold=", 5) == 0) {
+      r->hold_ns = strtol(s + 5, &end, 10) * 1000000000LL;
+      if (end == s + 5) return false;
+    } else {
+      return false;
+    }
+  }
+  return (*end == '\0');
+}
+
+// Drop spaces, so that rules can be written more readably.
+static void mgos_bme68x_alarm_strip(char *s) {
+  char *d = s;
+  for (; *s != '\0'; s++) {
+    if (*s != ' ') *d++ = *s;
+  }
+  *d = '\0';
+}
+
+bool mgos_bme68x_alarm_init(const struct mgos_config_bme68x_alarm *cfg) {
+  if (cfg->rules == NULL || cfg->rules[0] == '\0') return true;
+  char *names = strdup(cfg->rules);
+  if (names == NULL) return false;
+  mgos_bme68x_alarm_strip(names);
+  int n = 1;
+  for (const char *p = names; *p != '\0'; p++) n += (*p == ';');
+  struct mgos_bme68x_alarm_rule *rules =
+      (struct mgos_bme68x_alarm_rule *) calloc(n, sizeof(*rules));
+  if (rules == NULL) {
+    free(names);
+    return false;
+  }
+  int num_rules = 0;
+  char *s = names;
+  while (s != NULL) {
+    char *next = strchr(s, ';');
+    if (next != NULL) *next++ = '\0';
+    if (*s != '\0') {
+      struct mgos_bme68x_alarm_rule *r = &rules[num_rules];
+      if (!mgos_bme68x_alarm_parse_rule(s, r)) {
+        LOG(LL_ERROR, ("Invalid alarm rule %d", num_rules));
+        free(rules);
+        free(names);
+        return false;
+      }
+      r->pending_since = r->prev_ts = -1;
+      num_rules++;
+    }
+    s = next;
+  }
+  s_alarms.num_rules = num_rules;
+  s_alarms.rules = rules;
+  s_alarms.names = names;
+  LOG(LL_INFO, ("%d alarm rules", num_rules));
+  return true;
+}
+
+static void mgos_bme68x_alarm_get_state(int idx,
+                                        struct mgos_bme68x_alarm_ev *ev) {
+  const struct mgos_bme68x_alarm_rule *r = &s_alarms.rules[idx];
+  ev->idx = idx;
+  ev->name = r->name;
+  ev->sig = (enum mgos_bme68x_signal) r->sig;
+  ev->active = r->active;
+  ev->value = r->value;
+  ev->ts = r->ts;
+}
+
+static void mgos_bme68x_alarm_eval(int idx, float v, int64_t ts) {
+  struct mgos_bme68x_alarm_rule *r = &s_alarms.rules[idx];
+  if (r->rate) {
+    float prev_v = r->prev_v;
+    int64_t prev_ts = r->prev_ts;
+    r->prev_v = v;
+    r->prev_ts = ts;
+    if (prev_ts < 0 || ts <= prev_ts) return;
+    v = (v - prev_v) * 60e9f / (float) (ts - prev_ts);
+  }
+  bool trigger;
+  if (!r->active) {
+    bool cond = (r->above ? v > r->threshold : v < r->threshold);
+    if (!cond) {
+      r->pending_since = -1;
+      return;
+    }
+    if (r->pending_since < 0) r->pending_since = ts;
+    trigger = (ts - r->pending_since >= r->hold_ns);
+  } else {
+    trigger = (r->above ? v < r->threshold - r->hyst
+                        : v > r->threshold + r->hyst);
+    r->pending_since = -1;
+  }
+  if (!trigger) return;
+  r->active = !r->active;
+  r->value = v;
+  r->ts = ts;
+  struct mgos_bme68x_alarm_ev ev;
+  mgos_bme68x_alarm_get_state(idx, &ev);
+  LOG(LL_INFO, ("Alarm %s %s, %s %.2f", r->name,
+                (r->active ? "raised" : "cleared"),
+                mgos_bme68x_signal_name(ev.sig), v));
+  mgos_event_trigger(MGOS_EV_BME68X_ALARM, &ev);
+}
+
+void mgos_bme68x_alarm_update(const struct mgos_bsec_output *out) {
+  if (s_alarms.num_rules == 0) return;
+  float v[MGOS_BME68X_SIG_MAX];
+  uint8_t present = 0;
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    int sig = mgos_bme68x_signal_from_sensor_id(o->sensor_id);
+    if (sig < 0) continue;
+    v[sig] = o->signal;
+    present |= (1 << sig);
+  }
+  if (present == 0) return;
+  int64_t ts = out->outputs[0].time_stamp;
+  for (int i = 0; i < s_alarms.num_rules; i++) {
+    uint8_t sig = s_alarms.rules[i].sig;
+    if (present & (1 << sig)) mgos_bme68x_alarm_eval(i, v[sig], ts);
+  }
+}
+
+int mgos_bme68x_alarm_count(void) {
+  return s_alarms.num_rules;
+}
+
+bool mgos_bme68x_alarm_get(int idx, struct mgos_bme68x_alarm_ev *state) {
+  if (idx < 0 || idx >= s_alarms.num_rules) return false;
+  mgos_bme68x_alarm_get_state(idx, state);
+  return true;
+}
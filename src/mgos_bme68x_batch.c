@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Batching of outputs: samples are accumulated in a buffer allocated at
+// init and delivered with a single MGOS_EV_BME68X_BSEC_BATCH event.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+struct mgos_bme68x_batch {
+  int size;
+  int count;
+  int64_t interval_ns;
+  // Flushes the batch |interval_ns| after its first sample even if no more
+  // outputs arrive, e.g. at ULP.
+  mgos_timer_id timer_id;
+  struct mgos_bme68x_ring_sample *samples;
+};
+
+static struct mgos_bme68x_batch *s_batch;
+
+static void mgos_bme68x_batch_flush(enum mgos_bsec_batch_reason reason) {
+  struct mgos_bme68x_batch *b = s_batch;
+  if (b == NULL || b->count == 0) return;
+  mgos_clear_timer(b->timer_id);
+  b->timer_id = MGOS_INVALID_TIMER_ID;
+  struct mgos_bsec_batch ev = {
+      .reason = reason,
+      .num_samples = b->count,
+      .samples = b->samples,
+  };
+  mgos_event_trigger(MGOS_EV_BME68X_BSEC_BATCH, &ev);
+  b->count = 0;
+}
+
+static void mgos_bme68x_batch_timer_cb(void *arg) {
+  s_batch->timer_id = MGOS_INVALID_TIMER_ID;
+  mgos_bme68x_batch_flush(MGOS_BSEC_BATCH_INTERVAL);
+  (void) arg;
+}
+
+void mgos_bsec_batch_flush(void) {
+  mgos_bme68x_batch_flush(MGOS_BSEC_BATCH_REQUEST);
+}
+
+void mgos_bme68x_batch_append(const struct mgos_bsec_output *out) {
+  struct mgos_bme68x_batch *b = s_batch;
+  if (b == NULL || out->num_outputs == 0) return;
+  int64_t ts = out->outputs[0].time_stamp;
+  if (b->count > 0 && b->interval_ns > 0 &&
+      ts - b->samples[0].ts >= b->interval_ns) {
+    mgos_bme68x_batch_flush(MGOS_BSEC_BATCH_INTERVAL);
+  }
+  mgos_bme68x_sample_from_output(out, &b->samples[b->count++]);
+  if (b->count == 1 && b->interval_ns > 0) {
+    b->timer_id = mgos_set_timer((int)(b->interval_ns / 1000000), 0,
+                                 mgos_bme68x_batch_timer_cb, NULL);
+  }
+  if (b->count == b->size) mgos_bme68x_batch_flush(MGOS_BSEC_BATCH_FULL);
+}
+
+static void mgos_bme68x_batch_alarm_cb(int ev, void *ev_data, void *arg) {
+  mgos_bme68x_batch_flush(MGOS_BSEC_BATCH_ALARM);
+  (void) ev;
+  (void) ev_data;
+  (void) arg;
+}
+
+static void mgos_bme68x_batch_reboot_cb(int ev, void *ev_data, void *arg) {
+  mgos_bme68x_batch_flush(MGOS_BSEC_BATCH_REBOOT);
+  (void) ev;
+  (void) ev_data;
+  (void) arg;
+}
+
+bool mgos_bme68x_batch_init(const struct mgos_config_bme68x_batch *cfg) {
+  if (cfg->size <= 0) return false;
+  struct mgos_bme68x_batch *b = (struct mgos_bme68x_batch *) calloc(
+      1, sizeof(*b) + cfg->size * sizeof(b->samples[0]));
+  if (b == NULL) return false;
+  b->size = cfg->size;
+  b->interval_ns = cfg->interval * 1000000000LL;
+  b->timer_id = MGOS_INVALID_TIMER_ID;
+  b->samples = (struct mgos_bme68x_ring_sample *) (b + 1);
+  if (cfg->flush_on_alarm) {
+    mgos_event_add_handler(MGOS_EV_BME68X_ALARM, mgos_bme68x_batch_alarm_cb,
+                           NULL);
+  }
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, mgos_bme68x_batch_reboot_cb,
+                         NULL);
+  s_batch = b;
+  return true;
+}
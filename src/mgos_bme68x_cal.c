@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// IAQ calibration scheduler (bme68x.bsec.iaq_auto_cal).
+// A boost client forces IAQ to LP while the sensor calibrates.
+// Calibration starts right away when accuracy drops below 2, or once it has
+// stayed below 3 for |enter_hold| seconds, so brief dips are ignored.
+// It is complete after |cycles| samples at accuracy 3: accuracy 2 pauses
+// the count, below 2 restarts it. Progress is saved along with the BSEC
+// state and resumed after reboot.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+struct mgos_bsec_cal {
+  struct mgos_config_bme68x_bsec_cal cfg;
+  struct mgos_bsec_rate_client *client;
+  int64_t low_since;  // -1 if accuracy is 3.
+  int64_t lp_since_us;
+  int64_t day_start_us;
+  uint32_t day_commits_start;  // Subscription commits at the day start.
+  bool dirty;                  // Progress changed since the last save.
+  struct mgos_bsec_cal_stats stats;
+};
+
+static struct mgos_bsec_cal *s_cal;
+
+static uint32_t mgos_bsec_cal_num_commits(void) {
+  struct mgos_bsec_subscription_stats st;
+  mgos_bsec_get_subscription_stats(&st);
+  return st.num_commits;
+}
+
+// Account forced LP time up to |now|.
+static void mgos_bsec_cal_account(struct mgos_bsec_cal *c, int64_t now) {
+  if (!c->stats.calibrating) return;
+  uint32_t ms = (uint32_t)((now - c->lp_since_us) / 1000);
+  c->stats.lp_ms += ms;
+  c->stats.today.lp_ms += ms;
+  c->lp_since_us = now;
+}
+
+static void mgos_bsec_cal_roll_day(struct mgos_bsec_cal *c, int64_t now) {
+  if (now - c->day_start_us < 86400 * 1000000LL) return;
+  mgos_bsec_cal_account(c, now);
+  c->stats.today.sub_commits =
+      mgos_bsec_cal_num_commits() - c->day_commits_start;
+  c->stats.yesterday = c->stats.today;
+  memset(&c->stats.today, 0, sizeof(c->stats.today));
+  c->day_start_us = now;
+  c->day_commits_start = mgos_bsec_cal_num_commits();
+}
+
+static void mgos_bsec_cal_set(struct mgos_bsec_cal *c, bool calibrating) {
+  int64_t now = mgos_uptime_micros();
+  mgos_bsec_cal_account(c, now);
+  c->stats.calibrating = calibrating;
+  c->lp_since_us = now;
+  c->stats.num_switches++;
+  c->stats.today.switches++;
+  c->dirty = true;
+  mgos_bsec_rate_client_set(
+      c->client, MGOS_BSEC_SENSOR_IAQ,
+      (calibrating ? BSEC_SAMPLE_RATE_LP : BSEC_SAMPLE_RATE_DISABLED));
+  // Transitions are rare, save them right away.
+  mgos_bsec_cal_save();
+}
+
+void mgos_bsec_cal_update(const struct mgos_bsec_output *out) {
+  struct mgos_bsec_cal *c = s_cal;
+  if (c == NULL) return;
+  const bsec_output_t *iaq = NULL;
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    if (out->outputs[i].sensor_id == BSEC_OUTPUT_IAQ) iaq = &out->outputs[i];
+  }
+  if (iaq == NULL) return;
+  struct mgos_bsec_cal_stats *st = &c->stats;
+  mgos_bsec_cal_roll_day(c, mgos_uptime_micros());
+  if (iaq->accuracy == 3) {
+    c->low_since = -1;
+  } else if (c->low_since < 0) {
+    c->low_since = iaq->time_stamp;
+  }
+  if (!st->calibrating) {
+    if (iaq->accuracy == 3) return;
+    if (iaq->accuracy >= 2 &&
+        iaq->time_stamp - c->low_since < c->cfg.enter_hold * 1000000000LL) {
+      return;
+    }
+    LOG(LL_INFO, ("IAQ sensor %s", (iaq->accuracy == 2 ? "is calibrating"
+                                                       : "needs calibration")));
+    st->progress = 0;
+    mgos_bsec_cal_set(c, true);
+    return;
+  }
+  if (iaq->accuracy == 3) {
+    st->progress++;
+    c->dirty = true;
+    if (st->progress >= (uint32_t) c->cfg.cycles) {
+      LOG(LL_INFO, ("IAQ sensor calibration complete"));
+      mgos_bsec_cal_set(c, false);
+    }
+  } else if (iaq->accuracy < 2 && st->progress > 0) {
+    st->progress = 0;
+    c->dirty = true;
+  }
+}
+
+void mgos_bsec_cal_save(void) {
+  struct mgos_bsec_cal *c = s_cal;
+  if (c == NULL || !c->dirty || mgos_conf_str_empty(c->cfg.file)) return;
+  if (json_fprintf(c->cfg.file, "{calibrating: %B, progress: %u}",
+                   c->stats.calibrating, (unsigned) c->stats.progress) < 0) {
+    LOG(LL_ERROR, ("Failed to save calibration progress (%s)", c->cfg.file));
+    return;
+  }
+  c->dirty = false;
+}
+
+static void mgos_bsec_cal_load(struct mgos_bsec_cal *c) {
+  if (mgos_conf_str_empty(c->cfg.file)) return;
+  size_t size = 0;
+  char *data = cs_read_file(c->cfg.file, &size);
+  if (data == NULL) return;
+  bool calibrating = false;
+  unsigned int progress = 0;
+  json_scanf(data, size, "{calibrating: %B, progress: %u}", &calibrating,
+             &progress);
+  free(data);
+  if (!calibrating) return;
+  LOG(LL_INFO, ("Resuming IAQ sensor calibration, %u/%d", progress,
+                c->cfg.cycles));
+  c->stats.calibrating = true;
+  c->stats.progress = progress;
+  mgos_bsec_rate_client_set(c->client, MGOS_BSEC_SENSOR_IAQ,
+                            BSEC_SAMPLE_RATE_LP);
+}
+
+bool mgos_bsec_cal_init(const struct mgos_config_bme68x_bsec_cal *cfg) {
+  if (cfg->cycles <= 0 || cfg->enter_hold < 0) return false;
+  struct mgos_bsec_cal *c = (struct mgos_bsec_cal *) calloc(1, sizeof(*c));
+  if (c == NULL) return false;
+  c->cfg = *cfg;
+  c->client = mgos_bsec_rate_client_create_int("calibration",
+                                               true /* boost */, NULL, NULL);
+  if (c->client == NULL) {
+    free(c);
+    return false;
+  }
+  c->low_since = -1;
+  c->lp_since_us = c->day_start_us = mgos_uptime_micros();
+  c->day_commits_start = mgos_bsec_cal_num_commits();
+  mgos_bsec_cal_load(c);
+  s_cal = c;
+  return true;
+}
+
+bool mgos_bsec_get_cal_stats(struct mgos_bsec_cal_stats *stats) {
+  struct mgos_bsec_cal *c = s_cal;
+  if (c == NULL) return false;
+  int64_t now = mgos_uptime_micros();
+  mgos_bsec_cal_roll_day(c, now);
+  mgos_bsec_cal_account(c, now);
+  *stats = c->stats;
+  stats->today.sub_commits =
+      mgos_bsec_cal_num_commits() - c->day_commits_start;
+  return true;
+}
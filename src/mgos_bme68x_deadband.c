@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Deadband filter for MGOS_EV_BME68X_BSEC_OUTPUT: the event is only
+// triggered if a signal moved beyond its band since the last event,
+// accuracy changed or the heartbeat interval has passed.
+// Other consumers (per-output handlers, history) still get every output.
+
+#include "mgos_bme68x_internal.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "mgos.h"
+
+struct mgos_bme68x_deadband {
+  float abs[MGOS_BME68X_SIG_MAX];
+  float rel[MGOS_BME68X_SIG_MAX];
+  int64_t heartbeat_ns;
+  bool accuracy;
+  // Last forwarded output.
+  bool have_last;
+  int64_t last_ts;
+  uint8_t last_present;
+  float last[MGOS_BME68X_SIG_MAX];
+  uint8_t last_acc[MGOS_BME68X_SIG_MAX];
+  struct mgos_bme68x_deadband_stats stats;
+};
+
+static struct mgos_bme68x_deadband *s_db;
+
+// Parses "iaq:5,co2:5%,temp:0.2".
+static bool mgos_bme68x_deadband_parse(const char *s,
+                                       struct mgos_bme68x_deadband *db) {
+  while (s != NULL && *s != '\0') {
+    const char *colon = strchr(s, ':');
+    if (colon == NULL) return false;
+    int sig = mgos_bme68x_signal_from_name(s, colon - s);
+    if (sig < 0) return false;
+    char *end = NULL;
+    float band = strtof(colon + 1, &end);
+    if (end == colon + 1 || band < 0) return false;
+    if (*end == '%') {
+      db->rel[sig] = band / 100.0f;
+      end++;
+    } else {
+      db->abs[sig] = band;
+    }
+    while (*end == ' ') end++;
+    if (*end != ',' && *end != '\0') return false;
+    s = (*end == ',' ? end + 1 : end);
+    while (*s == ' ') s++;
+  }
+  return true;
+}
+
+bool mgos_bme68x_deadband_init(const struct mgos_config_bme68x_deadband *cfg) {
+  struct mgos_bme68x_deadband *db =
+      (struct mgos_bme68x_deadband *) calloc(1, sizeof(*db));
+  if (db == NULL) return false;
+  if (!mgos_bme68x_deadband_parse(cfg->bands, db)) {
+    LOG(LL_ERROR, ("Invalid deadband spec: %s", cfg->bands));
+    free(db);
+    return false;
+  }
+  db->heartbeat_ns = cfg->heartbeat * 1000000000LL;
+  db->accuracy = cfg->accuracy;
+  s_db = db;
+  return true;
+}
+
+static bool mgos_bme68x_deadband_changed(const struct mgos_bme68x_deadband *db,
+                                         const struct mgos_bsec_output *out) {
+  if (!db->have_last) return true;
+  int64_t ts = (out->num_outputs > 0 ? out->outputs[0].time_stamp : 0);
+  if (db->heartbeat_ns > 0 && ts - db->last_ts >= db->heartbeat_ns) {
+    return true;
+  }
+  uint8_t present = 0;
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    int sig = mgos_bme68x_signal_from_sensor_id(o->sensor_id);
+    if (sig < 0) continue;
+    present |= (1 << sig);
+    if (!(db->last_present & (1 << sig))) continue;
+    if (db->accuracy && o->accuracy != db->last_acc[sig]) return true;
+    float last = db->last[sig];
+    float band = db->abs[sig];
+    if (db->rel[sig] * fabsf(last) > band) band = db->rel[sig] * fabsf(last);
+    if (band > 0 && fabsf(o->signal - last) > band) return true;
+  }
+  // Compare only signals that have bands, others may come at lower rates.
+  uint8_t banded = 0;
+  for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+    if (db->abs[i] > 0 || db->rel[i] > 0) banded |= (1 << i);
+  }
+  return ((present & banded) & ~db->last_present) != 0;
+}
+
+bool mgos_bme68x_deadband_check(const struct mgos_bsec_output *out) {
+  struct mgos_bme68x_deadband *db = s_db;
+  if (db == NULL) return true;
+  if (!mgos_bme68x_deadband_changed(db, out)) {
+    db->stats.num_suppressed++;
+    return false;
+  }
+  db->stats.num_forwarded++;
+  db->have_last = true;
+  db->last_ts = (out->num_outputs > 0 ? out->outputs[0].time_stamp : 0);
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    int sig = mgos_bme68x_signal_from_sensor_id(o->sensor_id);
+    if (sig < 0) continue;
+    // Signals not present this time keep their last value.
+    db->last_present |= (1 << sig);
+    db->last[sig] = o->signal;
+    db->last_acc[sig] = o->accuracy;
+  }
+  return true;
+}
+
+bool mgos_bme68x_get_deadband_stats(struct mgos_bme68x_deadband_stats *stats) {
+  if (s_db == NULL) return false;
+  *stats = s_db->stats;
+  return true;
+}
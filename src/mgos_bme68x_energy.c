@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Energy accounting. Only times are accumulated, energy is computed from
+// them and the configured currents when stats are requested.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+#ifndef MGOS_BME68X_ENERGY_MAX_TRIES
+#define MGOS_BME68X_ENERGY_MAX_TRIES 10
+#endif
+
+// Counters updated by the measurement cycle, on the measurement task if it
+// is enabled. They have a single writer and are protected by |cyc_seq|
+// (odd = being updated). Reset records them in |cyc_base| instead of
+// clearing them.
+struct mgos_bme68x_energy_cyc {
+  uint32_t num_cycles;
+  uint64_t heater_us;
+  uint64_t meas_us;
+  uint64_t i2c_us;
+  uint64_t awake_us;  // Host time on the measurement task.
+};
+
+struct mgos_bme68x_energy_state {
+  struct mgos_config_bme68x_energy cfg;
+  volatile uint32_t cyc_seq;
+  struct mgos_bme68x_energy_cyc cyc;
+  uint64_t last_bus_us;  // I2C bus time seen at the previous cycle.
+  // The rest is owned by the main task.
+  struct mgos_bme68x_energy_cyc cyc_base;
+  int64_t start_us;
+  uint32_t num_outputs;
+  uint64_t awake_us;     // Host time on the main task.
+  float prev_output_mj;  // Total at the previous output.
+  float last_output_mj;
+};
+
+static struct mgos_bme68x_energy_state *s_energy;
+
+bool mgos_bme68x_energy_init(const struct mgos_config_bme68x_energy *cfg) {
+  if (cfg->voltage_mv <= 0) return false;
+  struct mgos_bme68x_energy_state *e =
+      (struct mgos_bme68x_energy_state *) calloc(1, sizeof(*e));
+  if (e == NULL) return false;
+  e->cfg = *cfg;
+  e->start_us = mgos_uptime_micros();
+  s_energy = e;
+  return true;
+}
+
+// mV * uA * us = 1e-12 mJ.
+static float mgos_bme68x_energy_mj(int ua, uint64_t us) {
+  return (float) ((double) s_energy->cfg.voltage_mv * ua * us * 1e-12);
+}
+
+// Consistent copy of the cycle counters, not adjusted for reset.
+static bool mgos_bme68x_energy_read_cyc(struct mgos_bme68x_energy_cyc *c) {
+  const struct mgos_bme68x_energy_state *e = s_energy;
+  for (int i = 0; i < MGOS_BME68X_ENERGY_MAX_TRIES; i++) {
+    uint32_t seq = e->cyc_seq;
+    if (seq & 1) continue;
+    __sync_synchronize();
+    *c = e->cyc;
+    __sync_synchronize();
+    if (e->cyc_seq == seq) return true;
+  }
+  return false;
+}
+
+// Cycle counters since the last reset.
+static bool mgos_bme68x_energy_get_cyc(struct mgos_bme68x_energy_cyc *c) {
+  const struct mgos_bme68x_energy_cyc *b = &s_energy->cyc_base;
+  if (!mgos_bme68x_energy_read_cyc(c)) return false;
+  c->num_cycles -= b->num_cycles;
+  c->heater_us -= b->heater_us;
+  c->meas_us -= b->meas_us;
+  c->i2c_us -= b->i2c_us;
+  c->awake_us -= b->awake_us;
+  return true;
+}
+
+static void mgos_bme68x_energy_cyc_begin(struct mgos_bme68x_energy_state *e) {
+  e->cyc_seq++;
+  __sync_synchronize();
+}
+
+static void mgos_bme68x_energy_cyc_end(struct mgos_bme68x_energy_state *e) {
+  __sync_synchronize();
+  e->cyc_seq++;
+}
+
+void mgos_bme68x_energy_cycle(const bsec_bme_settings_t *ss,
+                              uint32_t meas_us) {
+  struct mgos_bme68x_energy_state *e = s_energy;
+  if (e == NULL) return;
+  uint64_t i2c_us = 0;
+  struct mgos_bme68x_i2c_stats st;
+  if (mgos_bme68x_get_i2c_stats(NULL, &st)) {
+    uint64_t bus_us = st.total.bus_time_us;
+    // I2C stats may have been reset in the meantime.
+    i2c_us = (bus_us >= e->last_bus_us ? bus_us - e->last_bus_us : bus_us);
+    e->last_bus_us = bus_us;
+  }
+  mgos_bme68x_energy_cyc_begin(e);
+  e->cyc.num_cycles++;
+  e->cyc.meas_us += meas_us;
+  if (ss->run_gas) e->cyc.heater_us += ss->heater_duration * 1000;
+  e->cyc.i2c_us += i2c_us;
+  mgos_bme68x_energy_cyc_end(e);
+}
+
+void mgos_bme68x_energy_awake(int64_t start) {
+  struct mgos_bme68x_energy_state *e = s_energy;
+  if (e == NULL) return;
+  int64_t d = mgos_uptime_micros() - start;
+  if (d > 0) e->awake_us += d;
+}
+
+void mgos_bme68x_energy_task_awake(int64_t start) {
+  struct mgos_bme68x_energy_state *e = s_energy;
+  if (e == NULL) return;
+  int64_t d = mgos_uptime_micros() - start;
+  if (d <= 0) return;
+  mgos_bme68x_energy_cyc_begin(e);
+  e->cyc.awake_us += d;
+  mgos_bme68x_energy_cyc_end(e);
+}
+
+bool mgos_bme68x_get_energy(struct mgos_bme68x_energy *energy) {
+  const struct mgos_bme68x_energy_state *e = s_energy;
+  struct mgos_bme68x_energy_cyc c;
+  if (e == NULL || !mgos_bme68x_energy_get_cyc(&c)) return false;
+  memset(energy, 0, sizeof(*energy));
+  energy->num_cycles = c.num_cycles;
+  energy->num_outputs = e->num_outputs;
+  energy->heater_us = c.heater_us;
+  energy->meas_us = c.meas_us;
+  energy->i2c_us = c.i2c_us;
+  energy->awake_us = e->awake_us + c.awake_us;
+  energy->heater_mj = mgos_bme68x_energy_mj(e->cfg.heater_ua, c.heater_us);
+  energy->meas_mj = mgos_bme68x_energy_mj(e->cfg.meas_ua, c.meas_us);
+  energy->i2c_mj = mgos_bme68x_energy_mj(e->cfg.i2c_ua, c.i2c_us);
+  energy->host_mj = mgos_bme68x_energy_mj(e->cfg.host_ua, energy->awake_us);
+  energy->total_mj = energy->heater_mj + energy->meas_mj + energy->i2c_mj +
+                     energy->host_mj;
+  energy->last_output_mj = e->last_output_mj;
+  if (e->num_outputs > 0) {
+    energy->output_mj = energy->total_mj / e->num_outputs;
+  }
+  int64_t elapsed_us = mgos_uptime_micros() - e->start_us;
+  if (elapsed_us > 0) {
+    energy->hour_mj = energy->total_mj * (3600e6f / elapsed_us);
+  }
+  return true;
+}
+
+void mgos_bme68x_energy_output(void) {
+  struct mgos_bme68x_energy_state *e = s_energy;
+  struct mgos_bme68x_energy energy;
+  if (e == NULL || !mgos_bme68x_get_energy(&energy)) return;
+  e->num_outputs++;
+  e->last_output_mj = energy.total_mj - e->prev_output_mj;
+  e->prev_output_mj = energy.total_mj;
+}
+
+void mgos_bme68x_reset_energy(void) {
+  struct mgos_bme68x_energy_state *e = s_energy;
+  struct mgos_bme68x_energy_cyc base;
+  if (e == NULL) return;
+  if (!mgos_bme68x_energy_read_cyc(&base)) {
+    LOG(LL_ERROR, ("Failed to reset energy stats, try again"));
+    return;
+  }
+  e->cyc_base = base;
+  e->start_us = mgos_uptime_micros();
+  e->num_outputs = 0;
+  e->awake_us = 0;
+  e->prev_output_mj = e->last_output_mj = 0;
+}
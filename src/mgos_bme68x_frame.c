@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_bme68x_frame.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MGOS_BME68X_FRAME_HDR_LEN 4
+#define MGOS_BME68X_FRAME_ACC_FIELDS                                 \
+  ((1 << MGOS_BME68X_FRAME_IAQ) | (1 << MGOS_BME68X_FRAME_CO2) |     \
+   (1 << MGOS_BME68X_FRAME_VOC) | (1 << MGOS_BME68X_FRAME_SIAQ))
+
+struct mgos_bme68x_frame_fmt {
+  float scale;
+  float offset;
+  uint8_t len;
+  bool is_signed;
+  int8_t acc_shift;  // -1 if the field has no accuracy.
+};
+
+static const struct mgos_bme68x_frame_fmt s_fmt[MGOS_BME68X_FRAME_MAX] = {
+    [MGOS_BME68X_FRAME_IAQ] = {10, 0, 2, false, 0},
+    [MGOS_BME68X_FRAME_CO2] = {1, 0, 2, false, 2},
+    [MGOS_BME68X_FRAME_VOC] = {100, 0, 2, false, 4},
+    [MGOS_BME68X_FRAME_TEMP] = {100, 0, 2, true, -1},
+    [MGOS_BME68X_FRAME_RH] = {100, 0, 2, false, -1},
+    [MGOS_BME68X_FRAME_PS] = {0.5f, 30000, 2, false, -1},
+    [MGOS_BME68X_FRAME_GAS] = {0.1f, 0, 3, false, -1},
+    [MGOS_BME68X_FRAME_SIAQ] = {10, 0, 2, false, 6},
+};
+
+static int32_t mgos_bme68x_frame_quantize(int f, float v) {
+  const struct mgos_bme68x_frame_fmt *fmt = &s_fmt[f];
+  int32_t max = (1 << (fmt->len * 8)) - 1, min = 0;
+  if (fmt->is_signed) {
+    max >>= 1;
+    min = -max - 1;
+  }
+  if (isnan(v)) return 0;
+  float q = roundf((v - fmt->offset) * fmt->scale);
+  if (q < min) return min;
+  if (q > max) return max;
+  return (int32_t) q;
+}
+
+static float mgos_bme68x_frame_dequantize(int f, int32_t q) {
+  return q / s_fmt[f].scale + s_fmt[f].offset;
+}
+
+static uint8_t *mgos_bme68x_frame_put_varint(uint8_t *p, int32_t d) {
+  uint32_t zz = ((uint32_t) d << 1) ^ (uint32_t)(d >> 31);
+  while (zz >= 0x80) {
+    *p++ = (uint8_t)(zz | 0x80);
+    zz >>= 7;
+  }
+  *p++ = (uint8_t) zz;
+  return p;
+}
+
+static const uint8_t *mgos_bme68x_frame_get_varint(const uint8_t *p,
+                                                   const uint8_t *end,
+                                                   int32_t *d) {
+  uint32_t zz = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p >= end) return NULL;
+    uint8_t b = *p++;
+    zz |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *d = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+      return p;
+    }
+  }
+  return NULL;
+}
+
+int mgos_bme68x_frame_encode(struct mgos_bme68x_frame_ctx *ctx,
+                             const struct mgos_bme68x_frame_values *v,
+                             bool delta, uint8_t *buf, size_t size) {
+  uint8_t tmp[MGOS_BME68X_FRAME_MAX_LEN * 2];
+  int32_t q[MGOS_BME68X_FRAME_MAX];
+  uint8_t present = v->present;
+  for (int f = 0; f < MGOS_BME68X_FRAME_MAX; f++) {
+    q[f] = ((present & (1 << f)) ? mgos_bme68x_frame_quantize(f, v->v[f]) : 0);
+  }
+  uint8_t *p = tmp + MGOS_BME68X_FRAME_HDR_LEN;
+  if (present & MGOS_BME68X_FRAME_ACC_FIELDS) {
+    uint8_t acc = 0;
+    for (int f = 0; f < MGOS_BME68X_FRAME_MAX; f++) {
+      if (s_fmt[f].acc_shift < 0 || !(present & (1 << f))) continue;
+      acc |= (v->acc[f] & 3) << s_fmt[f].acc_shift;
+    }
+    *p++ = acc;
+  }
+  uint8_t *values = p;
+  // Full frame.
+  for (int f = 0; f < MGOS_BME68X_FRAME_MAX; f++) {
+    if (!(present & (1 << f))) continue;
+    for (int i = 0; i < s_fmt[f].len; i++) *p++ = (uint8_t)(q[f] >> (i * 8));
+  }
+  uint8_t flags = 0;
+  if (delta && ctx != NULL && ctx->valid && ctx->present == present &&
+      (uint16_t)(ctx->seq + 1) == v->seq) {
+    // Use delta encoding if it is shorter.
+    uint8_t dv[MGOS_BME68X_FRAME_MAX * 5], *dp = dv;
+    for (int f = 0; f < MGOS_BME68X_FRAME_MAX; f++) {
+      if (!(present & (1 << f))) continue;
+      dp = mgos_bme68x_frame_put_varint(dp, q[f] - ctx->q[f]);
+    }
+    if (dp - dv < p - values) {
+      memcpy(values, dv, dp - dv);
+      p = values + (dp - dv);
+      flags |= MGOS_BME68X_FRAME_F_DELTA;
+    }
+  }
+  tmp[0] = (MGOS_BME68X_FRAME_VERSION << 4) | flags;
+  tmp[1] = (uint8_t) v->seq;
+  tmp[2] = (uint8_t)(v->seq >> 8);
+  tmp[3] = present;
+  size_t len = p - tmp;
+  if (len > size) return -1;
+  memcpy(buf, tmp, len);
+  if (ctx != NULL) {
+    ctx->valid = true;
+    ctx->seq = v->seq;
+    ctx->present = present;
+    memcpy(ctx->q, q, sizeof(q));
+  }
+  return (int) len;
+}
+
+bool mgos_bme68x_frame_decode(struct mgos_bme68x_frame_ctx *ctx,
+                              const uint8_t *buf, size_t len,
+                              struct mgos_bme68x_frame_values *v) {
+  const uint8_t *p = buf, *end = buf + len;
+  if (len < MGOS_BME68X_FRAME_HDR_LEN) return false;
+  if ((p[0] >> 4) != MGOS_BME68X_FRAME_VERSION) return false;
+  bool delta = (p[0] & MGOS_BME68X_FRAME_F_DELTA);
+  memset(v, 0, sizeof(*v));
+  v->seq = p[1] | (p[2] << 8);
+  v->present = p[3];
+  p += MGOS_BME68X_FRAME_HDR_LEN;
+  if (delta && (ctx == NULL || !ctx->valid || ctx->present != v->present ||
+                (uint16_t)(ctx->seq + 1) != v->seq)) {
+    return false;
+  }
+  if (v->present & MGOS_BME68X_FRAME_ACC_FIELDS) {
+    if (p >= end) return false;
+    uint8_t acc = *p++;
+    for (int f = 0; f < MGOS_BME68X_FRAME_MAX; f++) {
+      if (s_fmt[f].acc_shift < 0 || !(v->present & (1 << f))) continue;
+      v->acc[f] = (acc >> s_fmt[f].acc_shift) & 3;
+    }
+  }
+  int32_t q[MGOS_BME68X_FRAME_MAX] = {0};
+  for (int f = 0; f < MGOS_BME68X_FRAME_MAX; f++) {
+    if (!(v->present & (1 << f))) {
+      v->v[f] = NAN;
+      continue;
+    }
+    if (delta) {
+      int32_t d;
+      p = mgos_bme68x_frame_get_varint(p, end, &d);
+      if (p == NULL) return false;
+      q[f] = ctx->q[f] + d;
+    } else {
+      const struct mgos_bme68x_frame_fmt *fmt = &s_fmt[f];
+      if (end - p < fmt->len) return false;
+      uint32_t u = 0;
+      for (int i = 0; i < fmt->len; i++) u |= (uint32_t) *p++ << (i * 8);
+      if (fmt->is_signed && (u & (1U << (fmt->len * 8 - 1)))) {
+        u |= ~0U << (fmt->len * 8);  // Sign-extend.
+      }
+      q[f] = (int32_t) u;
+    }
+    v->v[f] = mgos_bme68x_frame_dequantize(f, q[f]);
+  }
+  if (ctx != NULL) {
+    ctx->valid = true;
+    ctx->seq = v->seq;
+    ctx->present = v->present;
+    memcpy(ctx->q, q, sizeof(q));
+  }
+  return true;
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compressed history, encoding is similar to that of Facebook's Gorilla.
+//
+// Storage is split into blocks, each starts with a header followed by
+// a bit stream. First sample of a block is stored as is: 64-bit timestamp,
+// 32 bits per signal and 2 bits of IAQ accuracy. For the following samples:
+//  - timestamp delta-of-delta (ms): '0' if 0, '10' + 7 bits, '110' + 9 bits,
+//    '1110' + 12 bits or '1111' + 64 bits;
+//  - each signal is XOR-ed with its previous value: '0' if equal, '10' and
+//    meaningful bits if they fit the previous leading / trailing zero window,
+//    otherwise '11' + 5 bits of leading zeros + 6 bits of length + bits;
+//  - IAQ accuracy: '0' if unchanged, otherwise '1' + 2 bits.
+// When a sample may not fit in the current block, next block is started,
+// evicting the oldest one if necessary.
+
+#include "mgos_bme68x_internal.h"
+
+#include <math.h>
+
+#include "mgos.h"
+
+struct mgos_bme68x_hist_block {
+  uint32_t seq;
+  uint16_t num_samples;
+  uint32_t num_bits;
+  uint8_t data[];
+};
+
+struct mgos_bme68x_hist {
+  int num_blocks;
+  int block_size;  // Size of data, bytes.
+  uint8_t sigs;    // Bitmask of stored signals.
+  uint8_t num_sigs;
+  uint32_t mantissa_mask;
+  int first, count;  // Blocks in use.
+  uint32_t next_seq;
+  uint32_t num_evicted;
+  uint32_t max_sample_bits;
+  // Encoder state, same as iterator state at the end of the last block.
+  struct mgos_bme68x_hist_iter enc;
+  uint8_t *mem;
+};
+
+static struct mgos_bme68x_hist *s_hist;
+
+static struct mgos_bme68x_hist_block *mgos_bme68x_hist_block(
+    const struct mgos_bme68x_hist *h, int i) {
+  size_t stride = sizeof(struct mgos_bme68x_hist_block) + h->block_size;
+  return (struct mgos_bme68x_hist_block *) (h->mem + i * stride);
+}
+
+static void put_bits(struct mgos_bme68x_hist_block *b, uint64_t v, int n) {
+  while (n > 0) {
+    n--;
+    if ((v >> n) & 1) b->data[b->num_bits >> 3] |= (0x80 >> (b->num_bits & 7));
+    b->num_bits++;
+  }
+}
+
+static uint64_t get_bits(const struct mgos_bme68x_hist_block *b,
+                         uint32_t *pos, int n) {
+  uint64_t v = 0;
+  while (n-- > 0) {
+    v = (v << 1) | ((b->data[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+    (*pos)++;
+  }
+  return v;
+}
+
+static int clz32(uint32_t v) {
+  return (v == 0 ? 32 : __builtin_clz(v));
+}
+
+static int ctz32(uint32_t v) {
+  return (v == 0 ? 32 : __builtin_ctz(v));
+}
+
+static uint32_t float_bits(float f) {
+  uint32_t v;
+  memcpy(&v, &f, sizeof(v));
+  return v;
+}
+
+static float bits_float(uint32_t v) {
+  float f;
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+static void mgos_bme68x_hist_encode(struct mgos_bme68x_hist *h,
+                                    struct mgos_bme68x_hist_block *b,
+                                    int64_t ts, const uint32_t *v,
+                                    uint8_t acc) {
+  struct mgos_bme68x_hist_iter *e = &h->enc;
+  if (b->num_samples == 0) {
+    put_bits(b, (uint64_t) ts, 64);
+    for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+      if (!(h->sigs & (1 << i))) continue;
+      put_bits(b, v[i], 32);
+      e->lead[i] = 0xff;  // Force explicit window for the next value.
+    }
+    put_bits(b, acc, 2);
+    e->delta = 0;
+  } else {
+    int64_t delta = ts - e->ts;
+    int64_t dod = delta - e->delta;
+    if (dod == 0) {
+      put_bits(b, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+      put_bits(b, 2, 2);
+      put_bits(b, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+      put_bits(b, 6, 3);
+      put_bits(b, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+      put_bits(b, 14, 4);
+      put_bits(b, (uint64_t)(dod + 2047), 12);
+    } else {
+      put_bits(b, 15, 4);
+      put_bits(b, (uint64_t) dod, 64);
+    }
+    e->delta = delta;
+    for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+      if (!(h->sigs & (1 << i))) continue;
+      uint32_t x = v[i] ^ e->v[i];
+      if (x == 0) {
+        put_bits(b, 0, 1);
+        continue;
+      }
+      int lead = clz32(x), trail = ctz32(x);
+      if (lead > 31) lead = 31;
+      if (e->lead[i] != 0xff && lead >= e->lead[i] && trail >= e->trail[i]) {
+        put_bits(b, 2, 2);
+        put_bits(b, x >> e->trail[i], 32 - e->lead[i] - e->trail[i]);
+      } else {
+        int len = 32 - lead - trail;
+        put_bits(b, 3, 2);
+        put_bits(b, lead, 5);
+        put_bits(b, len - 1, 6);
+        put_bits(b, x >> trail, len);
+        e->lead[i] = lead;
+        e->trail[i] = trail;
+      }
+    }
+    if (acc == e->iaq_acc) {
+      put_bits(b, 0, 1);
+    } else {
+      put_bits(b, 1, 1);
+      put_bits(b, acc, 2);
+    }
+  }
+  e->ts = ts;
+  memcpy(e->v, v, sizeof(e->v));
+  e->iaq_acc = acc;
+  b->num_samples++;
+}
+
+// Decode next sample of the block, |it| holds the state.
+static void mgos_bme68x_hist_decode(const struct mgos_bme68x_hist *h,
+                                    const struct mgos_bme68x_hist_block *b,
+                                    struct mgos_bme68x_hist_iter *it) {
+  uint32_t *pos = &it->bit_pos;
+  if (it->sample == 0) {
+    it->ts = (int64_t) get_bits(b, pos, 64);
+    for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+      if (!(h->sigs & (1 << i))) continue;
+      it->v[i] = (uint32_t) get_bits(b, pos, 32);
+      it->lead[i] = 0xff;
+    }
+    it->iaq_acc = (uint8_t) get_bits(b, pos, 2);
+    it->delta = 0;
+  } else {
+    int64_t dod;
+    if (get_bits(b, pos, 1) == 0) {
+      dod = 0;
+    } else if (get_bits(b, pos, 1) == 0) {
+      dod = (int64_t) get_bits(b, pos, 7) - 63;
+    } else if (get_bits(b, pos, 1) == 0) {
+      dod = (int64_t) get_bits(b, pos, 9) - 255;
+    } else if (get_bits(b, pos, 1) == 0) {
+      dod = (int64_t) get_bits(b, pos, 12) - 2047;
+    } else {
+      dod = (int64_t) get_bits(b, pos, 64);
+    }
+    it->delta += dod;
+    it->ts += it->delta;
+    for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+      if (!(h->sigs & (1 << i))) continue;
+      if (get_bits(b, pos, 1) == 0) continue;
+      if (get_bits(b, pos, 1) == 0) {
+        int len = 32 - it->lead[i] - it->trail[i];
+        it->v[i] ^= (uint32_t) get_bits(b, pos, len) << it->trail[i];
+      } else {
+        int lead = (int) get_bits(b, pos, 5);
+        int len = (int) get_bits(b, pos, 6) + 1;
+        int trail = 32 - lead - len;
+        it->v[i] ^= (uint32_t) get_bits(b, pos, len) << trail;
+        it->lead[i] = lead;
+        it->trail[i] = trail;
+      }
+    }
+    if (get_bits(b, pos, 1) != 0) it->iaq_acc = (uint8_t) get_bits(b, pos, 2);
+  }
+  it->sample++;
+}
+
+static struct mgos_bme68x_hist_block *mgos_bme68x_hist_new_block(
+    struct mgos_bme68x_hist *h) {
+  if (h->count == h->num_blocks) {
+    h->first = (h->first + 1) % h->num_blocks;
+    h->count--;
+    h->num_evicted++;
+  }
+  int i = (h->first + h->count) % h->num_blocks;
+  struct mgos_bme68x_hist_block *b = mgos_bme68x_hist_block(h, i);
+  memset(b, 0, sizeof(*b) + h->block_size);
+  b->seq = h->next_seq++;
+  h->count++;
+  return b;
+}
+
+bool mgos_bme68x_hist_init(const struct mgos_config_bme68x_hist *cfg) {
+  if (cfg->block_size < 64 || cfg->size < 2 * cfg->block_size) return false;
+  struct mgos_bme68x_hist *h =
+      (struct mgos_bme68x_hist *) calloc(1, sizeof(*h));
+  if (h == NULL) return false;
+  h->block_size = (cfg->block_size + 3) & ~3;  // Keep headers aligned.
+  h->num_blocks =
+      cfg->size / (sizeof(struct mgos_bme68x_hist_block) + h->block_size);
+  h->mem = (uint8_t *) calloc(
+      h->num_blocks, sizeof(struct mgos_bme68x_hist_block) + h->block_size);
+  if (h->mem == NULL) {
+    free(h);
+    return false;
+  }
+  for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+    if (cfg->signals == NULL ||
+        strstr(cfg->signals, mgos_bme68x_signal_name(i)) != NULL) {
+      h->sigs |= (1 << i);
+      h->num_sigs++;
+    }
+  }
+  int mb = cfg->mantissa_bits;
+  if (mb < 1 || mb > 23) mb = 23;
+  h->mantissa_mask = ~((1U << (23 - mb)) - 1);
+  // Worst case: 68 bits of timestamp, 45 bits per signal, 3 bits of accuracy.
+  h->max_sample_bits = 68 + 45 * h->num_sigs + 3;
+  s_hist = h;
+  return true;
+}
+
+void mgos_bme68x_hist_append(const struct mgos_bsec_output *out) {
+  struct mgos_bme68x_hist *h = s_hist;
+  if (h == NULL || out->num_outputs == 0) return;
+  uint32_t v[MGOS_BME68X_SIG_MAX];
+  uint8_t acc = 0;
+  for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) v[i] = float_bits(NAN);
+  for (uint8_t k = 0; k < out->num_outputs; k++) {
+    const bsec_output_t *o = &out->outputs[k];
+    int sig = mgos_bme68x_signal_from_sensor_id(o->sensor_id);
+    if (sig < 0) continue;
+    // Dropping low mantissa bits makes XOR-ed values much more compressible.
+    v[sig] = float_bits(o->signal) & h->mantissa_mask;
+    if (sig == MGOS_BME68X_SIG_IAQ) acc = o->accuracy & 3;
+  }
+  int64_t ts = out->outputs[0].time_stamp / 1000000;
+  struct mgos_bme68x_hist_block *b = NULL;
+  if (h->count > 0) {
+    b = mgos_bme68x_hist_block(h, (h->first + h->count - 1) % h->num_blocks);
+    if (b->num_bits + h->max_sample_bits > h->block_size * 8U ||
+        b->num_samples == 0xffff || ts < h->enc.ts) {
+      b = NULL;
+    }
+  }
+  if (b == NULL) b = mgos_bme68x_hist_new_block(h);
+  mgos_bme68x_hist_encode(h, b, ts, v, acc);
+}
+
+bool mgos_bme68x_hist_get_stats(struct mgos_bme68x_hist_stats *stats) {
+  const struct mgos_bme68x_hist *h = s_hist;
+  if (h == NULL) return false;
+  memset(stats, 0, sizeof(*stats));
+  for (int k = 0; k < h->count; k++) {
+    const struct mgos_bme68x_hist_block *b =
+        mgos_bme68x_hist_block(h, (h->first + k) % h->num_blocks);
+    stats->num_samples += b->num_samples;
+    stats->bytes_used += sizeof(*b) + (b->num_bits + 7) / 8;
+  }
+  stats->num_blocks = h->count;
+  stats->num_evicted = h->num_evicted;
+  // Uncompressed: 64-bit timestamp, float per signal and accuracy byte.
+  stats->raw_bytes =
+      stats->num_samples * (sizeof(int64_t) + h->num_sigs * sizeof(float) + 1);
+  if (stats->bytes_used > 0) {
+    stats->ratio = (float) stats->raw_bytes / stats->bytes_used;
+  }
+  if (stats->num_samples > 0) {
+    stats->bits_per_sample = stats->bytes_used * 8.0f / stats->num_samples;
+  }
+  return true;
+}
+
+// Position iterator at the start of the k-th oldest block.
+static void mgos_bme68x_hist_iter_seek(const struct mgos_bme68x_hist *h,
+                                       struct mgos_bme68x_hist_iter *it,
+                                       int k) {
+  it->block = (h->first + k) % h->num_blocks;
+  it->seq = mgos_bme68x_hist_block(h, it->block)->seq;
+  it->sample = 0;
+  it->bit_pos = 0;
+}
+
+void mgos_bme68x_hist_iter_init(struct mgos_bme68x_hist_iter *it,
+                                int64_t from_ts) {
+  const struct mgos_bme68x_hist *h = s_hist;
+  memset(it, 0, sizeof(*it));
+  it->from_ts = from_ts;
+  it->block = -1;
+  if (h == NULL || h->count == 0) return;
+  // Skip blocks that end before from_ts: next block starts before it.
+  int k = 0;
+  for (; k + 1 < h->count; k++) {
+    const struct mgos_bme68x_hist_block *nb =
+        mgos_bme68x_hist_block(h, (h->first + k + 1) % h->num_blocks);
+    uint32_t pos = 0;
+    int64_t first_ts = (int64_t) get_bits(nb, &pos, 64);
+    if (first_ts * 1000000 > from_ts) break;
+  }
+  mgos_bme68x_hist_iter_seek(h, it, k);
+}
+
+bool mgos_bme68x_hist_iter_next(struct mgos_bme68x_hist_iter *it,
+                                struct mgos_bme68x_ring_sample *s) {
+  const struct mgos_bme68x_hist *h = s_hist;
+  if (h == NULL || h->count == 0 || it->block < 0) return false;
+  for (;;) {
+    const struct mgos_bme68x_hist_block *b =
+        mgos_bme68x_hist_block(h, it->block);
+    if (b->seq != it->seq) {
+      // Block was evicted, restart from the oldest one.
+      mgos_bme68x_hist_iter_seek(h, it, 0);
+      continue;
+    }
+    if (it->sample >= b->num_samples) {
+      int k = (it->block - h->first + h->num_blocks) % h->num_blocks;
+      if (k + 1 >= h->count) return false;
+      mgos_bme68x_hist_iter_seek(h, it, k + 1);
+      continue;
+    }
+    mgos_bme68x_hist_decode(h, b, it);
+    if (it->ts * 1000000 < it->from_ts) continue;
+    s->ts = it->ts * 1000000;
+    for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+      s->v[i] = ((h->sigs & (1 << i)) ? bits_float(it->v[i]) : NAN);
+    }
+    s->iaq_acc = it->iaq_acc;
+    return true;
+  }
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// I2C interface of the BME68x driver, with traffic accounting.
+// Each device gets its own interface struct (passed as intf_ptr), which
+// holds bus, address and counters.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+#include "mgos_i2c.h"
+
+struct mgos_bme68x_i2c_intf {
+  struct mgos_i2c *bus;
+  uint16_t addr;
+  uint8_t retries;
+  enum mgos_bme68x_i2c_phase phase;
+  struct mgos_bme68x_i2c_stats stats;
+};
+
+static const char *s_phase_names[MGOS_BME68X_I2C_PHASE_MAX] = {
+    "other", "control", "trigger", "poll", "read",
+};
+
+static struct mgos_bme68x_i2c_intf *s_intf;  // Library's own device.
+
+static void mgos_bme68x_i2c_account(struct mgos_bme68x_i2c_intf *intf,
+                                    bool ok, int tries, uint32_t rd,
+                                    uint32_t wr, int64_t start) {
+  uint32_t took = (uint32_t)(mgos_uptime_micros() - start);
+  struct mgos_bme68x_i2c_counters *cs[2] = {
+      &intf->stats.total,
+      &intf->stats.phase[intf->phase],
+  };
+  for (int i = 0; i < 2; i++) {
+    struct mgos_bme68x_i2c_counters *c = cs[i];
+    c->num_xfers++;
+    c->num_retries += tries - 1;
+    if (!ok) c->num_errors++;
+    if (ok) {
+      c->bytes_read += rd;
+      c->bytes_written += wr;
+    }
+    c->bus_time_us += took;
+  }
+}
+
+static BME68X_INTF_RET_TYPE bme68x_i2c_read(uint8_t reg_addr,
+                                            uint8_t *reg_data,
+                                            uint32_t length, void *intf_ptr) {
+  struct mgos_bme68x_i2c_intf *intf = (struct mgos_bme68x_i2c_intf *) intf_ptr;
+  int64_t start = mgos_uptime_micros();
+  bool ok = false;
+  int tries = 0;
+  while (!ok && tries <= intf->retries) {
+    ok = mgos_i2c_read_reg_n(intf->bus, intf->addr, reg_addr, length,
+                             reg_data);
+    tries++;
+  }
+  mgos_bme68x_i2c_account(intf, ok, tries, length, 1, start);
+  return (ok ? 0 : -1);
+}
+
+static BME68X_INTF_RET_TYPE bme68x_i2c_write(uint8_t reg_addr,
+                                             const uint8_t *reg_data,
+                                             uint32_t length, void *intf_ptr) {
+  struct mgos_bme68x_i2c_intf *intf = (struct mgos_bme68x_i2c_intf *) intf_ptr;
+  int64_t start = mgos_uptime_micros();
+  bool ok = false;
+  int tries = 0;
+  while (!ok && tries <= intf->retries) {
+    ok = mgos_i2c_write_reg_n(intf->bus, intf->addr, reg_addr, length,
+                              reg_data);
+    tries++;
+  }
+  mgos_bme68x_i2c_account(intf, ok, tries, 0, length + 1, start);
+  return (ok ? 0 : -1);
+}
+
+static void bme68x_delay_us(uint32_t period, void *intf_ptr) {
+  mgos_usleep(period);
+  (void) intf_ptr;
+}
+
+int8_t mgos_bme68x_i2c_init_dev(struct bme68x_dev *dev, int bus_no, int addr,
+                                int retries, bool own) {
+  struct mgos_bme68x_i2c_intf *intf = NULL;
+  // Re-init of a device set up here before: reuse its interface struct.
+  if (own) {
+    intf = s_intf;
+  } else if (dev->read == bme68x_i2c_read) {
+    intf = (struct mgos_bme68x_i2c_intf *) dev->intf_ptr;
+  }
+  bool new_intf = (intf == NULL);
+  if (new_intf) {
+    intf = (struct mgos_bme68x_i2c_intf *) calloc(1, sizeof(*intf));
+    if (intf == NULL) return BME68X_E_NULL_PTR;
+  }
+  intf->bus = mgos_i2c_get_bus(bus_no);
+  intf->addr = addr;
+  intf->retries = (retries > 0 ? retries : 0);
+  intf->phase = MGOS_BME68X_I2C_PHASE_OTHER;
+  dev->intf = BME68X_I2C_INTF;
+  dev->intf_ptr = intf;
+  dev->read = bme68x_i2c_read;
+  dev->write = bme68x_i2c_write;
+  dev->delay_us = bme68x_delay_us;
+  if (own) s_intf = intf;
+  int8_t res = bme68x_init(dev);
+  if (res != BME68X_OK && new_intf) {
+    if (s_intf == intf) s_intf = NULL;
+    dev->intf_ptr = NULL;
+    free(intf);
+  }
+  return res;
+}
+
+int8_t mgos_bme68x_init_dev_i2c(struct bme68x_dev *dev, int bus_no, int addr) {
+  return mgos_bme68x_i2c_init_dev(dev, bus_no, addr, 0, false);
+}
+
+static struct mgos_bme68x_i2c_intf *mgos_bme68x_i2c_get_intf(
+    const struct bme68x_dev *dev) {
+  if (dev == NULL) return s_intf;
+  if (dev->read != bme68x_i2c_read) return NULL;
+  return (struct mgos_bme68x_i2c_intf *) dev->intf_ptr;
+}
+
+void mgos_bme68x_i2c_set_phase(struct bme68x_dev *dev,
+                               enum mgos_bme68x_i2c_phase phase) {
+  struct mgos_bme68x_i2c_intf *intf = mgos_bme68x_i2c_get_intf(dev);
+  if (intf == NULL) return;
+  intf->phase = phase;
+  if (phase == MGOS_BME68X_I2C_PHASE_TRIGGER) intf->stats.num_cycles++;
+}
+
+bool mgos_bme68x_get_i2c_stats(const struct bme68x_dev *dev,
+                               struct mgos_bme68x_i2c_stats *stats) {
+  const struct mgos_bme68x_i2c_intf *intf = mgos_bme68x_i2c_get_intf(dev);
+  if (intf == NULL) return false;
+  *stats = intf->stats;
+  return true;
+}
+
+void mgos_bme68x_reset_i2c_stats(const struct bme68x_dev *dev) {
+  struct mgos_bme68x_i2c_intf *intf = mgos_bme68x_i2c_get_intf(dev);
+  if (intf == NULL) return;
+  memset(&intf->stats, 0, sizeof(intf->stats));
+}
+
+const char *mgos_bme68x_i2c_phase_name(enum mgos_bme68x_i2c_phase phase) {
+  if (phase >= MGOS_BME68X_I2C_PHASE_MAX) return "";
+  return s_phase_names[phase];
+}
+
+static void mgos_bme68x_i2c_stats_timer_cb(void *arg) {
+  const struct mgos_bme68x_i2c_intf *intf = s_intf;
+  if (intf == NULL) return;
+  const struct mgos_bme68x_i2c_counters *c = &intf->stats.total;
+  uint32_t nc = (intf->stats.num_cycles > 0 ? intf->stats.num_cycles : 1);
+  LOG(LL_INFO,
+      ("I2C: %u cycles, %u xfers, %u B read, %u B written, %u errors, "
+       "%u retries; per cycle: %.1f xfers, %u us",
+       (unsigned) intf->stats.num_cycles, (unsigned) c->num_xfers,
+       (unsigned) c->bytes_read, (unsigned) c->bytes_written,
+       (unsigned) c->num_errors, (unsigned) c->num_retries,
+       (double) c->num_xfers / nc, (unsigned) (c->bus_time_us / nc)));
+  (void) arg;
+}
+
+void mgos_bme68x_i2c_stats_log_start(int interval) {
+  if (interval <= 0) return;
+  mgos_set_timer(interval * 1000, MGOS_TIMER_REPEAT,
+                 mgos_bme68x_i2c_stats_timer_cb, NULL);
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Interfaces shared between the library's source files.
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "mgos_bme68x.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Messages above this level are compiled out. Per-cycle details are
+// available from the binary trace instead.
+#ifndef MGOS_BME68X_LOG_LEVEL
+#define MGOS_BME68X_LOG_LEVEL LL_VERBOSE_DEBUG
+#endif
+
+#define MGOS_BME68X_LOG(l, x)                    \
+  do {                                           \
+    if ((l) <= MGOS_BME68X_LOG_LEVEL) LOG(l, x); \
+  } while (0)
+
+// Measurement cycle, split into stages so that it can be driven either by
+// mgos timers or by a dedicated task (see mgos_bme68x_task.c).
+
+// Run BSEC sensor control and trigger measurement if requested.
+// |delay_ms| is set to delay until the next cycle, |meas_delay_ms| to the
+// time measurement takes, results can be processed after that.
+int mgos_bme68x_run_once(bsec_bme_settings_t *ss, int *delay_ms,
+                         int *meas_delay_ms);
+
+// Read measurement data and run BSEC. Outputs are stored to |out|.
+// Returns false if there is nothing to publish.
+bool mgos_bsec_process(const bsec_bme_settings_t *ss,
+                       struct bme68x_data *data,
+                       struct mgos_bsec_output *out);
+
+// Output slot that is not currently published. Main task only.
+struct mgos_bsec_output *mgos_bsec_free_slot(void);
+
+// Publish outputs and dispatch them to handlers. Main task only.
+void mgos_bsec_publish(struct mgos_bsec_output *out,
+                       const struct bme68x_data *data);
+
+// Accounts |delay_ms| of time to the next state save, returns true when
+// it is due. Called by whichever task runs the cycle.
+bool mgos_bsec_state_save_due(int delay_ms);
+
+// Saves BSEC and calibration state. Must run on the main task.
+void mgos_bsec_save_state(void);
+
+// BSEC library is not reentrant, calls that can be made from different
+// tasks must be made under this lock.
+void mgos_bsec_lock(void);
+void mgos_bsec_unlock(void);
+
+// Start measurement task, if supported on this platform.
+bool mgos_bme68x_task_start(const struct mgos_config_bme68x_task *cfg);
+
+// Cut the task's wait for the next cycle short. Returns false if the task
+// is not running.
+bool mgos_bme68x_task_wake(void);
+
+// Allocate history ring of |size| samples.
+bool mgos_bme68x_ring_init(int size);
+
+// Append output to the history ring.
+void mgos_bme68x_ring_append(const struct mgos_bsec_output *out);
+
+// Convert output to a sample, signals not present are set to NaN.
+void mgos_bme68x_sample_from_output(const struct mgos_bsec_output *out,
+                                    struct mgos_bme68x_ring_sample *s);
+
+bool mgos_bme68x_rollup_init(const struct mgos_config_bme68x_rollup *cfg);
+
+// Update rollups with the output.
+void mgos_bme68x_rollup_update(const struct mgos_bsec_output *out);
+
+bool mgos_bme68x_hist_init(const struct mgos_config_bme68x_hist *cfg);
+
+// Append output to the compressed history.
+void mgos_bme68x_hist_append(const struct mgos_bsec_output *out);
+
+bool mgos_bme68x_log_init(const struct mgos_config_bme68x_log *cfg);
+
+// Append output to the flash log, if logging outputs.
+void mgos_bme68x_log_append(const struct mgos_bsec_output *out);
+
+bool mgos_bme68x_deadband_init(const struct mgos_config_bme68x_deadband *cfg);
+
+// Returns true if the output event should be triggered for |out|.
+bool mgos_bme68x_deadband_check(const struct mgos_bsec_output *out);
+
+bool mgos_bme68x_alarm_init(const struct mgos_config_bme68x_alarm *cfg);
+
+// Evaluate alarm rules against the output.
+void mgos_bme68x_alarm_update(const struct mgos_bsec_output *out);
+
+bool mgos_bme68x_batch_init(const struct mgos_config_bme68x_batch *cfg);
+
+// Add output to the current batch.
+void mgos_bme68x_batch_append(const struct mgos_bsec_output *out);
+
+// Initialize device on I2C. |own| marks the library's own device.
+int8_t mgos_bme68x_i2c_init_dev(struct bme68x_dev *dev, int bus_no, int addr,
+                                int retries, bool own);
+
+// Attribute subsequent I2C transfers of |dev| to |phase|.
+void mgos_bme68x_i2c_set_phase(struct bme68x_dev *dev,
+                               enum mgos_bme68x_i2c_phase phase);
+
+// Log I2C stats every |interval| seconds.
+void mgos_bme68x_i2c_stats_log_start(int interval);
+
+bool mgos_bme68x_lat_init(void);
+
+// Record latency of |stage| that started at |start| (mgos_uptime_micros()).
+void mgos_bme68x_lat_record(enum mgos_bme68x_stage stage, int64_t start);
+
+bool mgos_bme68x_energy_init(const struct mgos_config_bme68x_energy *cfg);
+
+// Account a triggered measurement, |meas_us| is the T/P/H conversion time.
+void mgos_bme68x_energy_cycle(const bsec_bme_settings_t *ss,
+                              uint32_t meas_us);
+
+// Account host time spent since |start|, on the main task.
+void mgos_bme68x_energy_awake(int64_t start);
+// Same for the measurement task, which has a separate counter.
+void mgos_bme68x_energy_task_awake(int64_t start);
+
+void mgos_bme68x_energy_output(void);
+
+// Create a rate client. Boost clients only raise rate of sensors requested
+// by someone else.
+struct mgos_bsec_rate_client *mgos_bsec_rate_client_create_int(
+    const char *name, bool boost, mgos_bsec_output_cb_t cb, void *arg);
+
+bool mgos_bsec_cal_init(const struct mgos_config_bme68x_bsec_cal *cfg);
+
+// Feed output to the calibration scheduler.
+void mgos_bsec_cal_update(const struct mgos_bsec_output *out);
+
+// Save calibration progress, if it has changed.
+void mgos_bsec_cal_save(void);
+
+// Track stabilization and run-in, keep IAQ at LP until done if
+// |fast_start| is set.
+bool mgos_bsec_runin_init(bool fast_start);
+
+void mgos_bsec_runin_update(const struct mgos_bsec_output *out);
+
+bool mgos_bsec_ratectl_init(const struct mgos_config_bme68x_ratectl *cfg);
+
+// Feed output to the rate controller.
+void mgos_bsec_ratectl_update(const struct mgos_bsec_output *out);
+
+bool mgos_bme68x_trace_init(int size);
+
+// Append a trace record.
+void mgos_bme68x_trace(enum mgos_bme68x_trace_type type, uint8_t a,
+                       uint16_t b, uint32_t c, uint32_t d);
+
+void mgos_bme68x_trace_f(enum mgos_bme68x_trace_type type, uint8_t a,
+                         uint16_t b, float c);
+
+// Look up signal by name, returns -1 if not found.
+int mgos_bme68x_signal_from_name(const char *name, size_t len);
+
+// Register BME68x.* RPC handlers.
+bool mgos_bme68x_rpc_init(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// JSON encoder for outputs. Writes directly into the caller's buffer,
+// floats are formatted with integer arithmetic at a fixed precision.
+
+#include "mgos_bme68x_internal.h"
+
+#include <math.h>
+
+#include "mgos.h"
+
+#if CS_PLATFORM == CS_P_ESP32 || CS_PLATFORM == CS_P_ESP8266
+#include "xtensa/hal.h"
+#endif
+
+struct mgos_bsec_json_field {
+  const char *name;
+  uint8_t decimals;
+  bool has_accuracy;
+};
+
+static const struct mgos_bsec_json_field s_json_fields[] = {
+    [BSEC_OUTPUT_IAQ] = {"iaq", 1, true},
+    [BSEC_OUTPUT_STATIC_IAQ] = {"siaq", 1, true},
+    [BSEC_OUTPUT_CO2_EQUIVALENT] = {"co2", 0, true},
+    [BSEC_OUTPUT_BREATH_VOC_EQUIVALENT] = {"voc", 2, true},
+    [BSEC_OUTPUT_RAW_TEMPERATURE] = {"raw_temp", 2, false},
+    [BSEC_OUTPUT_RAW_PRESSURE] = {"ps", 0, false},
+    [BSEC_OUTPUT_RAW_HUMIDITY] = {"raw_rh", 2, false},
+    [BSEC_OUTPUT_RAW_GAS] = {"gas", 0, false},
+    [BSEC_OUTPUT_STABILIZATION_STATUS] = {"stab", 0, false},
+    [BSEC_OUTPUT_RUN_IN_STATUS] = {"run_in", 0, false},
+    [BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_TEMPERATURE] = {"temp", 2, false},
+    [BSEC_OUTPUT_SENSOR_HEAT_COMPENSATED_HUMIDITY] = {"rh", 2, false},
+    [BSEC_OUTPUT_GAS_PERCENTAGE] = {"gas_pct", 1, true},
+};
+
+static const uint32_t s_pow10[] = {1, 10, 100, 1000, 10000, 100000};
+
+static struct mgos_bsec_json_stats s_json_stats;
+
+// CPU cycle counter. Where there is none, uptime scaled by CPU frequency.
+// Wraps, so only good for short intervals.
+static uint32_t mgos_bsec_json_ccount(void) {
+#if CS_PLATFORM == CS_P_ESP32 || CS_PLATFORM == CS_P_ESP8266
+  return xthal_get_ccount();
+#else
+  return (uint32_t)(mgos_uptime_micros() * (mgos_get_cpu_freq() / 1000000));
+#endif
+}
+
+struct mgos_bsec_json_buf {
+  char *p, *end;
+};
+
+static void mgos_bsec_json_puts(struct mgos_bsec_json_buf *b, const char *s) {
+  while (*s != '\0' && b->p < b->end) *b->p++ = *s++;
+  if (*s != '\0') b->p = b->end + 1;  // Overflow.
+}
+
+static void mgos_bsec_json_putu(struct mgos_bsec_json_buf *b, uint64_t v,
+                                int min_digits) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + (v % 10);
+    v /= 10;
+  } while (v != 0 || n < min_digits);
+  if (b->end - b->p < n) {
+    b->p = b->end + 1;
+    return;
+  }
+  while (n > 0) *b->p++ = tmp[--n];
+}
+
+static void mgos_bsec_json_putf(struct mgos_bsec_json_buf *b, float v,
+                                int decimals) {
+  // Beyond this, the value is out of any sensor's range anyway.
+  if (isnan(v) || isinf(v) || fabsf(v) >= 1e12f) {
+    mgos_bsec_json_puts(b, "null");
+    return;
+  }
+  uint32_t scale = s_pow10[decimals];
+  int64_t sv = llroundf(v * scale);
+  if (sv < 0) {
+    mgos_bsec_json_puts(b, "-");
+    sv = -sv;
+  }
+  mgos_bsec_json_putu(b, (uint64_t) sv / scale, 1);
+  if (decimals == 0) return;
+  mgos_bsec_json_puts(b, ".");
+  mgos_bsec_json_putu(b, (uint64_t) sv % scale, decimals);
+}
+
+int mgos_bsec_output_to_json(const struct mgos_bsec_output *out, char *buf,
+                             size_t size) {
+  uint32_t start = mgos_bsec_json_ccount();
+  if (size == 0) return -1;
+  // Reserve space for the terminating NUL.
+  struct mgos_bsec_json_buf b = {.p = buf, .end = buf + size - 1};
+  mgos_bsec_json_puts(&b, "{\"ts\":");
+  int64_t ts = (out->num_outputs > 0 ? out->outputs[0].time_stamp : 0);
+  mgos_bsec_json_putu(&b, (uint64_t)(ts / 1000000), 1);
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    if (o->sensor_id >= ARRAY_SIZE(s_json_fields)) continue;
+    const struct mgos_bsec_json_field *f = &s_json_fields[o->sensor_id];
+    if (f->name == NULL) continue;
+    mgos_bsec_json_puts(&b, ",\"");
+    mgos_bsec_json_puts(&b, f->name);
+    mgos_bsec_json_puts(&b, "\":");
+    mgos_bsec_json_putf(&b, o->signal, f->decimals);
+    if (f->has_accuracy) {
+      mgos_bsec_json_puts(&b, ",\"");
+      mgos_bsec_json_puts(&b, f->name);
+      mgos_bsec_json_puts(&b, "_acc\":");
+      mgos_bsec_json_putu(&b, o->accuracy, 1);
+    }
+  }
+  mgos_bsec_json_puts(&b, "}");
+  struct mgos_bsec_json_stats *st = &s_json_stats;
+  st->num_encodes++;
+  if (b.p > b.end) {
+    st->num_overflows++;
+    buf[0] = '\0';
+    return -1;
+  }
+  *b.p = '\0';
+  uint32_t len = b.p - buf;
+  uint32_t took = mgos_bsec_json_ccount() - start;
+  st->last_bytes = len;
+  st->total_bytes += len;
+  if (len > st->max_bytes) st->max_bytes = len;
+  st->last_cycles = took;
+  st->total_cycles += took;
+  if (took > st->max_cycles) st->max_cycles = took;
+  return (int) len;
+}
+
+void mgos_bsec_get_json_stats(struct mgos_bsec_json_stats *stats) {
+  *stats = s_json_stats;
+}
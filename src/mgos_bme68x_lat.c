@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Latency histograms of the measurement cycle stages.
+// Buckets are log-linear: exact below 8 us, then 4 buckets per power of 2
+// (at most 25% wide), up to 2^24 us. Counts are 16 bit, when one would
+// overflow all counts of the stage are halved, keeping the distribution.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+#define MGOS_BME68X_LAT_LINEAR 8
+#define MGOS_BME68X_LAT_SUB_BITS 2
+#define MGOS_BME68X_LAT_MAX_BITS 24
+#define MGOS_BME68X_LAT_NUM_BUCKETS                 \
+  (MGOS_BME68X_LAT_LINEAR +                         \
+   (MGOS_BME68X_LAT_MAX_BITS - 3) * (1 << MGOS_BME68X_LAT_SUB_BITS))
+
+struct mgos_bme68x_lat_hist {
+  uint32_t count;
+  uint32_t min, max;
+  uint64_t sum;
+  uint16_t buckets[MGOS_BME68X_LAT_NUM_BUCKETS];
+};
+
+static const char *s_stage_names[MGOS_BME68X_STAGE_MAX] = {
+    "control", "config", "read", "do_steps",
+    "parse",   "store",  "dispatch", "state_save",
+};
+
+static struct mgos_bme68x_lat_hist *s_lat;
+
+static int mgos_bme68x_lat_bucket(uint32_t us) {
+  if (us < MGOS_BME68X_LAT_LINEAR) return us;
+  if (us >= (1U << MGOS_BME68X_LAT_MAX_BITS)) {
+    return MGOS_BME68X_LAT_NUM_BUCKETS - 1;
+  }
+  int msb = 31 - __builtin_clz(us);
+  int sub = (us >> (msb - MGOS_BME68X_LAT_SUB_BITS)) &
+            ((1 << MGOS_BME68X_LAT_SUB_BITS) - 1);
+  return MGOS_BME68X_LAT_LINEAR + ((msb - 3) << MGOS_BME68X_LAT_SUB_BITS) +
+         sub;
+}
+
+// Upper bound of the bucket.
+static uint32_t mgos_bme68x_lat_bucket_max(int b) {
+  if (b < MGOS_BME68X_LAT_LINEAR) return b;
+  b -= MGOS_BME68X_LAT_LINEAR;
+  int msb = (b >> MGOS_BME68X_LAT_SUB_BITS) + 3;
+  int sub = b & ((1 << MGOS_BME68X_LAT_SUB_BITS) - 1);
+  uint32_t width = 1U << (msb - MGOS_BME68X_LAT_SUB_BITS);
+  return (1U << msb) + (sub + 1) * width - 1;
+}
+
+bool mgos_bme68x_lat_init(void) {
+  s_lat = (struct mgos_bme68x_lat_hist *) calloc(MGOS_BME68X_STAGE_MAX,
+                                                 sizeof(*s_lat));
+  return (s_lat != NULL);
+}
+
+void mgos_bme68x_lat_record(enum mgos_bme68x_stage stage, int64_t start) {
+  if (s_lat == NULL || stage >= MGOS_BME68X_STAGE_MAX) return;
+  int64_t d = mgos_uptime_micros() - start;
+  uint32_t us = (d > 0 ? (d < UINT32_MAX ? (uint32_t) d : UINT32_MAX) : 0);
+  mgos_bme68x_trace(MGOS_BME68X_TRACE_TIMING, stage, 0, us, 0);
+  struct mgos_bme68x_lat_hist *h = &s_lat[stage];
+  uint16_t *bc = &h->buckets[mgos_bme68x_lat_bucket(us)];
+  if (*bc == UINT16_MAX) {
+    for (int i = 0; i < MGOS_BME68X_LAT_NUM_BUCKETS; i++) h->buckets[i] /= 2;
+  }
+  (*bc)++;
+  if (h->count == 0 || us < h->min) h->min = us;
+  if (us > h->max) h->max = us;
+  h->count++;
+  h->sum += us;
+}
+
+// Value at quantile |q|, upper bound of the bucket.
+static uint32_t mgos_bme68x_lat_quantile(const struct mgos_bme68x_lat_hist *h,
+                                         uint32_t total, float q) {
+  uint32_t target = (uint32_t)(q * total + 0.5f), n = 0;
+  if (target == 0) target = 1;
+  for (int i = 0; i < MGOS_BME68X_LAT_NUM_BUCKETS; i++) {
+    n += h->buckets[i];
+    if (n >= target) {
+      uint32_t v = mgos_bme68x_lat_bucket_max(i);
+      return (v < h->max ? v : h->max);
+    }
+  }
+  return h->max;
+}
+
+bool mgos_bme68x_get_latency(enum mgos_bme68x_stage stage,
+                             struct mgos_bme68x_latency *lat) {
+  if (s_lat == NULL || stage >= MGOS_BME68X_STAGE_MAX) return false;
+  const struct mgos_bme68x_lat_hist *h = &s_lat[stage];
+  memset(lat, 0, sizeof(*lat));
+  lat->count = h->count;
+  if (h->count == 0) return true;
+  uint32_t total = 0;
+  for (int i = 0; i < MGOS_BME68X_LAT_NUM_BUCKETS; i++) total += h->buckets[i];
+  lat->min = h->min;
+  lat->max = h->max;
+  lat->mean = (uint32_t)(h->sum / h->count);
+  lat->p50 = mgos_bme68x_lat_quantile(h, total, 0.5f);
+  lat->p90 = mgos_bme68x_lat_quantile(h, total, 0.9f);
+  lat->p99 = mgos_bme68x_lat_quantile(h, total, 0.99f);
+  lat->p999 = mgos_bme68x_lat_quantile(h, total, 0.999f);
+  return true;
+}
+
+void mgos_bme68x_reset_latency(void) {
+  if (s_lat == NULL) return;
+  memset(s_lat, 0, MGOS_BME68X_STAGE_MAX * sizeof(*s_lat));
+}
+
+const char *mgos_bme68x_stage_name(enum mgos_bme68x_stage stage) {
+  if (stage >= MGOS_BME68X_STAGE_MAX) return "";
+  return s_stage_names[stage];
+}
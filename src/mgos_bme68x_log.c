@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// On-flash log of outputs or rollups, for store-and-forward.
+//
+// The device is split into pages that are written in order, round robin,
+// which spreads erases evenly. Each page starts with a header, followed
+// by records appended one after another. Records carry a CRC, so partially
+// written ones (power loss) are detected and skipped.
+// When all the records in a page have been delivered, the "drained" word
+// in the page header is cleared, which does not require an erase.
+// The page after the current one is erased from a timer when the current
+// one is nearly full, so appending a record is a single small write.
+// Records carry the boot count and wall clock time, so that records of
+// earlier boots can be told apart when replayed.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+#include "mgos_vfs_dev.h"
+
+#define MGOS_BME68X_LOG_PAGE_MAGIC 0x4c383642  // "B68L"
+#define MGOS_BME68X_LOG_REC_MAGIC 0xb668
+#define MGOS_BME68X_LOG_ERASED16 0xffff
+#define MGOS_BME68X_LOG_NOT_DRAINED 0xffffffff
+// Wall clock is considered set (e.g. by SNTP) once it is past this.
+#define MGOS_BME68X_LOG_MIN_WALL_TIME 1546300800  // 2019-01-01
+
+struct mgos_bme68x_log_page_hdr {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t drained;  // Cleared when all the records have been delivered.
+  uint32_t boot;     // Boot count when the page was started.
+};
+
+struct mgos_bme68x_log_rec_hdr {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t res;
+  uint16_t len;   // Payload length.
+  uint16_t boot;  // Boot count, low bits.
+  uint32_t seq;
+  uint32_t time;  // UNIX time, s, or 0 if the clock was not set.
+  uint32_t crc;  // Of the fields above and payload.
+};
+
+union mgos_bme68x_log_payload {
+  struct mgos_bme68x_ring_sample sample;
+  struct mgos_bme68x_rollup rollup;
+};
+
+struct mgos_bme68x_log_pos {
+  int page;
+  uint32_t off;
+};
+
+struct mgos_bme68x_log {
+  struct mgos_vfs_dev *dev;
+  int source;  // Rollup resolution or -1 for outputs.
+  uint32_t page_size;
+  int num_pages;
+  struct mgos_bme68x_log_pos wr;
+  struct mgos_bme68x_log_pos rd;   // Next record to read.
+  struct mgos_bme68x_log_pos ack;  // First record not yet acknowledged.
+  int erased_page;                 // Page that was erased in advance.
+  bool erase_pending;
+  uint32_t next_page_seq;
+  uint32_t next_rec_seq;
+  uint32_t boot;
+  struct mgos_bme68x_log_stats stats;
+};
+
+static struct mgos_bme68x_log *s_log;
+
+static uint32_t mgos_bme68x_log_rec_size(uint16_t len) {
+  return (sizeof(struct mgos_bme68x_log_rec_hdr) + len + 3) & ~3U;
+}
+
+static size_t mgos_bme68x_log_page_off(const struct mgos_bme68x_log *l,
+                                       int page) {
+  return (size_t) page * l->page_size;
+}
+
+static uint32_t mgos_bme68x_log_rec_crc(
+    const struct mgos_bme68x_log_rec_hdr *h, const void *payload) {
+  uint32_t crc = cs_crc32(0, h, offsetof(struct mgos_bme68x_log_rec_hdr, crc));
+  return cs_crc32(crc, payload, h->len);
+}
+
+static bool mgos_bme68x_log_write(struct mgos_bme68x_log *l, size_t off,
+                                  size_t len, const void *data) {
+  if (mgos_vfs_dev_write(l->dev, off, len, data) != MGOS_VFS_DEV_ERR_NONE) {
+    LOG(LL_ERROR, ("Flash log write error @ %u", (unsigned) off));
+    return false;
+  }
+  l->stats.flash_bytes += len;
+  return true;
+}
+
+static void mgos_bme68x_log_mark_drained(struct mgos_bme68x_log *l,
+                                         int page) {
+  uint32_t drained = 0;
+  mgos_bme68x_log_write(
+      l,
+      mgos_bme68x_log_page_off(l, page) +
+          offsetof(struct mgos_bme68x_log_page_hdr, drained),
+      sizeof(drained), &drained);
+}
+
+static void mgos_bme68x_log_first_rec(struct mgos_bme68x_log *l, int page,
+                                      struct mgos_bme68x_log_pos *pos) {
+  pos->page = page;
+  pos->off = sizeof(struct mgos_bme68x_log_page_hdr);
+  (void) l;
+}
+
+// Erase the page that follows the current one. Anything in it is lost.
+static bool mgos_bme68x_log_erase_next(struct mgos_bme68x_log *l) {
+  int page = (l->wr.page + 1) % l->num_pages;
+  if (l->erased_page == page) return true;
+  int next = (page + 1) % l->num_pages;
+  if (l->ack.page == page) {
+    LOG(LL_WARN, ("Flash log full, dropping undelivered page %d", page));
+    mgos_bme68x_log_first_rec(l, next, &l->ack);
+    l->stats.num_lost++;
+  }
+  if (l->rd.page == page) l->rd = l->ack;
+  if (mgos_vfs_dev_erase(l->dev, mgos_bme68x_log_page_off(l, page),
+                         l->page_size) != MGOS_VFS_DEV_ERR_NONE) {
+    LOG(LL_ERROR, ("Flash log erase error, page %d", page));
+    return false;
+  }
+  l->stats.num_erases++;
+  l->erased_page = page;
+  return true;
+}
+
+static void mgos_bme68x_log_erase_timer_cb(void *arg) {
+  struct mgos_bme68x_log *l = (struct mgos_bme68x_log *) arg;
+  l->erase_pending = false;
+  mgos_bme68x_log_erase_next(l);
+}
+
+// Erase the next page once there is room for at most one more record of
+// the largest size in the current one.
+static void mgos_bme68x_log_schedule_erase(struct mgos_bme68x_log *l) {
+  uint32_t max_rec_size =
+      mgos_bme68x_log_rec_size(sizeof(union mgos_bme68x_log_payload));
+  if (l->erase_pending || l->erased_page == (l->wr.page + 1) % l->num_pages ||
+      l->wr.off + 2 * max_rec_size <= l->page_size) {
+    return;
+  }
+  l->erase_pending = true;
+  mgos_set_timer(0, 0, mgos_bme68x_log_erase_timer_cb, l);
+}
+
+static bool mgos_bme68x_log_write_page_hdr(struct mgos_bme68x_log *l,
+                                           int page) {
+  struct mgos_bme68x_log_page_hdr ph = {
+      .magic = MGOS_BME68X_LOG_PAGE_MAGIC,
+      .seq = l->next_page_seq++,
+      .drained = MGOS_BME68X_LOG_NOT_DRAINED,
+      .boot = l->boot,
+  };
+  return mgos_bme68x_log_write(l, mgos_bme68x_log_page_off(l, page),
+                               sizeof(ph), &ph);
+}
+
+static bool mgos_bme68x_log_start_page(struct mgos_bme68x_log *l) {
+  int page = (l->wr.page + 1) % l->num_pages;
+  if (l->erased_page != page) {
+    // Writes came faster than the erase timer. Do not erase here, that
+    // would block the output path.
+    mgos_bme68x_log_schedule_erase(l);
+    return false;
+  }
+  l->erased_page = -1;
+  if (!mgos_bme68x_log_write_page_hdr(l, page)) return false;
+  bool empty = (l->rd.page == l->wr.page && l->rd.off >= l->wr.off);
+  mgos_bme68x_log_first_rec(l, page, &l->wr);
+  // If everything has been delivered, move the cursors along.
+  if (empty && l->ack.page == l->rd.page && l->ack.off == l->rd.off) {
+    mgos_bme68x_log_mark_drained(l, l->ack.page);
+    l->rd = l->ack = l->wr;
+  }
+  return true;
+}
+
+static void mgos_bme68x_log_append_rec(uint8_t type, uint8_t res,
+                                       const void *payload, uint16_t len) {
+  struct mgos_bme68x_log *l = s_log;
+  struct {
+    struct mgos_bme68x_log_rec_hdr h;
+    union mgos_bme68x_log_payload p;
+    uint8_t pad[4];
+  } buf;
+  uint32_t rec_size = mgos_bme68x_log_rec_size(len);
+  if (l->wr.off + rec_size > l->page_size &&
+      !mgos_bme68x_log_start_page(l)) {
+    l->stats.num_dropped++;
+    return;
+  }
+  double now = mg_time();
+  memset(&buf, 0xff, rec_size);
+  buf.h.magic = MGOS_BME68X_LOG_REC_MAGIC;
+  buf.h.type = type;
+  buf.h.res = res;
+  buf.h.len = len;
+  buf.h.boot = (uint16_t) l->boot;
+  buf.h.seq = l->next_rec_seq++;
+  buf.h.time = (now > MGOS_BME68X_LOG_MIN_WALL_TIME ? (uint32_t) now : 0);
+  memcpy(&buf.p, payload, len);
+  buf.h.crc = mgos_bme68x_log_rec_crc(&buf.h, &buf.p);
+  if (!mgos_bme68x_log_write(
+          l, mgos_bme68x_log_page_off(l, l->wr.page) + l->wr.off, rec_size,
+          &buf)) {
+    // Do not write to this page anymore.
+    l->wr.off = l->page_size;
+    return;
+  }
+  l->wr.off += rec_size;
+  l->stats.num_records++;
+  l->stats.payload_bytes += len;
+  mgos_bme68x_log_schedule_erase(l);
+}
+
+void mgos_bme68x_log_append(const struct mgos_bsec_output *out) {
+  if (s_log == NULL || s_log->source >= 0 || out->num_outputs == 0) return;
+  struct mgos_bme68x_ring_sample s;
+  mgos_bme68x_sample_from_output(out, &s);
+  mgos_bme68x_log_append_rec(MGOS_BME68X_LOG_REC_SAMPLE, 0, &s, sizeof(s));
+}
+
+static void mgos_bme68x_log_rollup_cb(int ev, void *ev_data, void *arg) {
+  const struct mgos_bme68x_rollup_ev *rev =
+      (const struct mgos_bme68x_rollup_ev *) ev_data;
+  if (s_log == NULL || (int) rev->res != s_log->source) return;
+  mgos_bme68x_log_append_rec(MGOS_BME68X_LOG_REC_ROLLUP, rev->res, rev->r,
+                             sizeof(*rev->r));
+  (void) ev;
+  (void) arg;
+}
+
+// Move the read cursor to the next page, unless it is the current one.
+static bool mgos_bme68x_log_rd_next_page(struct mgos_bme68x_log *l) {
+  if (l->rd.page == l->wr.page) {
+    l->rd.off = l->wr.off;
+    return false;
+  }
+  mgos_bme68x_log_first_rec(l, (l->rd.page + 1) % l->num_pages, &l->rd);
+  return true;
+}
+
+bool mgos_bme68x_log_read(struct mgos_bme68x_log_record *rec) {
+  struct mgos_bme68x_log *l = s_log;
+  if (l == NULL) return false;
+  while (true) {
+    if (l->rd.page == l->wr.page && l->rd.off >= l->wr.off) return false;
+    struct mgos_bme68x_log_rec_hdr h;
+    union mgos_bme68x_log_payload p;
+    size_t off = mgos_bme68x_log_page_off(l, l->rd.page) + l->rd.off;
+    if (l->rd.off + sizeof(h) > l->page_size ||
+        mgos_vfs_dev_read(l->dev, off, sizeof(h), &h) !=
+            MGOS_VFS_DEV_ERR_NONE ||
+        h.magic == MGOS_BME68X_LOG_ERASED16) {
+      // End of page.
+      if (!mgos_bme68x_log_rd_next_page(l)) return false;
+      continue;
+    }
+    uint32_t rec_size = mgos_bme68x_log_rec_size(h.len);
+    if (h.magic != MGOS_BME68X_LOG_REC_MAGIC || h.len > sizeof(p) ||
+        l->rd.off + rec_size > l->page_size ||
+        mgos_vfs_dev_read(l->dev, off + sizeof(h), h.len, &p) !=
+            MGOS_VFS_DEV_ERR_NONE ||
+        mgos_bme68x_log_rec_crc(&h, &p) != h.crc) {
+      // Nothing after a bad record can be trusted.
+      l->stats.num_corrupted++;
+      if (!mgos_bme68x_log_rd_next_page(l)) return false;
+      continue;
+    }
+    l->rd.off += rec_size;
+    if ((h.type == MGOS_BME68X_LOG_REC_SAMPLE && h.len != sizeof(p.sample)) ||
+        (h.type == MGOS_BME68X_LOG_REC_ROLLUP && h.len != sizeof(p.rollup))) {
+      continue;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->seq = h.seq;
+    rec->boot = h.boot;
+    rec->time = h.time;
+    rec->type = (enum mgos_bme68x_log_rec_type) h.type;
+    rec->res = (enum mgos_bme68x_rollup_res) h.res;
+    memcpy(&rec->sample, &p, h.len);
+    return true;
+  }
+}
+
+void mgos_bme68x_log_ack(void) {
+  struct mgos_bme68x_log *l = s_log;
+  if (l == NULL) return;
+  while (l->ack.page != l->rd.page) {
+    mgos_bme68x_log_mark_drained(l, l->ack.page);
+    l->ack.page = (l->ack.page + 1) % l->num_pages;
+  }
+  l->ack = l->rd;
+}
+
+void mgos_bme68x_log_rewind(void) {
+  if (s_log == NULL) return;
+  s_log->rd = s_log->ack;
+}
+
+bool mgos_bme68x_log_get_stats(struct mgos_bme68x_log_stats *stats) {
+  const struct mgos_bme68x_log *l = s_log;
+  if (l == NULL) return false;
+  *stats = l->stats;
+  stats->write_amp =
+      (l->stats.payload_bytes > 0
+           ? (float) l->stats.flash_bytes / l->stats.payload_bytes
+           : 0);
+  return true;
+}
+
+// Find the end of the last page: first erased slot or a bad record.
+// Also finds the boot count of the last record.
+static uint32_t mgos_bme68x_log_scan_page(struct mgos_bme68x_log *l, int page,
+                                          uint32_t *next_rec_seq,
+                                          uint32_t *boot) {
+  uint32_t off = sizeof(struct mgos_bme68x_log_page_hdr);
+  while (off + sizeof(struct mgos_bme68x_log_rec_hdr) <= l->page_size) {
+    struct mgos_bme68x_log_rec_hdr h;
+    union mgos_bme68x_log_payload p;
+    size_t poff = mgos_bme68x_log_page_off(l, page) + off;
+    if (mgos_vfs_dev_read(l->dev, poff, sizeof(h), &h) !=
+        MGOS_VFS_DEV_ERR_NONE) {
+      break;
+    }
+    if (h.magic == MGOS_BME68X_LOG_ERASED16) return off;
+    uint32_t rec_size = mgos_bme68x_log_rec_size(h.len);
+    if (h.magic != MGOS_BME68X_LOG_REC_MAGIC || h.len > sizeof(p) ||
+        off + rec_size > l->page_size ||
+        mgos_vfs_dev_read(l->dev, poff + sizeof(h), h.len, &p) !=
+            MGOS_VFS_DEV_ERR_NONE ||
+        mgos_bme68x_log_rec_crc(&h, &p) != h.crc) {
+      break;
+    }
+    *next_rec_seq = h.seq + 1;
+    // Page header has all the bits, records only the low ones.
+    *boot = (*boot & ~0xffffU) | h.boot;
+    off += rec_size;
+  }
+  // Interrupted write, continue on the next page.
+  return l->page_size;
+}
+
+static bool mgos_bme68x_log_recover(struct mgos_bme68x_log *l) {
+  int head = -1;
+  struct mgos_bme68x_log_page_hdr ph;
+  for (int i = 0; i < l->num_pages; i++) {
+    if (mgos_vfs_dev_read(l->dev, mgos_bme68x_log_page_off(l, i), sizeof(ph),
+                          &ph) != MGOS_VFS_DEV_ERR_NONE) {
+      return false;
+    }
+    if (ph.magic != MGOS_BME68X_LOG_PAGE_MAGIC) continue;
+    if (head < 0 || ph.seq >= l->next_page_seq) {
+      head = i;
+      l->next_page_seq = ph.seq + 1;
+      l->boot = ph.boot;
+    }
+  }
+  if (head < 0) {
+    // Empty log, start from page 0.
+    if (mgos_vfs_dev_erase(l->dev, 0, l->page_size) != MGOS_VFS_DEV_ERR_NONE ||
+        !mgos_bme68x_log_write_page_hdr(l, 0)) {
+      return false;
+    }
+    l->stats.num_erases++;
+    mgos_bme68x_log_first_rec(l, 0, &l->wr);
+    l->rd = l->ack = l->wr;
+    mgos_bme68x_log_schedule_erase(l);
+    return true;
+  }
+  l->wr.page = head;
+  l->wr.off = mgos_bme68x_log_scan_page(l, head, &l->next_rec_seq, &l->boot);
+  l->boot++;
+  l->ack = l->wr;
+  // Oldest page that has not been drained, in write order.
+  for (int i = 1; i <= l->num_pages; i++) {
+    int page = (head + i) % l->num_pages;
+    if (mgos_vfs_dev_read(l->dev, mgos_bme68x_log_page_off(l, page),
+                          sizeof(ph), &ph) != MGOS_VFS_DEV_ERR_NONE) {
+      return false;
+    }
+    if (ph.magic == MGOS_BME68X_LOG_PAGE_MAGIC &&
+        ph.drained == MGOS_BME68X_LOG_NOT_DRAINED) {
+      mgos_bme68x_log_first_rec(l, page, &l->ack);
+      break;
+    }
+  }
+  l->rd = l->ack;
+  mgos_bme68x_log_schedule_erase(l);
+  return true;
+}
+
+bool mgos_bme68x_log_init(const struct mgos_config_bme68x_log *cfg) {
+  int source = -1;
+  if (cfg->source == NULL || strcmp(cfg->source, "output") == 0) {
+    source = -1;
+  } else if (strcmp(cfg->source, "1m") == 0) {
+    source = MGOS_BME68X_ROLLUP_MIN;
+  } else if (strcmp(cfg->source, "1h") == 0) {
+    source = MGOS_BME68X_ROLLUP_HOUR;
+  } else if (strcmp(cfg->source, "1d") == 0) {
+    source = MGOS_BME68X_ROLLUP_DAY;
+  } else {
+    LOG(LL_ERROR, ("Invalid log source %s", cfg->source));
+    return false;
+  }
+  if (cfg->page_size < 512 || cfg->page_size % 4 != 0) {
+    LOG(LL_ERROR, ("Invalid log page size %d", cfg->page_size));
+    return false;
+  }
+  struct mgos_vfs_dev *dev = mgos_vfs_dev_open(cfg->dev);
+  if (dev == NULL) {
+    LOG(LL_ERROR, ("Failed to open %s", (cfg->dev ? cfg->dev : "")));
+    return false;
+  }
+  size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  if (mgos_vfs_dev_get_erase_sizes(dev, erase_sizes) ==
+          MGOS_VFS_DEV_ERR_NONE &&
+      erase_sizes[0] > 0 && cfg->page_size % erase_sizes[0] != 0) {
+    LOG(LL_ERROR, ("Log page size %d is not a multiple of erase size %u",
+                   cfg->page_size, (unsigned) erase_sizes[0]));
+    mgos_vfs_dev_close(dev);
+    return false;
+  }
+  struct mgos_bme68x_log *l = (struct mgos_bme68x_log *) calloc(1, sizeof(*l));
+  if (l == NULL) {
+    mgos_vfs_dev_close(dev);
+    return false;
+  }
+  l->dev = dev;
+  l->source = source;
+  l->page_size = cfg->page_size;
+  l->num_pages = mgos_vfs_dev_get_size(dev) / cfg->page_size;
+  l->erased_page = -1;
+  l->stats.num_pages = l->num_pages;
+  l->stats.page_size = l->page_size;
+  if (l->num_pages < 2) {
+    LOG(LL_ERROR, ("Log device is too small"));
+    free(l);
+    mgos_vfs_dev_close(dev);
+    return false;
+  }
+  if (!mgos_bme68x_log_recover(l)) {
+    free(l);
+    mgos_vfs_dev_close(dev);
+    return false;
+  }
+  if (source >= 0) {
+    mgos_event_add_handler(MGOS_EV_BME68X_ROLLUP, mgos_bme68x_log_rollup_cb,
+                           NULL);
+  }
+  s_log = l;
+  LOG(LL_INFO,
+      ("Flash log on %s: %d x %u, page %d @ %u, next seq %u, boot %u",
+       cfg->dev, l->num_pages, (unsigned) l->page_size, l->wr.page,
+       (unsigned) l->wr.off, (unsigned) l->next_rec_seq, (unsigned) l->boot));
+  return true;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Adaptive IAQ sample rate controller.
+// A boost rate client: the configured rate (normally ULP) is the floor,
+// the controller steps up to LP (and CONT, if allowed) when IAQ moves fast
+// or accuracy is low and steps back down once IAQ has been stable for
+// |hold| seconds. With an energy budget, spending is tracked with a token
+// bucket holding up to one hour of budget and stepping up is only allowed
+// while there is credit left.
+
+#include "mgos_bme68x_internal.h"
+
+#include <math.h>
+
+#include "mgos.h"
+
+static const float s_level_sr[MGOS_BSEC_RATECTL_MAX] = {
+    [MGOS_BSEC_RATECTL_ULP] = BSEC_SAMPLE_RATE_DISABLED,  // Floor.
+    [MGOS_BSEC_RATECTL_LP] = BSEC_SAMPLE_RATE_LP,
+    [MGOS_BSEC_RATECTL_CONT] = BSEC_SAMPLE_RATE_CONT,
+};
+
+static const char *s_level_names[MGOS_BSEC_RATECTL_MAX] = {"ULP", "LP",
+                                                           "CONT"};
+
+struct mgos_bsec_ratectl {
+  struct mgos_bsec_rate_client *client;
+  enum mgos_bsec_ratectl_level max_level;
+  float rate_up, rate_down;
+  int64_t hold_ns;
+  int accuracy;
+  float budget_mj_h;
+  // State.
+  float prev_iaq;
+  int64_t prev_ts;       // 0 if there is no previous value.
+  int64_t stable_since;  // -1 if IAQ is not stable.
+  float credit_mj;
+  float prev_total_mj;
+  int64_t level_since_us;
+  struct mgos_bsec_ratectl_stats stats;
+};
+
+static struct mgos_bsec_ratectl *s_rc;
+
+static void mgos_bsec_ratectl_set_level(struct mgos_bsec_ratectl *rc,
+                                        enum mgos_bsec_ratectl_level level,
+                                        const char *why) {
+  struct mgos_bsec_ratectl_stats *st = &rc->stats;
+  if (level == st->level) return;
+  bsec_library_return_t ret = mgos_bsec_rate_client_set(
+      rc->client, MGOS_BSEC_SENSOR_IAQ, s_level_sr[level]);
+  if (ret != BSEC_OK) {
+    // Rate may not be supported by the BSEC config, stay where we are.
+    LOG(LL_ERROR, ("IAQ rate %s -> %s (%s) failed: %d",
+                   s_level_names[st->level], s_level_names[level], why, ret));
+    mgos_bsec_rate_client_set(rc->client, MGOS_BSEC_SENSOR_IAQ,
+                              s_level_sr[st->level]);
+    return;
+  }
+  int64_t now = mgos_uptime_micros();
+  st->level_ms[st->level] += (now - rc->level_since_us) / 1000;
+  rc->level_since_us = now;
+  LOG(LL_INFO, ("IAQ rate %s -> %s (%s)", s_level_names[st->level],
+                s_level_names[level], why));
+  st->level = level;
+  st->num_switches++;
+}
+
+// Update the token bucket, returns true if there is credit left.
+static bool mgos_bsec_ratectl_budget_ok(struct mgos_bsec_ratectl *rc,
+                                        int64_t dt_ns) {
+  if (rc->budget_mj_h <= 0) return true;
+  struct mgos_bme68x_energy e;
+  if (!mgos_bme68x_get_energy(&e)) return true;
+  float spent = e.total_mj - rc->prev_total_mj;
+  // Energy stats may have been reset in the meantime.
+  if (spent < 0) spent = e.total_mj;
+  rc->prev_total_mj = e.total_mj;
+  rc->credit_mj += rc->budget_mj_h * (dt_ns / 3600e9f) - spent;
+  if (rc->credit_mj > rc->budget_mj_h) rc->credit_mj = rc->budget_mj_h;
+  rc->stats.credit_mj = rc->credit_mj;
+  return (rc->credit_mj > 0);
+}
+
+void mgos_bsec_ratectl_update(const struct mgos_bsec_output *out) {
+  struct mgos_bsec_ratectl *rc = s_rc;
+  if (rc == NULL) return;
+  const bsec_output_t *iaq = NULL;
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    if (out->outputs[i].sensor_id == BSEC_OUTPUT_IAQ) iaq = &out->outputs[i];
+  }
+  if (iaq == NULL) return;
+  int64_t ts = iaq->time_stamp;
+  int64_t dt = (rc->prev_ts != 0 ? ts - rc->prev_ts : 0);
+  float rate = 0;  // Change per minute.
+  if (dt > 0) rate = fabsf(iaq->signal - rc->prev_iaq) * (60e9f / dt);
+  rc->prev_iaq = iaq->signal;
+  rc->prev_ts = ts;
+  rc->stats.rate = rate;
+  bool budget_ok = mgos_bsec_ratectl_budget_ok(rc, dt);
+  enum mgos_bsec_ratectl_level level = rc->stats.level;
+  if (!budget_ok) {
+    rc->stable_since = -1;
+    mgos_bsec_ratectl_set_level(rc, MGOS_BSEC_RATECTL_ULP, "budget");
+    return;
+  }
+  if (iaq->accuracy < rc->accuracy) {
+    rc->stable_since = -1;
+    if (level < MGOS_BSEC_RATECTL_LP) {
+      mgos_bsec_ratectl_set_level(rc, MGOS_BSEC_RATECTL_LP, "accuracy");
+    }
+    return;
+  }
+  if (rate > rc->rate_up) {
+    rc->stable_since = -1;
+    if (level < rc->max_level) {
+      mgos_bsec_ratectl_set_level(rc, level + 1, "change");
+    }
+    return;
+  }
+  if (rate >= rc->rate_down) {
+    rc->stable_since = -1;
+    return;
+  }
+  if (rc->stable_since < 0) rc->stable_since = ts;
+  if (level > MGOS_BSEC_RATECTL_ULP && ts - rc->stable_since >= rc->hold_ns) {
+    mgos_bsec_ratectl_set_level(rc, level - 1, "stable");
+    rc->stable_since = ts;
+  }
+}
+
+bool mgos_bsec_ratectl_init(const struct mgos_config_bme68x_ratectl *cfg) {
+  if (cfg->rate_down > cfg->rate_up) return false;
+  struct mgos_bsec_ratectl *rc =
+      (struct mgos_bsec_ratectl *) calloc(1, sizeof(*rc));
+  if (rc == NULL) return false;
+  rc->max_level = (cfg->cont ? MGOS_BSEC_RATECTL_CONT : MGOS_BSEC_RATECTL_LP);
+  rc->rate_up = cfg->rate_up;
+  rc->rate_down = cfg->rate_down;
+  rc->hold_ns = cfg->hold * 1000000000LL;
+  rc->accuracy = cfg->accuracy;
+  rc->budget_mj_h = cfg->budget;
+  rc->credit_mj = rc->budget_mj_h;
+  rc->stable_since = -1;
+  rc->level_since_us = mgos_uptime_micros();
+  rc->client = mgos_bsec_rate_client_create_int("ratectl", true /* boost */,
+                                                NULL, NULL);
+  if (rc->client == NULL) {
+    free(rc);
+    return false;
+  }
+  struct mgos_bme68x_energy e;
+  if (rc->budget_mj_h > 0 && !mgos_bme68x_get_energy(&e)) {
+    LOG(LL_WARN, ("Energy budget requires bme68x.energy, ignored"));
+  }
+  s_rc = rc;
+  return true;
+}
+
+// Cycles per hour and energy per cycle, from the energy stats if available.
+static float mgos_bsec_ratectl_predict_mj_h(float sr) {
+  struct mgos_bme68x_energy e;
+  if (!mgos_bme68x_get_energy(&e) || e.num_cycles == 0) return 0;
+  return sr * 3600 * (e.total_mj / e.num_cycles);
+}
+
+bool mgos_bsec_ratectl_get_stats(struct mgos_bsec_ratectl_stats *stats) {
+  const struct mgos_bsec_ratectl *rc = s_rc;
+  if (rc == NULL) return false;
+  *stats = rc->stats;
+  stats->level_ms[rc->stats.level] +=
+      (mgos_uptime_micros() - rc->level_since_us) / 1000;
+  float sr = mgos_bsec_get_sample_rate(MGOS_BSEC_SENSOR_IAQ);
+  stats->predicted_mj_h =
+      (sr != BSEC_SAMPLE_RATE_DISABLED ? mgos_bsec_ratectl_predict_mj_h(sr)
+                                       : 0);
+  return true;
+}
+
+const char *mgos_bsec_ratectl_level_name(enum mgos_bsec_ratectl_level level) {
+  if (level >= MGOS_BSEC_RATECTL_MAX) return "";
+  return s_level_names[level];
+}
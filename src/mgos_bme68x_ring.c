@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// In-memory history of recent outputs.
+// Stored as structure of arrays in a single allocation made at init,
+// appending is O(1) and does not allocate.
+
+#include "mgos_bme68x_internal.h"
+
+#include <math.h>
+
+#include "mgos.h"
+
+struct mgos_bme68x_ring {
+  int size;
+  int count;
+  int head;  // Next slot to write.
+  int64_t *ts;
+  float *v[MGOS_BME68X_SIG_MAX];
+  uint8_t *iaq_acc;
+};
+
+static struct mgos_bme68x_ring *s_ring;
+
+bool mgos_bme68x_ring_init(int size) {
+  size_t sz = sizeof(*s_ring) + size * (sizeof(int64_t) + sizeof(uint8_t) +
+                                        MGOS_BME68X_SIG_MAX * sizeof(float));
+  uint8_t *p = (uint8_t *) calloc(1, sz);
+  if (p == NULL) return false;
+  struct mgos_bme68x_ring *r = (struct mgos_bme68x_ring *) p;
+  p += sizeof(*r);
+  r->size = size;
+  r->ts = (int64_t *) p;
+  p += size * sizeof(int64_t);
+  for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+    r->v[i] = (float *) p;
+    p += size * sizeof(float);
+  }
+  r->iaq_acc = p;
+  s_ring = r;
+  return true;
+}
+
+void mgos_bme68x_sample_from_output(const struct mgos_bsec_output *out,
+                                    struct mgos_bme68x_ring_sample *s) {
+  s->ts = (out->num_outputs > 0 ? out->outputs[0].time_stamp : 0);
+  s->iaq_acc = 0;
+  for (int j = 0; j < MGOS_BME68X_SIG_MAX; j++) s->v[j] = NAN;
+  for (uint8_t k = 0; k < out->num_outputs; k++) {
+    const bsec_output_t *o = &out->outputs[k];
+    int sig = mgos_bme68x_signal_from_sensor_id(o->sensor_id);
+    if (sig < 0) continue;
+    s->v[sig] = o->signal;
+    if (sig == MGOS_BME68X_SIG_IAQ) s->iaq_acc = o->accuracy;
+  }
+}
+
+void mgos_bme68x_ring_append(const struct mgos_bsec_output *out) {
+  struct mgos_bme68x_ring *r = s_ring;
+  if (r == NULL || out->num_outputs == 0) return;
+  struct mgos_bme68x_ring_sample s;
+  mgos_bme68x_sample_from_output(out, &s);
+  int i = r->head;
+  r->ts[i] = s.ts;
+  for (int j = 0; j < MGOS_BME68X_SIG_MAX; j++) r->v[j][i] = s.v[j];
+  r->iaq_acc[i] = s.iaq_acc;
+  r->head = (i + 1) % r->size;
+  if (r->count < r->size) r->count++;
+}
+
+// Slot of the n-th oldest sample.
+static int mgos_bme68x_ring_slot(const struct mgos_bme68x_ring *r, int n) {
+  return (r->head - r->count + n + r->size) % r->size;
+}
+
+static void mgos_bme68x_ring_get(const struct mgos_bme68x_ring *r, int n,
+                                 struct mgos_bme68x_ring_sample *s) {
+  int i = mgos_bme68x_ring_slot(r, n);
+  s->ts = r->ts[i];
+  for (int j = 0; j < MGOS_BME68X_SIG_MAX; j++) s->v[j] = r->v[j][i];
+  s->iaq_acc = r->iaq_acc[i];
+}
+
+int mgos_bme68x_ring_count(void) {
+  return (s_ring != NULL ? s_ring->count : 0);
+}
+
+int mgos_bme68x_ring_get_range(int64_t from_ts, int64_t to_ts,
+                               struct mgos_bme68x_ring_sample *samples,
+                               int max) {
+  const struct mgos_bme68x_ring *r = s_ring;
+  if (r == NULL) return 0;
+  // Timestamps are increasing, find the first one >= from_ts.
+  int lo = 0, hi = r->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (r->ts[mgos_bme68x_ring_slot(r, mid)] < from_ts) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  int n = 0;
+  for (int k = lo; k < r->count && n < max; k++) {
+    if (r->ts[mgos_bme68x_ring_slot(r, k)] >= to_ts) break;
+    mgos_bme68x_ring_get(r, k, &samples[n++]);
+  }
+  return n;
+}
+
+int mgos_bme68x_ring_get_last(int n, struct mgos_bme68x_ring_sample *samples) {
+  const struct mgos_bme68x_ring *r = s_ring;
+  if (r == NULL) return 0;
+  if (n > r->count) n = r->count;
+  for (int k = 0; k < n; k++) {
+    mgos_bme68x_ring_get(r, r->count - n + k, &samples[k]);
+  }
+  return n;
+}
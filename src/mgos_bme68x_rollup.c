@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Rollups: min / max / mean / variance of outputs over fixed periods.
+// Updated in O(1) per sample, complete periods are kept in small rings.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+// Wall clock is considered set (e.g. by SNTP) once it is past this.
+#define MGOS_BME68X_ROLLUP_MIN_WALL_TIME 1546300800  // 2019-01-01
+
+static const int64_t s_periods[MGOS_BME68X_ROLLUP_MAX] = {
+    60 * 1000000000LL,
+    3600 * 1000000000LL,
+    86400 * 1000000000LL,
+};
+
+struct mgos_bme68x_rollup_ring {
+  struct mgos_bme68x_rollup cur;
+  struct mgos_bme68x_rollup *hist;
+  int size;
+  int count;
+  int head;  // Next slot to write.
+};
+
+static struct mgos_bme68x_rollup_ring *s_rollups;
+
+float mgos_bme68x_stats_variance(const struct mgos_bme68x_stats *st) {
+  if (st->count < 2) return 0;
+  return st->m2 / (st->count - 1);
+}
+
+static void mgos_bme68x_stats_add(struct mgos_bme68x_stats *st, float v) {
+  st->count++;
+  if (st->count == 1) {
+    st->min = st->max = st->mean = v;
+    st->m2 = 0;
+    return;
+  }
+  if (v < st->min) st->min = v;
+  if (v > st->max) st->max = v;
+  float delta = v - st->mean;
+  st->mean += delta / st->count;
+  st->m2 += delta * (v - st->mean);
+}
+
+bool mgos_bme68x_rollup_init(const struct mgos_config_bme68x_rollup *cfg) {
+  const int keep[MGOS_BME68X_ROLLUP_MAX] = {cfg->keep_min, cfg->keep_hour,
+                                            cfg->keep_day};
+  struct mgos_bme68x_rollup_ring *rs = (struct mgos_bme68x_rollup_ring *)
+      calloc(MGOS_BME68X_ROLLUP_MAX, sizeof(*rs));
+  if (rs == NULL) return false;
+  for (int i = 0; i < MGOS_BME68X_ROLLUP_MAX; i++) {
+    rs[i].cur.start_ts = -1;
+    if (keep[i] <= 0) continue;
+    rs[i].hist = (struct mgos_bme68x_rollup *) calloc(keep[i],
+                                                       sizeof(*rs[i].hist));
+    if (rs[i].hist == NULL) {
+      while (i-- > 0) free(rs[i].hist);
+      free(rs);
+      return false;
+    }
+    rs[i].size = keep[i];
+  }
+  s_rollups = rs;
+  return true;
+}
+
+static void mgos_bme68x_rollup_close(enum mgos_bme68x_rollup_res res) {
+  struct mgos_bme68x_rollup_ring *rr = &s_rollups[res];
+  const struct mgos_bme68x_rollup *r = &rr->cur;
+  if (rr->size > 0) {
+    rr->hist[rr->head] = rr->cur;
+    r = &rr->hist[rr->head];
+    rr->head = (rr->head + 1) % rr->size;
+    if (rr->count < rr->size) rr->count++;
+  }
+  struct mgos_bme68x_rollup_ev ev = {.res = res, .r = r};
+  mgos_event_trigger(MGOS_EV_BME68X_ROLLUP, &ev);
+}
+
+void mgos_bme68x_rollup_update(const struct mgos_bsec_output *out) {
+  if (s_rollups == NULL || out->num_outputs == 0) return;
+  // Periods are aligned to wall clock once it is set, so that rollups are
+  // comparable across reboots and devices. Until then BSEC time is used.
+  int64_t ts = out->outputs[0].time_stamp;
+  double now = mg_time();
+  bool wall_time = (now > MGOS_BME68X_ROLLUP_MIN_WALL_TIME);
+  if (wall_time) ts = (int64_t)(now * 1e9);
+  for (int res = 0; res < MGOS_BME68X_ROLLUP_MAX; res++) {
+    struct mgos_bme68x_rollup_ring *rr = &s_rollups[res];
+    int64_t start = ts - ts % s_periods[res];
+    if (start != rr->cur.start_ts || wall_time != rr->cur.wall_time) {
+      if (rr->cur.start_ts >= 0) mgos_bme68x_rollup_close(res);
+      memset(&rr->cur, 0, sizeof(rr->cur));
+      rr->cur.start_ts = start;
+      rr->cur.wall_time = wall_time;
+    }
+    for (uint8_t i = 0; i < out->num_outputs; i++) {
+      const bsec_output_t *o = &out->outputs[i];
+      int sig = mgos_bme68x_signal_from_sensor_id(o->sensor_id);
+      if (sig < 0) continue;
+      mgos_bme68x_stats_add(&rr->cur.sig[sig], o->signal);
+    }
+  }
+}
+
+bool mgos_bme68x_rollup_get(enum mgos_bme68x_rollup_res res, int n,
+                            struct mgos_bme68x_rollup *r) {
+  if (s_rollups == NULL || res >= MGOS_BME68X_ROLLUP_MAX || n < 0) {
+    return false;
+  }
+  const struct mgos_bme68x_rollup_ring *rr = &s_rollups[res];
+  if (n == 0) {
+    if (rr->cur.start_ts < 0) return false;
+    *r = rr->cur;
+    return true;
+  }
+  if (n > rr->count) return false;
+  *r = rr->hist[(rr->head - n + rr->size) % rr->size];
+  return true;
+}
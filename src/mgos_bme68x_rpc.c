@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_bme68x_internal.h"
+
+#include <math.h>
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#ifndef MGOS_BME68X_RPC_MAX_HISTORY_CHUNK
+#define MGOS_BME68X_RPC_MAX_HISTORY_CHUNK 50
+#endif
+
+static int mgos_bme68x_print_outputs(struct json_out *out, va_list *ap) {
+  const bsec_output_t *outputs = va_arg(*ap, const bsec_output_t *);
+  int num_outputs = va_arg(*ap, int);
+  int len = json_printf(out, "[");
+  for (int i = 0; i < num_outputs; i++) {
+    const bsec_output_t *o = &outputs[i];
+    len += json_printf(out, "%s{id: %d, ts: %lld, v: %.3f, acc: %d}",
+                       (i > 0 ? ", " : ""), o->sensor_id,
+                       (long long) o->time_stamp, o->signal, o->accuracy);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+// Serves the latest snapshot, does not touch the sensor.
+static void mgos_bme68x_get_latest_handler(struct mg_rpc_request_info *ri,
+                                           void *cb_arg,
+                                           struct mg_rpc_frame_info *fi,
+                                           struct mg_str args) {
+  struct mgos_bme68x_latest *l =
+      (struct mgos_bme68x_latest *) calloc(1, sizeof(*l));
+  if (l == NULL) {
+    mg_rpc_send_errorf(ri, 500, "out of memory");
+    return;
+  }
+  if (!mgos_bme68x_get_latest(l)) {
+    mg_rpc_send_errorf(ri, 503, "no data");
+    free(l);
+    return;
+  }
+  const struct bme68x_data *r = &l->raw;
+#ifdef BME68X_USE_FPU
+  float t = r->temperature, rh = r->humidity;
+#else
+  float t = r->temperature / 100.0f, rh = r->humidity / 1000.0f;
+#endif
+  mg_rpc_send_responsef(
+      ri,
+      "{gen: %u, raw: {status: %d, meas_index: %d, gas_index: %d, t: %.2f, "
+      "p: %.2f, rh: %.3f, gas: %.2f}, outputs: %M}",
+      (unsigned) l->gen, r->status, r->meas_index, r->gas_index, t,
+      (float) r->pressure, rh, (float) r->gas_resistance,
+      mgos_bme68x_print_outputs, l->outputs, (int) l->num_outputs);
+  free(l);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static void mgos_bme68x_measure_cb(const struct mgos_bsec_output *out,
+                                   uint32_t latency_ms, void *arg) {
+  struct mg_rpc_request_info *ri = (struct mg_rpc_request_info *) arg;
+  if (out == NULL) {
+    mg_rpc_send_errorf(ri, 504, "measurement failed after %u ms",
+                       (unsigned) latency_ms);
+    return;
+  }
+  mg_rpc_send_responsef(ri, "{latency_ms: %u, outputs: %M}",
+                        (unsigned) latency_ms, mgos_bme68x_print_outputs,
+                        out->outputs, (int) out->num_outputs);
+}
+
+// Takes a fresh measurement, responds once it is available.
+static void mgos_bme68x_measure_handler(struct mg_rpc_request_info *ri,
+                                        void *cb_arg,
+                                        struct mg_rpc_frame_info *fi,
+                                        struct mg_str args) {
+  bsec_library_return_t ret =
+      mgos_bsec_request_measurement(mgos_bme68x_measure_cb, ri);
+  if (ret != BSEC_OK) {
+    mg_rpc_send_errorf(ri, 503, "measurement request failed: %d", ret);
+  }
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static void mgos_bme68x_get_task_stats_handler(struct mg_rpc_request_info *ri,
+                                               void *cb_arg,
+                                               struct mg_rpc_frame_info *fi,
+                                               struct mg_str args) {
+  struct mgos_bme68x_task_stats st;
+  if (!mgos_bme68x_get_task_stats(&st)) {
+    mg_rpc_send_errorf(ri, 503, "task is not running");
+    return;
+  }
+  uint32_t avg_us =
+      (st.num_queued > 0 ? (uint32_t)(st.total_latency_us / st.num_queued)
+                         : 0);
+  mg_rpc_send_responsef(ri,
+                        "{queued: %u, dropped: %u, depth: %u, max_depth: %u, "
+                        "latency_us: {last: %u, max: %u, avg: %u}}",
+                        (unsigned) st.num_queued, (unsigned) st.num_dropped,
+                        (unsigned) st.depth, (unsigned) st.max_depth,
+                        (unsigned) st.last_latency_us,
+                        (unsigned) st.max_latency_us, (unsigned) avg_us);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static int mgos_bme68x_print_samples(struct json_out *out, va_list *ap) {
+  const struct mgos_bme68x_ring_sample *samples =
+      va_arg(*ap, const struct mgos_bme68x_ring_sample *);
+  int n = va_arg(*ap, int);
+  int len = json_printf(out, "[");
+  for (int i = 0; i < n; i++) {
+    const struct mgos_bme68x_ring_sample *s = &samples[i];
+    len += json_printf(out, "%s[%lld", (i > 0 ? ", " : ""), (long long) s->ts);
+    for (int j = 0; j < MGOS_BME68X_SIG_MAX; j++) {
+      if (isnan(s->v[j])) {
+        len += json_printf(out, ", null");
+      } else {
+        len += json_printf(out, ", %.2f", s->v[j]);
+      }
+    }
+    len += json_printf(out, ", %d]", s->iaq_acc);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+// Returns history samples in chunks, continue with from = next.
+static void mgos_bme68x_get_history_handler(struct mg_rpc_request_info *ri,
+                                            void *cb_arg,
+                                            struct mg_rpc_frame_info *fi,
+                                            struct mg_str args) {
+  long long from = 0, to = INT64_MAX;
+  int limit = 20, last = 0;
+  json_scanf(args.p, args.len, ri->args_fmt, &from, &to, &limit, &last);
+  if (limit <= 0 || limit > MGOS_BME68X_RPC_MAX_HISTORY_CHUNK) {
+    limit = MGOS_BME68X_RPC_MAX_HISTORY_CHUNK;
+  }
+  struct mgos_bme68x_ring_sample *samples =
+      (struct mgos_bme68x_ring_sample *) calloc(limit, sizeof(*samples));
+  if (samples == NULL) {
+    mg_rpc_send_errorf(ri, 500, "out of memory");
+    return;
+  }
+  int n;
+  long long next = -1;
+  if (last > 0) {
+    n = mgos_bme68x_ring_get_last((last < limit ? last : limit), samples);
+  } else {
+    // Full chunk means there may be more, let caller continue.
+    n = mgos_bme68x_ring_get_range(from, to, samples, limit);
+    if (n == limit) next = samples[n - 1].ts + 1;
+  }
+  mg_rpc_send_responsef(
+      ri,
+      "{signals: [\"ts\", \"iaq\", \"co2\", \"voc\", \"temp\", \"rh\", "
+      "\"ps\", \"gas\", \"iaq_acc\"], samples: %M, next: %lld}",
+      mgos_bme68x_print_samples, samples, n, next);
+  free(samples);
+  (void) cb_arg;
+  (void) fi;
+}
+
+static int mgos_bme68x_print_rollup(struct json_out *out, va_list *ap) {
+  const struct mgos_bme68x_rollup *r =
+      va_arg(*ap, const struct mgos_bme68x_rollup *);
+  int len = json_printf(out, "{start: %lld, wall_time: %B",
+                        (long long) r->start_ts, r->wall_time);
+  for (int i = 0; i < MGOS_BME68X_SIG_MAX; i++) {
+    const struct mgos_bme68x_stats *st = &r->sig[i];
+    if (st->count == 0) continue;
+    len += json_printf(
+        out, ", %Q: {n: %u, min: %.2f, max: %.2f, mean: %.2f, sd: %.3f}",
+        mgos_bme68x_signal_name(i), (unsigned) st->count, st->min, st->max,
+        st->mean, sqrtf(mgos_bme68x_stats_variance(st)));
+  }
+  len += json_printf(out, "}");
+  return len;
+}
+
+static int mgos_bme68x_print_rollups(struct json_out *out, va_list *ap) {
+  enum mgos_bme68x_rollup_res res = va_arg(*ap, int);
+  int n = va_arg(*ap, int);
+  struct mgos_bme68x_rollup r;
+  int len = json_printf(out, "[");
+  for (int i = 0; i < n && mgos_bme68x_rollup_get(res, i, &r); i++) {
+    len += json_printf(out, "%s%M", (i > 0 ? ", " : ""),
+                       mgos_bme68x_print_rollup, &r);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+// Returns current and up to n - 1 complete periods, most recent first.
+static void mgos_bme68x_get_rollups_handler(struct mg_rpc_request_info *ri,
+                                            void *cb_arg,
+                                            struct mg_rpc_frame_info *fi,
+                                            struct mg_str args) {
+  char *res_str = NULL;
+  int n = 2;
+  enum mgos_bme68x_rollup_res res = MGOS_BME68X_ROLLUP_HOUR;
+  json_scanf(args.p, args.len, ri->args_fmt, &res_str, &n);
+  if (res_str != NULL) {
+    if (strcmp(res_str, "1m") == 0) {
+      res = MGOS_BME68X_ROLLUP_MIN;
+    } else if (strcmp(res_str, "1h") == 0) {
+      res = MGOS_BME68X_ROLLUP_HOUR;
+    } else if (strcmp(res_str, "1d") == 0) {
+      res = MGOS_BME68X_ROLLUP_DAY;
+    } else {
+      mg_rpc_send_errorf(ri, 400, "invalid res, must be 1m, 1h or 1d");
+      free(res_str);
+      return;
+    }
+    free(res_str);
+  }
+  mg_rpc_send_responsef(ri, "{rollups: %M}", mgos_bme68x_print_rollups,
+                        (int) res, n);
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void mgos_bme68x_get_hist_stats_handler(struct mg_rpc_request_info *ri,
+                                               void *cb_arg,
+                                               struct mg_rpc_frame_info *fi,
+                                               struct mg_str args) {
+  struct mgos_bme68x_hist_stats st;
+  if (!mgos_bme68x_hist_get_stats(&st)) {
+    mg_rpc_send_errorf(ri, 503, "history is not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(ri,
+                        "{samples: %u, blocks: %u, evicted: %u, bytes: %u, "
+                        "raw_bytes: %u, ratio: %.2f, bits_per_sample: %.1f}",
+                        (unsigned) st.num_samples, (unsigned) st.num_blocks,
+                        (unsigned) st.num_evicted, (unsigned) st.bytes_used,
+                        (unsigned) st.raw_bytes, st.ratio,
+                        st.bits_per_sample);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static void mgos_bme68x_get_log_stats_handler(struct mg_rpc_request_info *ri,
+                                              void *cb_arg,
+                                              struct mg_rpc_frame_info *fi,
+                                              struct mg_str args) {
+  struct mgos_bme68x_log_stats st;
+  if (!mgos_bme68x_log_get_stats(&st)) {
+    mg_rpc_send_errorf(ri, 503, "log is not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(
+      ri,
+      "{pages: %u, page_size: %u, records: %u, lost: %u, corrupted: %u, "
+      "erases: %u, dropped: %u, payload_bytes: %u, flash_bytes: %u, "
+      "write_amp: %.3f}",
+      (unsigned) st.num_pages, (unsigned) st.page_size,
+      (unsigned) st.num_records, (unsigned) st.num_lost,
+      (unsigned) st.num_corrupted, (unsigned) st.num_erases,
+      (unsigned) st.num_dropped, (unsigned) st.payload_bytes,
+      (unsigned) st.flash_bytes, st.write_amp);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static void mgos_bme68x_get_deadband_stats_handler(
+    struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi,
+    struct mg_str args) {
+  struct mgos_bme68x_deadband_stats st;
+  if (!mgos_bme68x_get_deadband_stats(&st)) {
+    mg_rpc_send_errorf(ri, 503, "deadband is not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(ri, "{forwarded: %u, suppressed: %u}",
+                        (unsigned) st.num_forwarded,
+                        (unsigned) st.num_suppressed);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static int mgos_bme68x_print_alarms(struct json_out *out, va_list *ap) {
+  struct mgos_bme68x_alarm_ev a;
+  int len = json_printf(out, "[");
+  for (int i = 0; mgos_bme68x_alarm_get(i, &a); i++) {
+    len += json_printf(out,
+                       "%s{name: %Q, signal: %Q, active: %B, value: %.2f, "
+                       "ts: %lld}",
+                       (i > 0 ? ", " : ""), a.name,
+                       mgos_bme68x_signal_name(a.sig), a.active, a.value,
+                       (long long) a.ts);
+  }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
+}
+
+static void mgos_bme68x_get_alarms_handler(struct mg_rpc_request_info *ri,
+                                           void *cb_arg,
+                                           struct mg_rpc_frame_info *fi,
+                                           struct mg_str args) {
+  mg_rpc_send_responsef(ri, "{alarms: %M}", mgos_bme68x_print_alarms);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static int mgos_bme68x_print_i2c_counters(struct json_out *out, va_list *ap) {
+  const struct mgos_bme68x_i2c_counters *c =
+      va_arg(*ap, const struct mgos_bme68x_i2c_counters *);
+  return json_printf(out,
+                     "{xfers: %u, errors: %u, retries: %u, read: %u, "
+                     "written: %u, bus_us: %llu}",
+                     (unsigned) c->num_xfers, (unsigned) c->num_errors,
+                     (unsigned) c->num_retries, (unsigned) c->bytes_read,
+                     (unsigned) c->bytes_written,
+                     (unsigned long long) c->bus_time_us);
+}
+
+static int mgos_bme68x_print_i2c_phases(struct json_out *out, va_list *ap) {
+  const struct mgos_bme68x_i2c_stats *st =
+      va_arg(*ap, const struct mgos_bme68x_i2c_stats *);
+  int len = json_printf(out, "{");
+  for (int i = 0; i < MGOS_BME68X_I2C_PHASE_MAX; i++) {
+    len += json_printf(out, "%s%Q: %M", (i > 0 ? ", " : ""),
+                       mgos_bme68x_i2c_phase_name(i),
+                       mgos_bme68x_print_i2c_counters, &st->phase[i]);
+  }
+  len += json_printf(out, "}");
+  return len;
+}
+
+static void mgos_bme68x_get_i2c_stats_handler(struct mg_rpc_request_info *ri,
+                                              void *cb_arg,
+                                              struct mg_rpc_frame_info *fi,
+                                              struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  struct mgos_bme68x_i2c_stats st;
+  if (!mgos_bme68x_get_i2c_stats(NULL, &st)) {
+    mg_rpc_send_errorf(ri, 503, "sensor is not initialized");
+    return;
+  }
+  if (reset) mgos_bme68x_reset_i2c_stats(NULL);
+  mg_rpc_send_responsef(ri, "{cycles: %u, total: %M, phases: %M}",
+                        (unsigned) st.num_cycles,
+                        mgos_bme68x_print_i2c_counters, &st.total,
+                        mgos_bme68x_print_i2c_phases, &st);
+  (void) cb_arg;
+  (void) fi;
+}
+
+static int mgos_bme68x_print_latency(struct json_out *out, va_list *ap) {
+  struct mgos_bme68x_latency l;
+  int len = json_printf(out, "{");
+  for (int i = 0; mgos_bme68x_get_latency(i, &l); i++) {
+    len += json_printf(out,
+                       "%s%Q: {count: %u, min: %u, mean: %u, p50: %u, "
+                       "p90: %u, p99: %u, p999: %u, max: %u}",
+                       (i > 0 ? ", " : ""), mgos_bme68x_stage_name(i),
+                       (unsigned) l.count, (unsigned) l.min,
+                       (unsigned) l.mean, (unsigned) l.p50, (unsigned) l.p90,
+                       (unsigned) l.p99, (unsigned) l.p999, (unsigned) l.max);
+  }
+  len += json_printf(out, "}");
+  (void) ap;
+  return len;
+}
+
+static void mgos_bme68x_get_latency_handler(struct mg_rpc_request_info *ri,
+                                            void *cb_arg,
+                                            struct mg_rpc_frame_info *fi,
+                                            struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  struct mgos_bme68x_latency l;
+  if (!mgos_bme68x_get_latency(MGOS_BME68X_STAGE_CONTROL, &l)) {
+    mg_rpc_send_errorf(ri, 503, "latency histograms are not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(ri, "{stages: %M}", mgos_bme68x_print_latency);
+  if (reset) mgos_bme68x_reset_latency();
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void mgos_bme68x_get_energy_handler(struct mg_rpc_request_info *ri,
+                                           void *cb_arg,
+                                           struct mg_rpc_frame_info *fi,
+                                           struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  struct mgos_bme68x_energy e;
+  if (!mgos_bme68x_get_energy(&e)) {
+    mg_rpc_send_errorf(ri, 503, "energy accounting is not enabled");
+    return;
+  }
+  if (reset) mgos_bme68x_reset_energy();
+  mg_rpc_send_responsef(
+      ri,
+      "{cycles: %u, outputs: %u, heater_ms: %u, meas_ms: %u, i2c_ms: %u, "
+      "awake_ms: %u, heater_mj: %.3f, meas_mj: %.3f, i2c_mj: %.3f, "
+      "host_mj: %.3f, total_mj: %.3f, output_mj: %.4f, last_output_mj: %.4f, "
+      "hour_mj: %.2f}",
+      (unsigned) e.num_cycles, (unsigned) e.num_outputs,
+      (unsigned) (e.heater_us / 1000), (unsigned) (e.meas_us / 1000),
+      (unsigned) (e.i2c_us / 1000), (unsigned) (e.awake_us / 1000),
+      e.heater_mj, e.meas_mj, e.i2c_mj, e.host_mj, e.total_mj, e.output_mj,
+      e.last_output_mj, e.hour_mj);
+  (void) cb_arg;
+  (void) fi;
+}
+
+static int mgos_bme68x_print_wakeups(struct json_out *out, va_list *ap) {
+  int64_t ts[8];
+  int n = mgos_bsec_predict_wakeups(ts, ARRAY_SIZE(ts));
+  int len = json_printf(out, "[");
+  for (int i = 0; i < n; i++) {
+    len += json_printf(out, "%s%lld", (i > 0 ? ", " : ""), ts[i] / 1000000);
+  }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
+}
+
+static void mgos_bme68x_get_rate_ctl_handler(struct mg_rpc_request_info *ri,
+                                             void *cb_arg,
+                                             struct mg_rpc_frame_info *fi,
+                                             struct mg_str args) {
+  struct mgos_bsec_ratectl_stats st;
+  if (!mgos_bsec_ratectl_get_stats(&st)) {
+    mg_rpc_send_errorf(ri, 503, "rate controller is not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(
+      ri,
+      "{level: %Q, switches: %u, ulp_ms: %u, lp_ms: %u, cont_ms: %u, "
+      "rate: %.2f, credit_mj: %.2f, predicted_mj_h: %.2f, wakeups: %M}",
+      mgos_bsec_ratectl_level_name(st.level), (unsigned) st.num_switches,
+      (unsigned) st.level_ms[MGOS_BSEC_RATECTL_ULP],
+      (unsigned) st.level_ms[MGOS_BSEC_RATECTL_LP],
+      (unsigned) st.level_ms[MGOS_BSEC_RATECTL_CONT], st.rate, st.credit_mj,
+      st.predicted_mj_h, mgos_bme68x_print_wakeups);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static int mgos_bme68x_print_cal_day(struct json_out *out, va_list *ap) {
+  const struct mgos_bsec_cal_day *d =
+      va_arg(*ap, const struct mgos_bsec_cal_day *);
+  return json_printf(out, "{lp_ms: %u, switches: %u, sub_commits: %u}",
+                     (unsigned) d->lp_ms, (unsigned) d->switches,
+                     (unsigned) d->sub_commits);
+}
+
+static void mgos_bme68x_get_cal_stats_handler(struct mg_rpc_request_info *ri,
+                                              void *cb_arg,
+                                              struct mg_rpc_frame_info *fi,
+                                              struct mg_str args) {
+  struct mgos_bsec_cal_stats st;
+  if (!mgos_bsec_get_cal_stats(&st)) {
+    mg_rpc_send_errorf(ri, 503, "auto calibration is not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(ri,
+                        "{calibrating: %B, progress: %u, switches: %u, "
+                        "lp_ms: %u, today: %M, yesterday: %M}",
+                        st.calibrating, (unsigned) st.progress,
+                        (unsigned) st.num_switches, (unsigned) st.lp_ms,
+                        mgos_bme68x_print_cal_day, &st.today,
+                        mgos_bme68x_print_cal_day, &st.yesterday);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static void mgos_bme68x_get_run_in_handler(struct mg_rpc_request_info *ri,
+                                           void *cb_arg,
+                                           struct mg_rpc_frame_info *fi,
+                                           struct mg_str args) {
+  struct mgos_bsec_runin_status st;
+  if (!mgos_bsec_get_runin_status(&st)) {
+    mg_rpc_send_errorf(ri, 503, "BSEC is not enabled");
+    return;
+  }
+  mg_rpc_send_responsef(ri,
+                        "{stable: %B, run_in: %B, valid: %B, boost: %B, "
+                        "time_to_stable_ms: %u, time_to_run_in_ms: %u}",
+                        st.stable, st.run_in, st.valid, st.boost,
+                        (unsigned) st.time_to_stable_ms,
+                        (unsigned) st.time_to_run_in_ms);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+static void mgos_bme68x_get_trace_handler(struct mg_rpc_request_info *ri,
+                                          void *cb_arg,
+                                          struct mg_rpc_frame_info *fi,
+                                          struct mg_str args) {
+  unsigned int seq = 0;
+  int limit = 32;
+  json_scanf(args.p, args.len, ri->args_fmt, &seq, &limit);
+  if (limit <= 0 || limit > 64) limit = 64;
+  struct mgos_bme68x_trace_rec *recs =
+      (struct mgos_bme68x_trace_rec *) calloc(limit, sizeof(*recs));
+  if (recs == NULL) {
+    mg_rpc_send_errorf(ri, 500, "out of memory");
+    return;
+  }
+  uint32_t s = seq;
+  int n = mgos_bme68x_trace_get(&s, recs, limit);
+  if (n < 0) {
+    mg_rpc_send_errorf(ri, 503, "trace is not enabled");
+  } else {
+    mg_rpc_send_responsef(ri, "{seq: %u, next: %u, rec_size: %d, data: %V}",
+                          (unsigned) s, (unsigned) (s + n),
+                          (int) sizeof(*recs), recs,
+                          (int) (n * sizeof(*recs)));
+  }
+  free(recs);
+  (void) cb_arg;
+  (void) fi;
+}
+
+bool mgos_bme68x_rpc_init(void) {
+  struct mg_rpc *c = mgos_rpc_get_global();
+  if (c == NULL) return false;
+  mg_rpc_add_handler(c, "BME68x.GetLatest", "",
+                     mgos_bme68x_get_latest_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.Measure", "",
+                     mgos_bme68x_measure_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetHistory",
+                     "{from: %lld, to: %lld, limit: %d, last: %d}",
+                     mgos_bme68x_get_history_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetRollups", "{res: %Q, n: %d}",
+                     mgos_bme68x_get_rollups_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetHistStats", "",
+                     mgos_bme68x_get_hist_stats_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetTaskStats", "",
+                     mgos_bme68x_get_task_stats_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetLogStats", "",
+                     mgos_bme68x_get_log_stats_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetDeadbandStats", "",
+                     mgos_bme68x_get_deadband_stats_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetAlarms", "",
+                     mgos_bme68x_get_alarms_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetI2CStats", "{reset: %B}",
+                     mgos_bme68x_get_i2c_stats_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetLatency", "{reset: %B}",
+                     mgos_bme68x_get_latency_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetEnergy", "{reset: %B}",
+                     mgos_bme68x_get_energy_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetRateCtl", "",
+                     mgos_bme68x_get_rate_ctl_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetCalStats", "",
+                     mgos_bme68x_get_cal_stats_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetRunIn", "",
+                     mgos_bme68x_get_run_in_handler, NULL);
+  mg_rpc_add_handler(c, "BME68x.GetTrace", "{seq: %u, limit: %d}",
+                     mgos_bme68x_get_trace_handler, NULL);
+  return true;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Sensor stabilization and run-in tracking.
+// BSEC reports both as outputs that turn 1 once complete. Until then,
+// with fast start enabled, a boost client keeps IAQ at LP, the fastest
+// rate all BSEC configurations support.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+struct mgos_bsec_runin {
+  int64_t start_us;
+  struct mgos_bsec_rate_client *client;
+  struct mgos_bsec_runin_status st;
+};
+
+static struct mgos_bsec_runin *s_runin;
+
+bool mgos_bsec_runin_init(bool fast_start) {
+  struct mgos_bsec_runin *ri =
+      (struct mgos_bsec_runin *) calloc(1, sizeof(*ri));
+  if (ri == NULL) return false;
+  ri->start_us = mgos_uptime_micros();
+  if (fast_start) {
+    ri->client = mgos_bsec_rate_client_create_int("fast_start",
+                                                  true /* boost */, NULL, NULL);
+    if (ri->client == NULL) {
+      free(ri);
+      return false;
+    }
+    mgos_bsec_rate_client_set(ri->client, MGOS_BSEC_SENSOR_IAQ,
+                              BSEC_SAMPLE_RATE_LP);
+    ri->st.boost = true;
+  }
+  s_runin = ri;
+  return true;
+}
+
+void mgos_bsec_runin_update(const struct mgos_bsec_output *out) {
+  struct mgos_bsec_runin *ri = s_runin;
+  if (ri == NULL || ri->st.valid) return;
+  struct mgos_bsec_runin_status *st = &ri->st;
+  uint32_t elapsed_ms =
+      (uint32_t)((mgos_uptime_micros() - ri->start_us) / 1000);
+  for (uint8_t i = 0; i < out->num_outputs; i++) {
+    const bsec_output_t *o = &out->outputs[i];
+    if (o->signal < 1.0f) continue;
+    if (o->sensor_id == BSEC_OUTPUT_STABILIZATION_STATUS && !st->stable) {
+      st->stable = true;
+      st->time_to_stable_ms = elapsed_ms;
+      LOG(LL_INFO, ("Sensor stabilized in %u s", (unsigned) elapsed_ms / 1000));
+    }
+    if (o->sensor_id == BSEC_OUTPUT_RUN_IN_STATUS && !st->run_in) {
+      st->run_in = true;
+      st->time_to_run_in_ms = elapsed_ms;
+      LOG(LL_INFO,
+          ("Sensor run-in done in %u s", (unsigned) elapsed_ms / 1000));
+    }
+  }
+  if (!st->stable || !st->run_in) return;
+  st->valid = true;
+  if (ri->client != NULL) {
+    mgos_bsec_rate_client_free(ri->client);
+    ri->client = NULL;
+    st->boost = false;
+  }
+  mgos_event_trigger(MGOS_EV_BME68X_DATA_VALID, st);
+}
+
+bool mgos_bsec_get_runin_status(struct mgos_bsec_runin_status *status) {
+  const struct mgos_bsec_runin *ri = s_runin;
+  if (ri == NULL) return false;
+  *status = ri->st;
+  return true;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Dedicated measurement task.
+// Sensor I/O and BSEC run on a separate FreeRTOS task, outputs are passed
+// to the main task through a single-producer single-consumer ring and
+// dispatched there, so event handlers still run on the main task.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+struct mgos_bme68x_sample {
+  struct mgos_bsec_output out;
+  struct bme68x_data raw;
+  int64_t queued_us;
+};
+
+struct mgos_bme68x_task_state {
+  TaskHandle_t task;
+  // Ring of |len| entries. Producer (measurement task) owns |head|,
+  // consumer (main task) owns |tail|. Indices run freely.
+  // Entries are copied to the double-buffered output slot for publishing,
+  // so an entry can be reused as soon as it has been dispatched.
+  struct mgos_bme68x_sample *q;
+  uint32_t len;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint32_t drain_pending;
+  // Used when the queue is full: BSEC still needs to see every sample.
+  struct mgos_bme68x_sample scratch;
+  struct mgos_bme68x_task_stats stats;
+};
+
+static struct mgos_bme68x_task_state *s_task;
+
+// Runs on the main task.
+static void mgos_bme68x_task_drain_cb(void *arg) {
+  struct mgos_bme68x_task_state *t = s_task;
+  // Clear the flag first so that entries queued from now on re-schedule us.
+  __atomic_store_n(&t->drain_pending, 0, __ATOMIC_SEQ_CST);
+  uint32_t tail = t->tail;
+  while (tail != __atomic_load_n(&t->head, __ATOMIC_ACQUIRE)) {
+    struct mgos_bme68x_sample *e = &t->q[tail % t->len];
+    uint32_t lat = (uint32_t)(mgos_uptime_micros() - e->queued_us);
+    t->stats.last_latency_us = lat;
+    t->stats.total_latency_us += lat;
+    if (lat > t->stats.max_latency_us) t->stats.max_latency_us = lat;
+    int64_t start = mgos_uptime_micros();
+    struct mgos_bsec_output *out = mgos_bsec_free_slot();
+    *out = e->out;
+    mgos_bsec_publish(out, &e->raw);
+    mgos_bme68x_energy_awake(start);
+    __atomic_store_n(&t->tail, ++tail, __ATOMIC_RELEASE);
+  }
+  (void) arg;
+}
+
+// Runs on the main task, calibration state is owned by it.
+static void mgos_bme68x_task_save_state_cb(void *arg) {
+  mgos_bsec_save_state();
+  (void) arg;
+}
+
+static void mgos_bme68x_task_measure(const bsec_bme_settings_t *ss) {
+  struct mgos_bme68x_task_state *t = s_task;
+  uint32_t head = t->head;
+  uint32_t depth = head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+  bool full = (depth >= t->len);
+  struct mgos_bme68x_sample *e = (full ? &t->scratch : &t->q[head % t->len]);
+  int64_t start = mgos_uptime_micros();
+  mgos_bsec_lock();
+  bool ok = mgos_bsec_process(ss, &e->raw, &e->out);
+  mgos_bsec_unlock();
+  mgos_bme68x_energy_task_awake(start);
+  if (!ok) return;
+  if (full) {
+    t->stats.num_dropped++;
+    return;
+  }
+  e->queued_us = mgos_uptime_micros();
+  __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+  t->stats.num_queued++;
+  if (depth + 1 > t->stats.max_depth) t->stats.max_depth = depth + 1;
+  if (__atomic_exchange_n(&t->drain_pending, 1, __ATOMIC_SEQ_CST) == 0) {
+    mgos_invoke_cb(mgos_bme68x_task_drain_cb, NULL, false /* from_isr */);
+  }
+}
+
+static void mgos_bme68x_task(void *arg) {
+  bsec_bme_settings_t ss;
+  for (;;) {
+    int delay_ms = 0, meas_delay_ms = 0;
+    int64_t start = mgos_uptime_micros();
+    mgos_bsec_lock();
+    int ret = mgos_bme68x_run_once(&ss, &delay_ms, &meas_delay_ms);
+    mgos_bsec_unlock();
+    mgos_bme68x_energy_task_awake(start);
+    if (ret != BSEC_OK) {
+      LOG(LL_ERROR, ("BSEC run failed: %d", ret));
+      delay_ms = 10000;
+    } else {
+      if (ss.trigger_measurement && meas_delay_ms > 0) {
+        vTaskDelay(pdMS_TO_TICKS(meas_delay_ms));
+      }
+      mgos_bme68x_task_measure(&ss);
+    }
+    if (mgos_bsec_state_save_due(delay_ms)) {
+      mgos_invoke_cb(mgos_bme68x_task_save_state_cb, NULL,
+                     false /* from_isr */);
+    }
+    int elapsed_ms = (int) ((mgos_uptime_micros() - start) / 1000);
+    if (delay_ms > elapsed_ms) {
+      // Notified by mgos_bme68x_task_wake().
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(delay_ms - elapsed_ms));
+    }
+  }
+  (void) arg;
+}
+
+bool mgos_bme68x_task_start(const struct mgos_config_bme68x_task *cfg) {
+  if (s_task != NULL) return true;
+  if (cfg->queue_len < 1) return false;
+  struct mgos_bme68x_task_state *t =
+      (struct mgos_bme68x_task_state *) calloc(1, sizeof(*t));
+  if (t == NULL) return false;
+  t->len = cfg->queue_len;
+  t->q = (struct mgos_bme68x_sample *) calloc(t->len, sizeof(*t->q));
+  if (t->q == NULL) {
+    free(t);
+    return false;
+  }
+  s_task = t;
+  if (xTaskCreatePinnedToCore(mgos_bme68x_task, "bme68x", cfg->stack_size,
+                              NULL, cfg->prio, &t->task,
+                              cfg->core) != pdPASS) {
+    s_task = NULL;
+    free(t->q);
+    free(t);
+    return false;
+  }
+  LOG(LL_INFO, ("BME68x task started on core %d, queue %d", cfg->core,
+                cfg->queue_len));
+  return true;
+}
+
+bool mgos_bme68x_task_wake(void) {
+  struct mgos_bme68x_task_state *t = s_task;
+  if (t == NULL) return false;
+  xTaskNotifyGive(t->task);
+  return true;
+}
+
+bool mgos_bme68x_get_task_stats(struct mgos_bme68x_task_stats *stats) {
+  struct mgos_bme68x_task_state *t = s_task;
+  if (t == NULL) return false;
+  *stats = t->stats;
+  stats->depth = t->head - t->tail;
+  return true;
+}
+
+#else
+
+bool mgos_bme68x_task_start(const struct mgos_config_bme68x_task *cfg) {
+  LOG(LL_ERROR, ("Measurement task is not supported on this platform"));
+  (void) cfg;
+  return false;
+}
+
+bool mgos_bme68x_task_wake(void) {
+  return false;
+}
+
+bool mgos_bme68x_get_task_stats(struct mgos_bme68x_task_stats *stats) {
+  (void) stats;
+  return false;
+}
+
+#endif
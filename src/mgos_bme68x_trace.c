@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Binary trace: fixed-size records in a RAM ring. Appending is a few stores,
+// no formatting is done on the device.
+
+#include "mgos_bme68x_internal.h"
+
+#include "mgos.h"
+
+struct mgos_bme68x_trace_ring {
+  uint32_t size;
+  volatile uint32_t seq;  // Sequence number of the next record.
+  struct mgos_bme68x_trace_rec recs[];
+};
+
+static struct mgos_bme68x_trace_ring *s_trace;
+
+bool mgos_bme68x_trace_init(int size) {
+  struct mgos_bme68x_trace_ring *t = (struct mgos_bme68x_trace_ring *) calloc(
+      1, sizeof(*t) + size * sizeof(t->recs[0]));
+  if (t == NULL) return false;
+  t->size = size;
+  s_trace = t;
+  return true;
+}
+
+void mgos_bme68x_trace(enum mgos_bme68x_trace_type type, uint8_t a,
+                       uint16_t b, uint32_t c, uint32_t d) {
+  struct mgos_bme68x_trace_ring *t = s_trace;
+  if (t == NULL) return;
+  // May be called from the measurement task and the main task.
+  uint32_t seq = __sync_fetch_and_add(&t->seq, 1);
+  struct mgos_bme68x_trace_rec *r = &t->recs[seq % t->size];
+  r->ts = (uint32_t)(mgos_uptime_micros() / 1000);
+  r->type = type;
+  r->a = a;
+  r->b = b;
+  r->c = c;
+  r->d = d;
+}
+
+void mgos_bme68x_trace_f(enum mgos_bme68x_trace_type type, uint8_t a,
+                         uint16_t b, float c) {
+  uint32_t u;
+  memcpy(&u, &c, sizeof(u));
+  mgos_bme68x_trace(type, a, b, u, 0);
+}
+
+int mgos_bme68x_trace_get(uint32_t *seq, struct mgos_bme68x_trace_rec *recs,
+                          int max) {
+  const struct mgos_bme68x_trace_ring *t = s_trace;
+  if (t == NULL) return -1;
+  uint32_t end = t->seq;
+  uint32_t start = (end > t->size ? end - t->size : 0);
+  if ((int32_t)(*seq - start) < 0 || (int32_t)(*seq - end) > 0) *seq = start;
+  int n = 0;
+  for (uint32_t s = *seq; s != end && n < max; s++) {
+    recs[n++] = t->recs[s % t->size];
+  }
+  return n;
+}
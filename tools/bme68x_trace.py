@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+#
+# Decode binary trace records returned by BME68x.GetTrace.
+#
+#   mos call BME68x.GetTrace '{"limit": 64}' | tools/bme68x_trace.py
+#
+
+import base64
+import json
+import struct
+import sys
+
+REC = struct.Struct("<IBBHII")
+
+TYPES = {1: "ctl", 2: "in", 3: "out", 4: "status", 5: "timing"}
+
+OPS = {
+    1: "sensor_control",
+    2: "set_conf",
+    3: "set_op_mode",
+    4: "get_data",
+    5: "do_steps",
+    6: "subscription",
+    7: "state_save",
+}
+
+STAGES = [
+    "control",
+    "config",
+    "read",
+    "do_steps",
+    "parse",
+    "store",
+    "dispatch",
+    "state_save",
+]
+
+
+def as_float(u):
+    return struct.unpack("<f", struct.pack("<I", u))[0]
+
+
+def as_int(u):
+    return u - (1 << 32) if u & 0x80000000 else u
+
+
+def format_rec(ts, typ, a, b, c, d):
+    if typ == 1:
+        return ("trigger %d gas %d ht %d dur %d ms, os t%d p%d h%d, "
+                "process 0x%x" % (a & 1, (a >> 1) & 1, b, d & 0xffff,
+                                  (d >> 16) & 0xf, (d >> 20) & 0xf,
+                                  (d >> 24) & 0xf, c))
+    if typ == 2:
+        return "%3d %.2f" % (a, as_float(c))
+    if typ == 3:
+        return "%3d %.2f acc %d" % (a, as_float(c), b)
+    if typ == 4:
+        return "%s %d b %d d %d" % (OPS.get(a, a), as_int(c), b, d)
+    if typ == 5:
+        return "%s %d us" % (STAGES[a] if a < len(STAGES) else a, c)
+    return "a %d b %d c 0x%x d 0x%x" % (a, b, c, d)
+
+
+def main():
+    resp = json.load(sys.stdin)
+    if "result" in resp:
+        resp = resp["result"]
+    data = base64.b64decode(resp["data"])
+    if resp.get("rec_size", REC.size) != REC.size:
+        sys.exit("unexpected record size %d" % resp["rec_size"])
+    seq = resp["seq"]
+    for i in range(len(data) // REC.size):
+        ts, typ, a, b, c, d = REC.unpack_from(data, i * REC.size)
+        print("%8d %10.3f %-6s %s" % (seq + i, ts / 1000.0,
+                                      TYPES.get(typ, typ),
+                                      format_rec(ts, typ, a, b, c, d)))
+    print("next seq: %d" % resp["next"], file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compensation microbenchmark: cost of the driver's calc_* functions and of
+// field decoding in the float and integer builds, over ADC values the
+// simulator produces for a spread of environments, and agreement of the
+// two builds across all calibration sets.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bme68x_bench.h"
+
+// Maximum allowed difference between float and integer results.
+#define BENCH_TEMP_TOL 0.01  // deg C
+#define BENCH_PRES_TOL 16.0  // Pa
+#define BENCH_HUM_TOL 0.1    // %RH
+#define BENCH_GAS_TOL 0.01   // Relative.
+// Integer gas_high is truncated to 100 Ohm, 5% of the 2 kOhm minimum.
+#define BENCH_GAS_HIGH_TOL 0.05
+#define BENCH_RES_HEAT_TOL 2  // Codes.
+
+static const char *s_kernel_names[BME68X_BENCH_MAX] = {
+    "temperature", "pressure", "humidity", "gas_low",
+    "gas_high",    "res_heat", "fields",
+};
+
+static const struct bme68x_bench_build *s_builds[2] = {
+    &bme68x_bench_build_float,
+    &bme68x_bench_build_int,
+};
+
+struct bench_data {
+  uint32_t *t_adc, *p_adc;
+  uint16_t *h_adc, *gl_adc, *gh_adc, *heatr_temp;
+  uint8_t *gl_range, *gh_range, *fields;
+  struct bme68x_bench_input in;
+};
+
+static uint64_t s_rng;
+
+static double bench_rand(double a, double b) {
+  // xorshift64*, fixed seed so that runs are comparable.
+  s_rng ^= s_rng >> 12;
+  s_rng ^= s_rng << 25;
+  s_rng ^= s_rng >> 27;
+  double v = ((s_rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / (1ULL << 53));
+  return a + (b - a) * v;
+}
+
+static bool bench_alloc(struct bench_data *d, int n) {
+  memset(d, 0, sizeof(*d));
+  d->t_adc = calloc(n, sizeof(*d->t_adc));
+  d->p_adc = calloc(n, sizeof(*d->p_adc));
+  d->h_adc = calloc(n, sizeof(*d->h_adc));
+  d->gl_adc = calloc(n, sizeof(*d->gl_adc));
+  d->gh_adc = calloc(n, sizeof(*d->gh_adc));
+  d->heatr_temp = calloc(n, sizeof(*d->heatr_temp));
+  d->gl_range = calloc(n, 1);
+  d->gh_range = calloc(n, 1);
+  d->fields = calloc(n, BME68X_LEN_FIELD);
+  d->in = (struct bme68x_bench_input){
+      .n = n,
+      .t_adc = d->t_adc,
+      .p_adc = d->p_adc,
+      .h_adc = d->h_adc,
+      .gl_adc = d->gl_adc,
+      .gl_range = d->gl_range,
+      .gh_adc = d->gh_adc,
+      .gh_range = d->gh_range,
+      .heatr_temp = d->heatr_temp,
+      .fields = d->fields,
+  };
+  return (d->t_adc != NULL && d->p_adc != NULL && d->h_adc != NULL &&
+          d->gl_adc != NULL && d->gh_adc != NULL && d->heatr_temp != NULL &&
+          d->gl_range != NULL && d->gh_range != NULL && d->fields != NULL);
+}
+
+// Generates samples for calibration set |calib| and initializes both builds
+// for it.
+static bool bench_gen(struct bench_data *d, int calib) {
+  struct bme68x_sim *lo = bme68x_sim_create(BME68X_VARIANT_GAS_LOW, calib);
+  struct bme68x_sim *hi = bme68x_sim_create(BME68X_VARIANT_GAS_HIGH, calib);
+  bool ok = (lo != NULL && hi != NULL);
+  s_rng = 0x9e3779b97f4a7c15ULL + calib;
+  for (int i = 0; ok && i < d->in.n; i++) {
+    struct bme68x_sim_env env = {
+        .temp = bench_rand(-10, 50),
+        .humidity = bench_rand(5, 95),
+        // Integer pressure overflows above ~106 kPa with typical par_p10.
+        .pressure = bench_rand(87000, 105000),
+        .gas = exp(bench_rand(log(2e3), log(2e6))),
+    };
+    uint8_t *f = &d->fields[i * BME68X_LEN_FIELD], fh[BME68X_LEN_FIELD];
+    bme68x_sim_encode_field(lo, &env, f);
+    bme68x_sim_encode_field(hi, &env, fh);
+    d->p_adc[i] = (f[2] << 12) | (f[3] << 4) | (f[4] >> 4);
+    d->t_adc[i] = (f[5] << 12) | (f[6] << 4) | (f[7] >> 4);
+    d->h_adc[i] = (f[8] << 8) | f[9];
+    d->gl_adc[i] = (f[13] << 2) | (f[14] >> 6);
+    d->gl_range[i] = f[14] & BME68X_GAS_RANGE_MSK;
+    d->gh_adc[i] = (fh[15] << 2) | (fh[16] >> 6);
+    d->gh_range[i] = fh[16] & BME68X_GAS_RANGE_MSK;
+    d->heatr_temp[i] = (uint16_t) bench_rand(150, 400);
+  }
+  for (int b = 0; ok && b < 2; b++) {
+    ok = s_builds[b]->init(lo) && s_builds[b]->prepare(&d->in);
+  }
+  bme68x_sim_free(lo);
+  bme68x_sim_free(hi);
+  return ok;
+}
+
+static int bench_perf_open(void) {
+#ifdef __linux__
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof(pe);
+  pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+  pe.disabled = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return (int) syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Best of |reps| runs, per sample (per field for the fields kernel).
+static void bench_time(const struct bme68x_bench_build *b,
+                       enum bme68x_bench_kernel k,
+                       const struct bme68x_bench_input *in, int reps,
+                       int perf_fd, double *ns, double *instr) {
+  uint64_t best_ns = UINT64_MAX, best_instr = UINT64_MAX;
+  b->run(k, in);  // Warm up.
+  for (int r = 0; r < reps; r++) {
+#ifdef __linux__
+    if (perf_fd >= 0) {
+      ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    uint64_t start = bench_now_ns();
+    b->run(k, in);
+    uint64_t took = bench_now_ns() - start;
+    uint64_t count = 0;
+#ifdef __linux__
+    if (perf_fd >= 0) {
+      ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+    }
+#endif
+    if (took < best_ns) best_ns = took;
+    if (count < best_instr) best_instr = count;
+  }
+  *ns = (double) best_ns / in->n;
+  *instr = (perf_fd >= 0 ? (double) best_instr / in->n : NAN);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-n samples] [-r reps] [-c calib] [-s]\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int n = 30000, reps = 20, calib = 0;
+  bool csv = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:c:s")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = atoi(optarg);
+        break;
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 'c':
+        calib = atoi(optarg);
+        break;
+      case 's':
+        csv = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  n -= n % 3;  // Whole field triplets.
+  if (n <= 0 || reps <= 0 || calib < 0 || calib >= bme68x_sim_num_calibs) {
+    usage(argv[0]);
+  }
+  struct bench_data d;
+  double *out[2] = {calloc(n, sizeof(double)), calloc(n, sizeof(double))};
+  if (!bench_alloc(&d, n) || out[0] == NULL || out[1] == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  // Cost.
+  int perf_fd = bench_perf_open();
+  if (!bench_gen(&d, calib)) {
+    fprintf(stderr, "failed to initialize the driver\n");
+    return 1;
+  }
+  double ns[2][BME68X_BENCH_MAX], instr[2][BME68X_BENCH_MAX];
+  for (int b = 0; b < 2; b++) {
+    for (int k = 0; k < BME68X_BENCH_MAX; k++) {
+      bench_time(s_builds[b], k, &d.in, reps, perf_fd, &ns[b][k],
+                 &instr[b][k]);
+    }
+  }
+  if (csv) {
+    printf("kernel,build,ns,instr\n");
+    for (int k = 0; k < BME68X_BENCH_MAX; k++) {
+      for (int b = 0; b < 2; b++) {
+        printf("%s,%s,%.2f,%.1f\n", s_kernel_names[k], s_builds[b]->name,
+               ns[b][k], instr[b][k]);
+      }
+    }
+  } else {
+    printf("# %d samples, best of %d, calib %s%s\n", n, reps,
+           bme68x_sim_calibs[calib].name,
+           perf_fd < 0 ? ", instruction counter not available" : "");
+    printf("%-12s %12s %12s %12s %12s\n", "per sample", "float ns",
+           "float instr", "int ns", "int instr");
+    for (int k = 0; k < BME68X_BENCH_MAX; k++) {
+      printf("%-12s %12.2f %12.1f %12.2f %12.1f\n", s_kernel_names[k],
+             ns[0][k], instr[0][k], ns[1][k], instr[1][k]);
+    }
+    // Decoding is what's left after compensation.
+    for (int b = 0; b < 2; b++) {
+      double comp = ns[b][BME68X_BENCH_TEMP] + ns[b][BME68X_BENCH_PRES] +
+                    ns[b][BME68X_BENCH_HUM] + ns[b][BME68X_BENCH_GAS_LOW];
+      double mbs = BME68X_LEN_FIELD * 1e3 / ns[b][BME68X_BENCH_FIELDS];
+      printf("# %s fields: %.1f MB/s, %.2f ns/field excluding compensation\n",
+             s_builds[b]->name, mbs, ns[b][BME68X_BENCH_FIELDS] - comp);
+    }
+  }
+
+  // Agreement, over all calibration sets.
+  static const double tols[BME68X_BENCH_FIELDS] = {
+      BENCH_TEMP_TOL,     BENCH_PRES_TOL,     BENCH_HUM_TOL,
+      BENCH_GAS_TOL,      BENCH_GAS_HIGH_TOL, BENCH_RES_HEAT_TOL,
+  };
+  double max_diff[BME68X_BENCH_FIELDS] = {0}, sum_diff[BME68X_BENCH_FIELDS];
+  memset(sum_diff, 0, sizeof(sum_diff));
+  for (int c = 0; c < bme68x_sim_num_calibs; c++) {
+    if (!bench_gen(&d, c)) {
+      fprintf(stderr, "failed to initialize the driver\n");
+      return 1;
+    }
+    for (int k = 0; k < BME68X_BENCH_FIELDS; k++) {
+      for (int b = 0; b < 2; b++) {
+        s_builds[b]->run(k, &d.in);
+        s_builds[b]->results(k, out[b], n);
+      }
+      bool rel = (k == BME68X_BENCH_GAS_LOW || k == BME68X_BENCH_GAS_HIGH);
+      for (int i = 0; i < n; i++) {
+        double diff = fabs(out[0][i] - out[1][i]);
+        if (rel) diff /= out[0][i];
+        if (diff > max_diff[k]) max_diff[k] = diff;
+        sum_diff[k] += diff;
+      }
+    }
+  }
+  bool ok = true;
+  if (!csv) {
+    printf("# float vs integer, %d calibration sets\n", bme68x_sim_num_calibs);
+    printf("%-12s %12s %12s %12s\n", "", "max diff", "mean diff", "limit");
+  }
+  for (int k = 0; k < BME68X_BENCH_FIELDS; k++) {
+    bool rel = (k == BME68X_BENCH_GAS_LOW || k == BME68X_BENCH_GAS_HIGH);
+    double scale = (rel ? 100 : 1);  // Relative diffs are in %.
+    double mean = sum_diff[k] / ((double) n * bme68x_sim_num_calibs);
+    bool k_ok = (max_diff[k] <= tols[k]);
+    if (!csv) {
+      printf("%-12s %12.4f %12.4f %12.4f%s%s\n", s_kernel_names[k],
+             max_diff[k] * scale, mean * scale, tols[k] * scale,
+             rel ? " %" : "", k_ok ? "" : "  FAIL");
+    }
+    if (!k_ok) ok = false;
+  }
+  if (!ok) fprintf(stderr, "float and integer results differ\n");
+  return (ok ? 0 : 1);
+}
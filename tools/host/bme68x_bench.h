@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compensation benchmark kernels. bme68x_bench_calc.c is compiled once
+// for each driver build and exports a struct bme68x_bench_build.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bme68x_sim.h"
+
+enum bme68x_bench_kernel {
+  BME68X_BENCH_TEMP,
+  BME68X_BENCH_PRES,
+  BME68X_BENCH_HUM,
+  BME68X_BENCH_GAS_LOW,
+  BME68X_BENCH_GAS_HIGH,
+  BME68X_BENCH_RES_HEAT,
+  BME68X_BENCH_FIELDS,  // read_all_field_data(), 3 fields per call.
+  BME68X_BENCH_MAX,
+};
+
+struct bme68x_bench_input {
+  int n;
+  const uint32_t *t_adc;
+  const uint32_t *p_adc;
+  const uint16_t *h_adc;
+  const uint16_t *gl_adc;  // Low gas variant.
+  const uint8_t *gl_range;
+  const uint16_t *gh_adc;  // High gas variant.
+  const uint8_t *gh_range;
+  const uint16_t *heatr_temp;
+  const uint8_t *fields;  // n fields, BME68X_LEN_FIELD bytes each.
+};
+
+struct bme68x_bench_build {
+  const char *name;
+  // Initializes the driver against |sim|, for its calibration set.
+  bool (*init)(struct bme68x_sim *sim);
+  // Allocates outputs and computes t_fine for each sample.
+  bool (*prepare)(const struct bme68x_bench_input *in);
+  void (*run)(enum bme68x_bench_kernel k, const struct bme68x_bench_input *in);
+  // Outputs of the last run of |k|, in deg C, Pa, %RH, Ohm or res_heat code.
+  void (*results)(enum bme68x_bench_kernel k, double *out, int n);
+};
+
+extern const struct bme68x_bench_build bme68x_bench_build_float;
+extern const struct bme68x_bench_build bme68x_bench_build_int;
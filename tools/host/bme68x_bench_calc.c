@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark kernels for one build of the driver, float by default and
+// integer with BME68X_DO_NOT_USE_FPU.
+// The compensation functions are static, so the driver source is included
+// here. Its public functions are renamed for the two builds to be linked
+// into the same binary.
+
+#ifdef BME68X_DO_NOT_USE_FPU
+#define BME68X_BENCH_SYM(x) x##_int
+#define BME68X_BENCH_NAME "integer"
+#else
+#define BME68X_BENCH_SYM(x) x##_float
+#define BME68X_BENCH_NAME "float"
+#endif
+
+#define bme68x_init BME68X_BENCH_SYM(bme68x_init)
+#define bme68x_set_regs BME68X_BENCH_SYM(bme68x_set_regs)
+#define bme68x_get_regs BME68X_BENCH_SYM(bme68x_get_regs)
+#define bme68x_soft_reset BME68X_BENCH_SYM(bme68x_soft_reset)
+#define bme68x_set_op_mode BME68X_BENCH_SYM(bme68x_set_op_mode)
+#define bme68x_get_op_mode BME68X_BENCH_SYM(bme68x_get_op_mode)
+#define bme68x_get_meas_dur BME68X_BENCH_SYM(bme68x_get_meas_dur)
+#define bme68x_get_data BME68X_BENCH_SYM(bme68x_get_data)
+#define bme68x_set_conf BME68X_BENCH_SYM(bme68x_set_conf)
+#define bme68x_get_conf BME68X_BENCH_SYM(bme68x_get_conf)
+#define bme68x_set_heatr_conf BME68X_BENCH_SYM(bme68x_set_heatr_conf)
+#define bme68x_get_heatr_conf BME68X_BENCH_SYM(bme68x_get_heatr_conf)
+#define bme68x_selftest_check BME68X_BENCH_SYM(bme68x_selftest_check)
+
+#include "bme68x.c"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bme68x_bench.h"
+
+#ifdef BME68X_USE_FPU
+typedef float bme68x_bench_out_t;
+typedef float bme68x_bench_t_fine_t;
+#define BME68X_BENCH_TEMP_SCALE 1.0
+#define BME68X_BENCH_HUM_SCALE 1.0
+#else
+typedef int64_t bme68x_bench_out_t;
+typedef int32_t bme68x_bench_t_fine_t;
+#define BME68X_BENCH_TEMP_SCALE 100.0
+#define BME68X_BENCH_HUM_SCALE 1000.0
+#endif
+
+static struct bme68x_dev s_dev;
+static bme68x_bench_t_fine_t *s_t_fine;
+static bme68x_bench_out_t *s_out[BME68X_BENCH_MAX];
+static int s_n;
+
+// Field benchmark reads from memory, only decoding is measured.
+static const uint8_t *s_fields;
+static uint8_t s_set_val[30];  // idac, res_heat, gas_wait.
+static struct bme68x_data s_field_data[3];
+static struct bme68x_data *const s_field_ptrs[3] = {
+    &s_field_data[0], &s_field_data[1], &s_field_data[2]};
+
+static BME68X_INTF_RET_TYPE bme68x_bench_read(uint8_t reg_addr,
+                                              uint8_t *reg_data,
+                                              uint32_t length,
+                                              void *intf_ptr) {
+  if (reg_addr == BME68X_REG_FIELD0) {
+    memcpy(reg_data, s_fields, length);
+  } else {
+    memcpy(reg_data, s_set_val, length);
+  }
+  (void) intf_ptr;
+  return 0;
+}
+
+static bool bme68x_bench_init(struct bme68x_sim *sim) {
+  memset(&s_dev, 0, sizeof(s_dev));
+  bme68x_sim_attach(sim, &s_dev);
+  s_dev.amb_temp = 25;
+  if (bme68x_init(&s_dev) != BME68X_OK) return false;
+  s_dev.read = bme68x_bench_read;
+  memset(s_set_val, 0x40, sizeof(s_set_val));
+  return true;
+}
+
+static bool bme68x_bench_prepare(const struct bme68x_bench_input *in) {
+  free(s_t_fine);
+  s_t_fine = (bme68x_bench_t_fine_t *) calloc(in->n, sizeof(*s_t_fine));
+  if (s_t_fine == NULL) return false;
+  for (int k = 0; k < BME68X_BENCH_MAX; k++) {
+    free(s_out[k]);
+    s_out[k] = (bme68x_bench_out_t *) calloc(in->n, sizeof(*s_out[k]));
+    if (s_out[k] == NULL) return false;
+  }
+  for (int i = 0; i < in->n; i++) {
+    calc_temperature(in->t_adc[i], &s_dev);
+    s_t_fine[i] = s_dev.calib.t_fine;
+  }
+  s_n = in->n;
+  return true;
+}
+
+static void bme68x_bench_run(enum bme68x_bench_kernel k,
+                             const struct bme68x_bench_input *in) {
+  struct bme68x_dev *dev = &s_dev;
+  bme68x_bench_out_t *out = s_out[k];
+  int n = in->n;
+  switch (k) {
+    case BME68X_BENCH_TEMP:
+      for (int i = 0; i < n; i++) {
+        out[i] = calc_temperature(in->t_adc[i], dev);
+      }
+      break;
+    case BME68X_BENCH_PRES:
+      for (int i = 0; i < n; i++) {
+        dev->calib.t_fine = s_t_fine[i];
+        out[i] = calc_pressure(in->p_adc[i], dev);
+      }
+      break;
+    case BME68X_BENCH_HUM:
+      for (int i = 0; i < n; i++) {
+        dev->calib.t_fine = s_t_fine[i];
+        out[i] = calc_humidity(in->h_adc[i], dev);
+      }
+      break;
+    case BME68X_BENCH_GAS_LOW:
+      for (int i = 0; i < n; i++) {
+        out[i] = calc_gas_resistance_low(in->gl_adc[i], in->gl_range[i], dev);
+      }
+      break;
+    case BME68X_BENCH_GAS_HIGH:
+      for (int i = 0; i < n; i++) {
+        out[i] = calc_gas_resistance_high(in->gh_adc[i], in->gh_range[i]);
+      }
+      break;
+    case BME68X_BENCH_RES_HEAT:
+      for (int i = 0; i < n; i++) {
+        out[i] = calc_res_heat(in->heatr_temp[i], dev);
+      }
+      break;
+    case BME68X_BENCH_FIELDS:
+      for (int i = 0; i + 3 <= n; i += 3) {
+        s_fields = &in->fields[i * BME68X_LEN_FIELD];
+        read_all_field_data(s_field_ptrs, dev);
+      }
+      break;
+    case BME68X_BENCH_MAX:
+      break;
+  }
+}
+
+static void bme68x_bench_results(enum bme68x_bench_kernel k, double *out,
+                                 int n) {
+  double scale = 1.0;
+  if (k == BME68X_BENCH_TEMP) scale = BME68X_BENCH_TEMP_SCALE;
+  if (k == BME68X_BENCH_HUM) scale = BME68X_BENCH_HUM_SCALE;
+  for (int i = 0; i < n && i < s_n; i++) {
+    out[i] = s_out[k][i] / scale;
+  }
+}
+
+const struct bme68x_bench_build BME68X_BENCH_SYM(bme68x_bench_build) = {
+    .name = BME68X_BENCH_NAME,
+    .init = bme68x_bench_init,
+    .prepare = bme68x_bench_prepare,
+    .run = bme68x_bench_run,
+    .results = bme68x_bench_results,
+};
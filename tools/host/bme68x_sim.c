@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measurement cycles are not run in real time: state is advanced lazily,
+// up to the virtual clock, whenever the driver touches the bus.
+
+#include "bme68x_sim.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_NUM_FIELDS 3
+#define SIM_MEASURING_MSK 0x20
+#define SIM_GAS_MEASURING_MSK 0x40
+// Heating time needed for the plate to reach its target temperature.
+#define SIM_HEAT_STAB_US 10000
+// Gas resistance of the environment is for this heater temperature, it is
+// halved for every 100 degrees above it and doubled for every 100 below.
+#define SIM_GAS_REF_TEMP 320.0
+// Ambient temperature assumed for decoding heater set points.
+#define SIM_AMB_TEMP 25.0
+// Values reported for skipped (oversampling 0) measurements.
+#define SIM_SKIPPED_ADC 0x80000
+#define SIM_SKIPPED_HUM_ADC 0x8000
+
+// Representative calibration sets, within the spread seen across parts.
+const struct bme68x_sim_calib bme68x_sim_calibs[] = {
+    {"typ-a", 26203, 26377, 3, 36472, -10376, 88, 7130, -140, 30, 49, -1044,
+     -3104, 30, 773, 1015, 0, 45, 20, 120, -100, -30, -5969, 18, 1, 43, -1},
+    {"typ-b", 25945, 26518, 3, 35950, -10561, 88, 7603, -62, 30, 36, -256,
+     -3219, 30, 826, 996, 0, 45, 20, 120, -100, -63, -12134, 18, 1, 26, 0},
+    {"typ-c", 26461, 26155, 3, 36861, -10128, 88, 6760, -236, 30, 60, -1763,
+     -2788, 30, 705, 1041, 0, 45, 20, 120, -100, -20, -1000, 18, 2, 57, -2},
+};
+
+const int bme68x_sim_num_calibs =
+    sizeof(bme68x_sim_calibs) / sizeof(bme68x_sim_calibs[0]);
+
+// Gas range correction factors of the low gas variant, same as the driver's.
+static const double s_k1_range[16] = {
+    0, 0, 0, 0, 0, -1, 0, -0.8, 0, 0, -0.2, -0.5, 0, -1, 0, 0};
+static const double s_k2_range[16] = {
+    0, 0, 0, 0, 0.1, 0.7, 0, -0.8, -0.1, 0, 0, 0, 0, 0, 0, 0};
+
+struct bme68x_sim_trace_point {
+  double t;
+  struct bme68x_sim_env env;
+};
+
+struct bme68x_sim {
+  uint8_t regs[256];
+  uint8_t variant;
+  const struct bme68x_sim_calib *calib;
+  uint32_t i2c_freq;
+  uint64_t now_us;
+  // Cycle in progress, if mode is not sleep.
+  uint8_t mode;
+  uint64_t cycle_start_us;
+  uint64_t tph_end_us;
+  uint64_t cycle_end_us;
+  uint8_t step;         // Heater profile step.
+  uint8_t step_cycles;  // Cycles completed at the current step (parallel).
+  uint8_t field;        // Field the cycle's results go to.
+  uint8_t meas_index;
+  bme68x_sim_env_cb_t env_cb;
+  void *env_cb_arg;
+  struct bme68x_sim_trace_point *trace;
+  int trace_len;
+  struct bme68x_sim_env envs[256];  // By meas_index.
+  struct bme68x_sim_stats stats;
+};
+
+static void bme68x_sim_default_env(uint64_t t_us, uint8_t gas_index,
+                                   struct bme68x_sim_env *env, void *arg) {
+  double t = t_us / 1e6;
+  env->temp = 22 + 3 * sin(2 * M_PI * t / 3600);
+  env->humidity = 45 + 10 * sin(2 * M_PI * t / 5400);
+  env->pressure = 101325 + 150 * sin(2 * M_PI * t / 21600);
+  env->gas = 50000 * (1 + 0.5 * sin(2 * M_PI * t / 1800));
+  (void) gas_index;
+  (void) arg;
+}
+
+/* Forward models, from the floating point compensation formulas. */
+
+static double bme68x_sim_temp(const struct bme68x_sim_calib *c, uint32_t adc,
+                              double *t_fine) {
+  double v1 = (adc / 16384.0 - c->t1 / 1024.0) * c->t2;
+  double v2 = (adc / 131072.0 - c->t1 / 8192.0);
+  *t_fine = v1 + v2 * v2 * (c->t3 * 16.0);
+  return *t_fine / 5120.0;
+}
+
+static double bme68x_sim_temp_fn(const struct bme68x_sim_calib *c,
+                                 uint32_t adc, double t_fine) {
+  return bme68x_sim_temp(c, adc, &t_fine);
+}
+
+static double bme68x_sim_pres_fn(const struct bme68x_sim_calib *c,
+                                 uint32_t adc, double t_fine) {
+  double v1 = t_fine / 2.0 - 64000.0;
+  double v2 = v1 * v1 * (c->p6 / 131072.0);
+  v2 = v2 + v1 * c->p5 * 2.0;
+  v2 = v2 / 4.0 + c->p4 * 65536.0;
+  v1 = (c->p3 * v1 * v1 / 16384.0 + c->p2 * v1) / 524288.0;
+  v1 = (1.0 + v1 / 32768.0) * c->p1;
+  double p = ((1048576.0 - adc) - v2 / 4096.0) * 6250.0 / v1;
+  double v3 = (p / 256.0) * (p / 256.0) * (p / 256.0) * (c->p10 / 131072.0);
+  v1 = c->p9 * p * p / 2147483648.0;
+  v2 = p * (c->p8 / 32768.0);
+  return p + (v1 + v2 + v3 + c->p7 * 128.0) / 16.0;
+}
+
+static double bme68x_sim_hum_fn(const struct bme68x_sim_calib *c,
+                                uint32_t adc, double t_fine) {
+  double t = t_fine / 5120.0;
+  double v1 = adc - (c->h1 * 16.0 + (c->h3 / 2.0) * t);
+  double v2 = v1 * (c->h2 / 262144.0) *
+              (1.0 + (c->h4 / 16384.0) * t + (c->h5 / 1048576.0) * t * t);
+  double v3 = c->h6 / 16384.0, v4 = c->h7 / 2097152.0;
+  return v2 + (v3 + v4 * t) * v2 * v2;
+}
+
+typedef double (*bme68x_sim_fn_t)(const struct bme68x_sim_calib *c,
+                                  uint32_t adc, double t_fine);
+
+// ADC value in [0, max] that |fn| maps closest to |v|.
+static uint32_t bme68x_sim_invert(bme68x_sim_fn_t fn,
+                                  const struct bme68x_sim_calib *c,
+                                  double t_fine, double v, uint32_t max,
+                                  bool decreasing) {
+  uint32_t lo = 0, hi = max;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    double fm = fn(c, mid, t_fine);
+    if (decreasing ? fm > v : fm < v) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return (fabs(fn(c, lo, t_fine) - v) <= fabs(fn(c, hi, t_fine) - v) ? lo
+                                                                      : hi);
+}
+
+// Heater temperature for a res_heat set point, inverse of calc_res_heat().
+static double bme68x_sim_heater_temp(const struct bme68x_sim_calib *c,
+                                     uint8_t res_heat) {
+  double v1 = c->gh1 / 16.0 + 49.0;
+  double v2 = (c->gh2 / 32768.0) * 0.0005 + 0.00235;
+  double v3 = c->gh3 / 1024.0;
+  double v5 = (res_heat / 3.4 + 25) * ((4.0 + c->res_heat_range) / 4) *
+              (1 + c->res_heat_val * 0.002);
+  double v4 = v5 - v3 * SIM_AMB_TEMP;
+  return (v4 / v1 - 1) / v2;
+}
+
+// Picks the range that puts the ADC value closest to mid-scale,
+// like the sensor's auto-ranging.
+static void bme68x_sim_gas_adc(const struct bme68x_sim *sim, double r,
+                               uint16_t *adc, uint8_t *range) {
+  const struct bme68x_sim_calib *c = sim->calib;
+  double best_a = 0;
+  for (int rg = 0; rg < 16; rg++) {
+    double a;
+    if (sim->variant == BME68X_VARIANT_GAS_HIGH) {
+      a = (1e6 * (262144 >> rg) / r - 4096) / 3 + 512;
+    } else {
+      double v2 = (1340.0 + 5.0 * c->range_sw_err) * (1 + s_k1_range[rg] / 100);
+      double v3 = 1 + s_k2_range[rg] / 100;
+      a = (1 / (r * v3 * 0.000000125 * (1 << rg)) - 1) * v2 + 512;
+    }
+    if (rg == 0 || fabs(a - 512) < fabs(best_a - 512)) {
+      best_a = a;
+      *range = rg;
+    }
+  }
+  if (best_a < 0) best_a = 0;
+  if (best_a > 1023) best_a = 1023;
+  *adc = (uint16_t) lround(best_a);
+}
+
+/* Register map. */
+
+static void bme68x_sim_put16(uint8_t *c, int lsb, int msb, uint16_t v) {
+  c[lsb] = v & 0xff;
+  c[msb] = v >> 8;
+}
+
+static uint8_t bme68x_sim_coeff_reg(int i) {
+  if (i < BME68X_LEN_COEFF1) return BME68X_REG_COEFF1 + i;
+  i -= BME68X_LEN_COEFF1;
+  if (i < BME68X_LEN_COEFF2) return BME68X_REG_COEFF2 + i;
+  return BME68X_REG_COEFF3 + i - BME68X_LEN_COEFF2;
+}
+
+static void bme68x_sim_encode_calib(struct bme68x_sim *sim) {
+  const struct bme68x_sim_calib *cal = sim->calib;
+  uint8_t c[BME68X_LEN_COEFF_ALL];
+  memset(c, 0, sizeof(c));
+  bme68x_sim_put16(c, BME68X_IDX_T1_LSB, BME68X_IDX_T1_MSB, cal->t1);
+  bme68x_sim_put16(c, BME68X_IDX_T2_LSB, BME68X_IDX_T2_MSB, cal->t2);
+  c[BME68X_IDX_T3] = cal->t3;
+  bme68x_sim_put16(c, BME68X_IDX_P1_LSB, BME68X_IDX_P1_MSB, cal->p1);
+  bme68x_sim_put16(c, BME68X_IDX_P2_LSB, BME68X_IDX_P2_MSB, cal->p2);
+  c[BME68X_IDX_P3] = cal->p3;
+  bme68x_sim_put16(c, BME68X_IDX_P4_LSB, BME68X_IDX_P4_MSB, cal->p4);
+  bme68x_sim_put16(c, BME68X_IDX_P5_LSB, BME68X_IDX_P5_MSB, cal->p5);
+  c[BME68X_IDX_P6] = cal->p6;
+  c[BME68X_IDX_P7] = cal->p7;
+  bme68x_sim_put16(c, BME68X_IDX_P8_LSB, BME68X_IDX_P8_MSB, cal->p8);
+  bme68x_sim_put16(c, BME68X_IDX_P9_LSB, BME68X_IDX_P9_MSB, cal->p9);
+  c[BME68X_IDX_P10] = cal->p10;
+  // H1 and H2 share a byte, a nibble each.
+  c[BME68X_IDX_H2_MSB] = cal->h2 >> 4;
+  c[BME68X_IDX_H1_MSB] = cal->h1 >> 4;
+  c[BME68X_IDX_H1_LSB] = ((cal->h2 & 0x0f) << 4) | (cal->h1 & 0x0f);
+  c[BME68X_IDX_H3] = cal->h3;
+  c[BME68X_IDX_H4] = cal->h4;
+  c[BME68X_IDX_H5] = cal->h5;
+  c[BME68X_IDX_H6] = cal->h6;
+  c[BME68X_IDX_H7] = cal->h7;
+  c[BME68X_IDX_GH1] = cal->gh1;
+  bme68x_sim_put16(c, BME68X_IDX_GH2_LSB, BME68X_IDX_GH2_MSB, cal->gh2);
+  c[BME68X_IDX_GH3] = cal->gh3;
+  c[BME68X_IDX_RES_HEAT_VAL] = cal->res_heat_val;
+  c[BME68X_IDX_RES_HEAT_RANGE] = (cal->res_heat_range << 4) & 0x30;
+  c[BME68X_IDX_RANGE_SW_ERR] = (uint8_t)(cal->range_sw_err * 16) & 0xf0;
+  for (int i = 0; i < BME68X_LEN_COEFF_ALL; i++) {
+    sim->regs[bme68x_sim_coeff_reg(i)] = c[i];
+  }
+}
+
+static void bme68x_sim_reset(struct bme68x_sim *sim) {
+  memset(sim->regs, 0, sizeof(sim->regs));
+  sim->regs[BME68X_REG_CHIP_ID] = BME68X_CHIP_ID;
+  sim->regs[BME68X_REG_VARIANT_ID] = sim->variant;
+  sim->regs[BME68X_REG_UNIQUE_ID] = 0x5a;
+  sim->regs[BME68X_REG_UNIQUE_ID + 1] = 0x68;
+  bme68x_sim_encode_calib(sim);
+  sim->mode = BME68X_SLEEP_MODE;
+  sim->meas_index = 0;
+}
+
+static uint8_t *bme68x_sim_field(struct bme68x_sim *sim, int i) {
+  return &sim->regs[BME68X_REG_FIELD0 + i * BME68X_LEN_FIELD_OFFSET];
+}
+
+static bool bme68x_sim_run_gas(const struct bme68x_sim *sim) {
+  return (sim->regs[BME68X_REG_CTRL_GAS_1] & BME68X_RUN_GAS_MSK) != 0;
+}
+
+static bool bme68x_sim_heater_on(const struct bme68x_sim *sim) {
+  return bme68x_sim_run_gas(sim) &&
+         !(sim->regs[BME68X_REG_CTRL_GAS_0] & BME68X_HCTRL_MSK);
+}
+
+static int bme68x_sim_num_steps(const struct bme68x_sim *sim) {
+  int n = sim->regs[BME68X_REG_CTRL_GAS_1] & BME68X_NBCONV_MSK;
+  if (n < 1) n = 1;
+  if (n > 10) n = 10;
+  return n;
+}
+
+// 6-bit value with a 2-bit x4 multiplier, used by the heater duration regs.
+static uint32_t bme68x_sim_dur(uint8_t v) {
+  return (uint32_t)(v & 0x3f) << (2 * (v >> 6));
+}
+
+static uint32_t bme68x_sim_tph_us(const struct bme68x_sim *sim) {
+  static const uint8_t os_cycles[8] = {0, 1, 2, 4, 8, 16, 16, 16};
+  uint8_t ctrl_meas = sim->regs[BME68X_REG_CTRL_MEAS];
+  uint32_t cycles = os_cycles[(ctrl_meas >> BME68X_OST_POS) & 7] +
+                    os_cycles[(ctrl_meas >> BME68X_OSP_POS) & 7] +
+                    os_cycles[sim->regs[BME68X_REG_CTRL_HUM] & 7];
+  uint32_t us = cycles * 1963 + 477 * 4;
+  if (bme68x_sim_run_gas(sim)) us += 477 * 5;
+  if (sim->mode != BME68X_PARALLEL_MODE) us += 1000;  // Wake up.
+  return us;
+}
+
+static uint32_t bme68x_sim_heater_us(const struct bme68x_sim *sim) {
+  if (!bme68x_sim_heater_on(sim)) return 0;
+  if (sim->mode == BME68X_PARALLEL_MODE) {
+    // Shared heater duration, in 0.477 ms steps.
+    return bme68x_sim_dur(sim->regs[BME68X_REG_SHD_HEATR_DUR]) * 477;
+  }
+  return bme68x_sim_dur(sim->regs[BME68X_REG_GAS_WAIT0 + sim->step]) * 1000;
+}
+
+// Sleep between cycles in sequential mode.
+static uint32_t bme68x_sim_odr_us(const struct bme68x_sim *sim) {
+  static const uint32_t odr_us[8] = {590,    62500,   125000, 250000,
+                                     500000, 1000000, 10000,  20000};
+  if (sim->regs[BME68X_REG_CTRL_GAS_1] & BME68X_ODR3_MSK) return 0;
+  return odr_us[(sim->regs[BME68X_REG_CONFIG] >> BME68X_ODR20_POS) & 7];
+}
+
+static void bme68x_sim_start_cycle(struct bme68x_sim *sim, uint64_t start) {
+  sim->cycle_start_us = start;
+  sim->tph_end_us = start + bme68x_sim_tph_us(sim);
+  sim->cycle_end_us = sim->tph_end_us + bme68x_sim_heater_us(sim);
+  bme68x_sim_field(sim, sim->field)[0] &= ~BME68X_NEW_DATA_MSK;
+}
+
+static void bme68x_sim_put20(uint8_t *p, uint32_t v) {
+  p[0] = (v >> 12) & 0xff;
+  p[1] = (v >> 4) & 0xff;
+  p[2] = (v & 0x0f) << 4;
+}
+
+static uint8_t *bme68x_sim_gas_regs(const struct bme68x_sim *sim, uint8_t *f) {
+  return &f[sim->variant == BME68X_VARIANT_GAS_HIGH ? 15 : 13];
+}
+
+// Fills in ADC values and gas range of field |f| for |env|.
+static void bme68x_sim_put_values(const struct bme68x_sim *sim,
+                                  const struct bme68x_sim_env *env,
+                                  uint8_t *f) {
+  const struct bme68x_sim_calib *c = sim->calib;
+  double t_fine;
+  uint32_t t_adc = bme68x_sim_invert(bme68x_sim_temp_fn, c, 0, env->temp,
+                                     0xfffff, false /* decreasing */);
+  bme68x_sim_temp(c, t_adc, &t_fine);
+  uint32_t p_adc = bme68x_sim_invert(bme68x_sim_pres_fn, c, t_fine,
+                                     env->pressure, 0xfffff, true);
+  double rh = fmin(fmax(env->humidity, 0), 100);
+  uint32_t h_adc =
+      bme68x_sim_invert(bme68x_sim_hum_fn, c, t_fine, rh, 0xffff, false);
+  bme68x_sim_put20(&f[2], p_adc);
+  bme68x_sim_put20(&f[5], t_adc);
+  f[8] = h_adc >> 8;
+  f[9] = h_adc & 0xff;
+  uint16_t g_adc = 0;
+  uint8_t range = 0;
+  bme68x_sim_gas_adc(sim, env->gas, &g_adc, &range);
+  uint8_t *g = bme68x_sim_gas_regs(sim, f);
+  g[0] = g_adc >> 2;
+  g[1] = ((g_adc & 3) << 6) | range;
+}
+
+static void bme68x_sim_complete_cycle(struct bme68x_sim *sim) {
+  uint8_t *f = bme68x_sim_field(sim, sim->field);
+  uint8_t ctrl_meas = sim->regs[BME68X_REG_CTRL_MEAS];
+  struct bme68x_sim_env *env = &sim->envs[sim->meas_index];
+  sim->env_cb(sim->cycle_end_us, sim->step, env, sim->env_cb_arg);
+  if (bme68x_sim_heater_on(sim)) {
+    uint8_t res_heat = sim->regs[BME68X_REG_RES_HEAT0 + sim->step];
+    double ht = bme68x_sim_heater_temp(sim->calib, res_heat);
+    env->gas *= pow(2, (SIM_GAS_REF_TEMP - ht) / 100);
+  }
+  memset(f, 0, BME68X_LEN_FIELD);
+  // Temperature is needed for the other two even if it's skipped.
+  bme68x_sim_put_values(sim, env, f);
+  if ((ctrl_meas & BME68X_OST_MSK) == 0) {
+    bme68x_sim_put20(&f[5], SIM_SKIPPED_ADC);
+  }
+  if ((ctrl_meas & BME68X_OSP_MSK) == 0) {
+    bme68x_sim_put20(&f[2], SIM_SKIPPED_ADC);
+  }
+  if ((sim->regs[BME68X_REG_CTRL_HUM] & BME68X_OSH_MSK) == 0) {
+    f[8] = SIM_SKIPPED_HUM_ADC >> 8;
+    f[9] = SIM_SKIPPED_HUM_ADC & 0xff;
+  }
+  f[0] = BME68X_NEW_DATA_MSK | sim->step;
+  f[1] = sim->meas_index++;
+  uint8_t *g = bme68x_sim_gas_regs(sim, f);
+  if (!bme68x_sim_run_gas(sim)) {
+    g[0] = g[1] = 0;
+  } else {
+    uint32_t heat_us = bme68x_sim_heater_us(sim);
+    bool valid = true;
+    if (sim->mode == BME68X_PARALLEL_MODE) {
+      // The heater stays on for gas_wait cycles, the conversion is done on
+      // the last one.
+      uint8_t n = sim->regs[BME68X_REG_GAS_WAIT0 + sim->step];
+      valid = (sim->step_cycles + 1 >= n);
+      heat_us *= sim->step_cycles + 1;
+    }
+    if (valid) g[1] |= BME68X_GASM_VALID_MSK;
+    if (heat_us >= SIM_HEAT_STAB_US) g[1] |= BME68X_HEAT_STAB_MSK;
+    if (bme68x_sim_heater_on(sim)) {
+      // DAC code the heater regulation settled at, a fixed function of the
+      // target resistance.
+      uint8_t res_heat = sim->regs[BME68X_REG_RES_HEAT0 + sim->step];
+      sim->regs[BME68X_REG_IDAC_HEAT0 + sim->step] = 0x20 + res_heat / 4;
+    }
+  }
+  sim->stats.num_cycles++;
+  switch (sim->mode) {
+    case BME68X_FORCED_MODE:
+      sim->mode = BME68X_SLEEP_MODE;
+      sim->regs[BME68X_REG_CTRL_MEAS] &= ~BME68X_MODE_MSK;
+      break;
+    case BME68X_SEQUENTIAL_MODE:
+      sim->step = (sim->step + 1) % bme68x_sim_num_steps(sim);
+      sim->field = (sim->field + 1) % SIM_NUM_FIELDS;
+      bme68x_sim_start_cycle(sim, sim->cycle_end_us + bme68x_sim_odr_us(sim));
+      break;
+    case BME68X_PARALLEL_MODE: {
+      uint8_t n = sim->regs[BME68X_REG_GAS_WAIT0 + sim->step];
+      if (++sim->step_cycles >= n) {
+        sim->step_cycles = 0;
+        sim->step = (sim->step + 1) % bme68x_sim_num_steps(sim);
+      }
+      sim->field = (sim->field + 1) % SIM_NUM_FIELDS;
+      bme68x_sim_start_cycle(sim, sim->cycle_end_us);
+      break;
+    }
+  }
+}
+
+// Completes the cycles due by now and updates status of the one in progress.
+static void bme68x_sim_run(struct bme68x_sim *sim) {
+  while (sim->mode != BME68X_SLEEP_MODE && sim->cycle_end_us <= sim->now_us) {
+    bme68x_sim_complete_cycle(sim);
+  }
+  for (int i = 0; i < SIM_NUM_FIELDS; i++) {
+    bme68x_sim_field(sim, i)[0] &= ~(SIM_MEASURING_MSK | SIM_GAS_MEASURING_MSK);
+  }
+  if (sim->mode == BME68X_SLEEP_MODE || sim->now_us < sim->cycle_start_us) {
+    return;
+  }
+  uint8_t *f = bme68x_sim_field(sim, sim->field);
+  f[0] |= SIM_MEASURING_MSK;
+  if (sim->now_us >= sim->tph_end_us) f[0] |= SIM_GAS_MEASURING_MSK;
+}
+
+static void bme68x_sim_set_mode(struct bme68x_sim *sim, uint8_t mode) {
+  if (mode == sim->mode) return;
+  // Anything in progress is aborted.
+  sim->mode = mode;
+  if (mode == BME68X_SLEEP_MODE) return;
+  sim->step = sim->step_cycles = sim->field = 0;
+  bme68x_sim_start_cycle(sim, sim->now_us);
+}
+
+static void bme68x_sim_write_reg(struct bme68x_sim *sim, uint8_t reg,
+                                 uint8_t val) {
+  if (reg == BME68X_REG_SOFT_RESET) {
+    if (val == BME68X_SOFT_RESET_CMD) {
+      bme68x_sim_reset(sim);
+      sim->stats.num_resets++;
+    }
+    return;
+  }
+  // Only the control block is writable, the rest is read-only.
+  if (reg < BME68X_REG_IDAC_HEAT0 || reg > BME68X_REG_CONFIG) return;
+  sim->regs[reg] = val;
+  if (reg == BME68X_REG_CTRL_MEAS) {
+    bme68x_sim_set_mode(sim, val & BME68X_MODE_MSK);
+  }
+}
+
+// Time on the wire: 9 bits per byte, plus start and stop conditions.
+static void bme68x_sim_bus(struct bme68x_sim *sim, uint32_t bytes,
+                           uint32_t conds) {
+  uint64_t bits = bytes * 9 + conds;
+  uint64_t us = (bits * 1000000 + sim->i2c_freq - 1) / sim->i2c_freq;
+  sim->now_us += us;
+  sim->stats.bus_us += us;
+}
+
+static BME68X_INTF_RET_TYPE bme68x_sim_read(uint8_t reg_addr,
+                                            uint8_t *reg_data,
+                                            uint32_t length, void *intf_ptr) {
+  struct bme68x_sim *sim = (struct bme68x_sim *) intf_ptr;
+  bme68x_sim_run(sim);
+  bool field_read = false, new_data = false;
+  for (uint32_t i = 0; i < length; i++) {
+    reg_data[i] = sim->regs[(uint8_t)(reg_addr + i)];
+  }
+  // New data flags are cleared once read.
+  for (int i = 0; i < SIM_NUM_FIELDS; i++) {
+    uint32_t reg = BME68X_REG_FIELD0 + i * BME68X_LEN_FIELD_OFFSET;
+    if (reg < reg_addr || reg >= reg_addr + length) continue;
+    uint8_t *f = bme68x_sim_field(sim, i);
+    field_read = true;
+    if (f[0] & BME68X_NEW_DATA_MSK) new_data = true;
+    f[0] &= ~BME68X_NEW_DATA_MSK;
+  }
+  if (field_read && !new_data) sim->stats.num_empty_polls++;
+  // Address, register, address again, data; start, restart, stop.
+  bme68x_sim_bus(sim, 3 + length, 3);
+  sim->stats.num_reads++;
+  sim->stats.bytes_read += length;
+  return 0;
+}
+
+static BME68X_INTF_RET_TYPE bme68x_sim_write(uint8_t reg_addr,
+                                             const uint8_t *reg_data,
+                                             uint32_t length,
+                                             void *intf_ptr) {
+  struct bme68x_sim *sim = (struct bme68x_sim *) intf_ptr;
+  if (length == 0) return -1;
+  bme68x_sim_run(sim);
+  // Burst writes are register/value pairs.
+  bme68x_sim_write_reg(sim, reg_addr, reg_data[0]);
+  for (uint32_t i = 1; i + 1 < length; i += 2) {
+    bme68x_sim_write_reg(sim, reg_data[i], reg_data[i + 1]);
+  }
+  bme68x_sim_bus(sim, 2 + length, 2);
+  sim->stats.num_writes++;
+  sim->stats.bytes_written += length + 1;
+  return 0;
+}
+
+static void bme68x_sim_delay_us(uint32_t period, void *intf_ptr) {
+  struct bme68x_sim *sim = (struct bme68x_sim *) intf_ptr;
+  sim->now_us += period;
+  sim->stats.num_delays++;
+  sim->stats.delay_us += period;
+}
+
+struct bme68x_sim *bme68x_sim_create(uint8_t variant, int calib) {
+  if (calib < 0 || calib >= bme68x_sim_num_calibs) return NULL;
+  struct bme68x_sim *sim = (struct bme68x_sim *) calloc(1, sizeof(*sim));
+  if (sim == NULL) return NULL;
+  sim->variant = variant;
+  sim->calib = &bme68x_sim_calibs[calib];
+  sim->i2c_freq = 400000;
+  sim->env_cb = bme68x_sim_default_env;
+  bme68x_sim_reset(sim);
+  return sim;
+}
+
+void bme68x_sim_free(struct bme68x_sim *sim) {
+  if (sim == NULL) return;
+  free(sim->trace);
+  free(sim);
+}
+
+void bme68x_sim_attach(struct bme68x_sim *sim, struct bme68x_dev *dev) {
+  dev->intf = BME68X_I2C_INTF;
+  dev->intf_ptr = sim;
+  dev->read = bme68x_sim_read;
+  dev->write = bme68x_sim_write;
+  dev->delay_us = bme68x_sim_delay_us;
+}
+
+void bme68x_sim_set_env_cb(struct bme68x_sim *sim, bme68x_sim_env_cb_t cb,
+                           void *arg) {
+  sim->env_cb = (cb != NULL ? cb : bme68x_sim_default_env);
+  sim->env_cb_arg = arg;
+}
+
+static double bme68x_sim_lerp(double a, double b, double k) {
+  return a + (b - a) * k;
+}
+
+static void bme68x_sim_trace_env(uint64_t t_us, uint8_t gas_index,
+                                 struct bme68x_sim_env *env, void *arg) {
+  const struct bme68x_sim *sim = (const struct bme68x_sim *) arg;
+  const struct bme68x_sim_trace_point *tp = sim->trace;
+  int n = sim->trace_len;
+  double t = t_us / 1e6;
+  if (t <= tp[0].t) {
+    *env = tp[0].env;
+  } else if (t >= tp[n - 1].t) {
+    *env = tp[n - 1].env;
+  } else {
+    int lo = 0, hi = n - 1;
+    while (hi - lo > 1) {
+      int mid = (lo + hi) / 2;
+      if (tp[mid].t <= t) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    const struct bme68x_sim_env *a = &tp[lo].env, *b = &tp[hi].env;
+    double k = (t - tp[lo].t) / (tp[hi].t - tp[lo].t);
+    env->temp = bme68x_sim_lerp(a->temp, b->temp, k);
+    env->humidity = bme68x_sim_lerp(a->humidity, b->humidity, k);
+    env->pressure = bme68x_sim_lerp(a->pressure, b->pressure, k);
+    env->gas = bme68x_sim_lerp(a->gas, b->gas, k);
+  }
+  (void) gas_index;
+}
+
+bool bme68x_sim_load_trace(struct bme68x_sim *sim, const char *file) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) return false;
+  struct bme68x_sim_trace_point *tp = NULL;
+  int n = 0, cap = 0;
+  bool ok = true;
+  char line[256];
+  while (ok && fgets(line, sizeof(line), fp) != NULL) {
+    struct bme68x_sim_trace_point p;
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (sscanf(line, "%lf,%lf,%lf,%lf,%lf", &p.t, &p.env.temp,
+               &p.env.humidity, &p.env.pressure, &p.env.gas) != 5 ||
+        (n > 0 && p.t <= tp[n - 1].t)) {
+      fprintf(stderr, "%s: invalid line %d\n", file, n + 1);
+      ok = false;
+      break;
+    }
+    if (n == cap) {
+      cap = (cap > 0 ? cap * 2 : 64);
+      void *ntp = realloc(tp, cap * sizeof(*tp));
+      if (ntp == NULL) {
+        ok = false;
+        break;
+      }
+      tp = (struct bme68x_sim_trace_point *) ntp;
+    }
+    tp[n++] = p;
+  }
+  fclose(fp);
+  if (!ok || n == 0) {
+    free(tp);
+    return false;
+  }
+  free(sim->trace);
+  sim->trace = tp;
+  sim->trace_len = n;
+  bme68x_sim_set_env_cb(sim, bme68x_sim_trace_env, sim);
+  return true;
+}
+
+void bme68x_sim_set_i2c_freq(struct bme68x_sim *sim, uint32_t freq) {
+  if (freq > 0) sim->i2c_freq = freq;
+}
+
+uint64_t bme68x_sim_now(const struct bme68x_sim *sim) {
+  return sim->now_us;
+}
+
+void bme68x_sim_advance(struct bme68x_sim *sim, uint64_t us) {
+  sim->now_us += us;
+}
+
+void bme68x_sim_get_env(const struct bme68x_sim *sim, uint8_t meas_index,
+                        struct bme68x_sim_env *env) {
+  *env = sim->envs[meas_index];
+}
+
+void bme68x_sim_get_stats(const struct bme68x_sim *sim,
+                          struct bme68x_sim_stats *stats) {
+  *stats = sim->stats;
+}
+
+void bme68x_sim_reset_stats(struct bme68x_sim *sim) {
+  memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+void bme68x_sim_encode_field(const struct bme68x_sim *sim,
+                             const struct bme68x_sim_env *env,
+                             uint8_t *field) {
+  memset(field, 0, BME68X_LEN_FIELD);
+  bme68x_sim_put_values(sim, env, field);
+  field[0] = BME68X_NEW_DATA_MSK;
+  bme68x_sim_gas_regs(sim, field)[1] |=
+      BME68X_GASM_VALID_MSK | BME68X_HEAT_STAB_MSK;
+}
+
+uint8_t bme68x_sim_peek(struct bme68x_sim *sim, uint8_t reg) {
+  bme68x_sim_run(sim);
+  return sim->regs[reg];
+}
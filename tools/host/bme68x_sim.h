@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host-side register-level BME68x simulator.
+// Plugs into the read/write/delay callbacks of the Bosch driver and models
+// the register map of the sensor on a virtual clock: chip and variant id,
+// calibration blocks, ctrl_meas mode transitions with conversion time
+// derived from oversampling and heater settings, the three field registers
+// and field rotation in parallel and sequential modes.
+// Environment is supplied by a callback, a CSV trace or the built-in
+// synthetic function, ADC values are produced by inverting the
+// compensation formulas for the device's calibration set. Gas resistance
+// is scaled by the heater temperature set for the cycle.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bme68x.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bme68x_sim;
+
+struct bme68x_sim_env {
+  double temp;      // deg C
+  double humidity;  // %RH
+  double pressure;  // Pa
+  double gas;       // Ohm, at 320 deg C heater temperature.
+};
+
+// Environment at virtual time |t_us|, for the heater step |gas_index|.
+typedef void (*bme68x_sim_env_cb_t)(uint64_t t_us, uint8_t gas_index,
+                                    struct bme68x_sim_env *env, void *arg);
+
+// Calibration set, encoded into the COEFF1..3 register blocks on reset.
+struct bme68x_sim_calib {
+  const char *name;
+  uint16_t t1;
+  int16_t t2;
+  int8_t t3;
+  uint16_t p1;
+  int16_t p2;
+  int8_t p3;
+  int16_t p4, p5;
+  int8_t p6, p7;
+  int16_t p8, p9;
+  uint8_t p10;
+  uint16_t h1, h2;
+  int8_t h3, h4, h5;
+  uint8_t h6;
+  int8_t h7;
+  int8_t gh1;
+  int16_t gh2;
+  int8_t gh3;
+  uint8_t res_heat_range;
+  int8_t res_heat_val;
+  int8_t range_sw_err;
+};
+
+extern const struct bme68x_sim_calib bme68x_sim_calibs[];
+extern const int bme68x_sim_num_calibs;
+
+struct bme68x_sim_stats {
+  uint32_t num_reads;
+  uint32_t num_writes;
+  uint32_t bytes_read;
+  uint32_t bytes_written;
+  uint32_t num_delays;
+  uint32_t num_resets;
+  uint32_t num_cycles;       // Completed measurement cycles.
+  uint32_t num_empty_polls;  // Field reads that found no new data.
+  uint64_t bus_us;           // Time spent on the bus, at the set clock.
+  uint64_t delay_us;         // Time spent in delay_us.
+};
+
+// |variant| is BME68X_VARIANT_GAS_LOW or BME68X_VARIANT_GAS_HIGH,
+// |calib| is an index into bme68x_sim_calibs.
+struct bme68x_sim *bme68x_sim_create(uint8_t variant, int calib);
+void bme68x_sim_free(struct bme68x_sim *sim);
+
+// Sets up |dev| to talk to |sim| over (simulated) I2C.
+void bme68x_sim_attach(struct bme68x_sim *sim, struct bme68x_dev *dev);
+
+void bme68x_sim_set_env_cb(struct bme68x_sim *sim, bme68x_sim_env_cb_t cb,
+                           void *arg);
+
+// Loads a CSV trace: "t_s,temp,humidity,pressure,gas" per line, lines
+// starting with '#' are ignored. Values are interpolated linearly and held
+// after the last point.
+bool bme68x_sim_load_trace(struct bme68x_sim *sim, const char *file);
+
+// Default is 400 kHz.
+void bme68x_sim_set_i2c_freq(struct bme68x_sim *sim, uint32_t freq);
+
+uint64_t bme68x_sim_now(const struct bme68x_sim *sim);
+void bme68x_sim_advance(struct bme68x_sim *sim, uint64_t us);
+
+// Environment the cycle with |meas_index| was generated from.
+void bme68x_sim_get_env(const struct bme68x_sim *sim, uint8_t meas_index,
+                        struct bme68x_sim_env *env);
+
+void bme68x_sim_get_stats(const struct bme68x_sim *sim,
+                          struct bme68x_sim_stats *stats);
+void bme68x_sim_reset_stats(struct bme68x_sim *sim);
+
+// Field register contents the sensor would report for |env|, with all
+// measurements enabled and a valid, heat-stable gas result. Useful for
+// generating realistic ADC distributions without running cycles.
+void bme68x_sim_encode_field(const struct bme68x_sim *sim,
+                             const struct bme68x_sim_env *env,
+                             uint8_t *field);
+
+// Direct register access, bypassing the bus and the accounting.
+uint8_t bme68x_sim_peek(struct bme68x_sim *sim, uint8_t reg);
+
+#ifdef __cplusplus
+}
+#endif
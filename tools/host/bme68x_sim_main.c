@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2019 Deomid "rojer" Ryabkov
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the Bosch driver against the simulator: measurement cycles in the
+// selected mode, compensated values checked against the environment they
+// were generated from, then per-sample I/O cost and timing.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bme68x.h"
+#include "bme68x_sim.h"
+
+#ifdef BME68X_USE_FPU
+#define SIM_TEMP(d) ((double) (d)->temperature)
+#define SIM_HUM(d) ((double) (d)->humidity)
+#define SIM_BUILD "float"
+#define SIM_PRES_TOL 1.0
+#else
+#define SIM_TEMP(d) ((d)->temperature / 100.0)
+#define SIM_HUM(d) ((d)->humidity / 1000.0)
+#define SIM_BUILD "integer"
+#define SIM_PRES_TOL 8.0  // Integer pressure formula is coarser.
+#endif
+
+// Tolerances for the compensated values, covering ADC quantization and
+// the integer build's rounding.
+#define SIM_TEMP_TOL 0.02
+#define SIM_HUM_TOL 0.05
+#define SIM_GAS_TOL 0.01  // Relative.
+
+// Heater profiles from Bosch's examples.
+static uint16_t s_seq_temp[10] = {200, 240, 280, 320, 360,
+                                  360, 320, 280, 240, 200};
+static uint16_t s_seq_dur[10] = {100, 100, 100, 100, 100,
+                                 100, 100, 100, 100, 100};
+static uint16_t s_par_temp[10] = {320, 100, 100, 100, 200,
+                                  200, 200, 320, 320, 320};
+static uint16_t s_par_mul[10] = {5, 2, 10, 30, 5, 5, 5, 5, 5, 5};
+
+struct sim_err {
+  double temp, pres, hum, gas;
+  int num_samples;
+  int num_gas;
+};
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-m forced|sequential|parallel] [-v low|high] "
+          "[-c calib] [-n samples] [-i interval_ms] [-t trace.csv] "
+          "[-f i2c_freq] [-q]\n",
+          argv0);
+  exit(2);
+}
+
+static void check_sample(struct bme68x_sim *sim, const struct bme68x_data *d,
+                         uint64_t now, bool quiet, struct sim_err *err) {
+  struct bme68x_sim_env env;
+  bme68x_sim_get_env(sim, d->meas_index, &env);
+  double temp = SIM_TEMP(d), hum = SIM_HUM(d);
+  double pres = d->pressure, gas = d->gas_resistance;
+  err->temp = fmax(err->temp, fabs(temp - env.temp));
+  err->pres = fmax(err->pres, fabs(pres - env.pressure));
+  err->hum = fmax(err->hum, fabs(hum - env.humidity));
+  if (d->status & BME68X_GASM_VALID_MSK) {
+    err->gas = fmax(err->gas, fabs(gas - env.gas) / env.gas);
+    err->num_gas++;
+  }
+  err->num_samples++;
+  if (quiet) return;
+  printf("%.3f,%u,%u,0x%02x,%.2f,%.0f,%.3f,%.0f\n", now / 1e6,
+         d->meas_index, d->gas_index, d->status, temp, pres, hum, gas);
+}
+
+int main(int argc, char **argv) {
+  uint8_t mode = BME68X_FORCED_MODE, variant = BME68X_VARIANT_GAS_LOW;
+  int calib = 0, num_samples = 100, interval_ms = 3000, freq = 0;
+  const char *trace = NULL;
+  bool quiet = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:v:c:n:i:t:f:q")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (strcmp(optarg, "forced") == 0) {
+          mode = BME68X_FORCED_MODE;
+        } else if (strcmp(optarg, "sequential") == 0) {
+          mode = BME68X_SEQUENTIAL_MODE;
+        } else if (strcmp(optarg, "parallel") == 0) {
+          mode = BME68X_PARALLEL_MODE;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'v':
+        variant = (strcmp(optarg, "high") == 0 ? BME68X_VARIANT_GAS_HIGH
+                                               : BME68X_VARIANT_GAS_LOW);
+        break;
+      case 'c':
+        calib = atoi(optarg);
+        break;
+      case 'n':
+        num_samples = atoi(optarg);
+        break;
+      case 'i':
+        interval_ms = atoi(optarg);
+        break;
+      case 't':
+        trace = optarg;
+        break;
+      case 'f':
+        freq = atoi(optarg);
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  struct bme68x_sim *sim = bme68x_sim_create(variant, calib);
+  if (sim == NULL) {
+    fprintf(stderr, "invalid calibration set %d\n", calib);
+    return 2;
+  }
+  if (trace != NULL && !bme68x_sim_load_trace(sim, trace)) {
+    fprintf(stderr, "failed to load %s\n", trace);
+    return 2;
+  }
+  if (freq > 0) bme68x_sim_set_i2c_freq(sim, freq);
+
+  struct bme68x_dev dev;
+  memset(&dev, 0, sizeof(dev));
+  bme68x_sim_attach(sim, &dev);
+  dev.amb_temp = 25;
+  int8_t rslt = bme68x_init(&dev);
+  if (rslt != BME68X_OK) {
+    fprintf(stderr, "bme68x_init: %d\n", rslt);
+    return 1;
+  }
+
+  struct bme68x_conf conf = {
+      .os_hum = BME68X_OS_1X,
+      .os_temp = BME68X_OS_2X,
+      .os_pres = BME68X_OS_16X,
+      .filter = BME68X_FILTER_OFF,
+      .odr = BME68X_ODR_NONE,
+  };
+  struct bme68x_heatr_conf hc = {.enable = BME68X_ENABLE};
+  switch (mode) {
+    case BME68X_FORCED_MODE:
+      hc.heatr_temp = 320;
+      hc.heatr_dur = 150;
+      break;
+    case BME68X_SEQUENTIAL_MODE:
+      hc.heatr_temp_prof = s_seq_temp;
+      hc.heatr_dur_prof = s_seq_dur;
+      hc.profile_len = 10;
+      break;
+    case BME68X_PARALLEL_MODE:
+      hc.heatr_temp_prof = s_par_temp;
+      hc.heatr_dur_prof = s_par_mul;
+      hc.profile_len = 10;
+      // 140 ms TPHG cycle.
+      hc.shared_heatr_dur =
+          140 - bme68x_get_meas_dur(BME68X_PARALLEL_MODE, &conf, &dev) / 1000;
+      break;
+  }
+  rslt = bme68x_set_conf(&conf, &dev);
+  if (rslt == BME68X_OK) rslt = bme68x_set_heatr_conf(mode, &hc, &dev);
+  if (rslt != BME68X_OK) {
+    fprintf(stderr, "config: %d\n", rslt);
+    return 1;
+  }
+
+  bme68x_sim_reset_stats(sim);
+  uint64_t start = bme68x_sim_now(sim);
+  struct sim_err err;
+  memset(&err, 0, sizeof(err));
+  struct bme68x_data data[3];
+  uint8_t n_data = 0;
+  int num_errors = 0;
+  if (!quiet) printf("# t,meas_index,gas_index,status,temp,pres,rh,gas\n");
+  if (mode != BME68X_FORCED_MODE) rslt = bme68x_set_op_mode(mode, &dev);
+  while (rslt == BME68X_OK && err.num_samples < num_samples) {
+    uint64_t cycle_start = bme68x_sim_now(sim);
+    uint32_t del = bme68x_get_meas_dur(mode, &conf, &dev);
+    if (mode == BME68X_FORCED_MODE) {
+      rslt = bme68x_set_op_mode(mode, &dev);
+      del += hc.heatr_dur * 1000;
+    } else if (mode == BME68X_SEQUENTIAL_MODE) {
+      del += s_seq_dur[0] * 1000;
+    } else {
+      del += hc.shared_heatr_dur * 1000;
+    }
+    if (rslt != BME68X_OK) break;
+    dev.delay_us(del, dev.intf_ptr);
+    int8_t r = bme68x_get_data(mode, data, &n_data, &dev);
+    if (r < 0) {
+      rslt = r;
+      break;
+    }
+    if (r == BME68X_W_NO_NEW_DATA) num_errors++;
+    for (uint8_t i = 0; i < n_data; i++) {
+      if (!(data[i].status & BME68X_NEW_DATA_MSK)) continue;
+      check_sample(sim, &data[i], bme68x_sim_now(sim), quiet, &err);
+    }
+    if (mode != BME68X_FORCED_MODE) continue;
+    uint64_t took = bme68x_sim_now(sim) - cycle_start;
+    if (took < interval_ms * 1000ULL) {
+      bme68x_sim_advance(sim, interval_ms * 1000ULL - took);
+    }
+  }
+  if (rslt != BME68X_OK) {
+    fprintf(stderr, "driver error: %d\n", rslt);
+    return 1;
+  }
+
+  struct bme68x_sim_stats st;
+  bme68x_sim_get_stats(sim, &st);
+  double n = err.num_samples;
+  static const char *mode_names[] = {"sleep", "forced", "parallel",
+                                     "sequential"};
+  printf(
+      "# %s build, %s mode, %s gas variant, calib %s: %d samples "
+      "(%d gas), %.1f s\n",
+      SIM_BUILD, mode_names[mode],
+      variant == BME68X_VARIANT_GAS_HIGH ? "high" : "low",
+      bme68x_sim_calibs[calib].name, err.num_samples, err.num_gas,
+      (bme68x_sim_now(sim) - start) / 1e6);
+  printf(
+      "# per sample: %.2f reads, %.2f writes, %.1f B read, %.1f B written, "
+      "%.0f us bus, %.2f delays (%.0f us), %.2f empty polls\n",
+      st.num_reads / n, st.num_writes / n, st.bytes_read / n,
+      st.bytes_written / n, st.bus_us / n, st.num_delays / n,
+      st.delay_us / n, st.num_empty_polls / n);
+  printf(
+      "# max error: temp %.3f C, pres %.2f Pa, rh %.3f %%, gas %.3f %%; "
+      "%d reads without new data\n",
+      err.temp, err.pres, err.hum, err.gas * 100, num_errors);
+  bme68x_sim_free(sim);
+  bool ok = (err.temp <= SIM_TEMP_TOL && err.pres <= SIM_PRES_TOL &&
+             err.hum <= SIM_HUM_TOL && err.gas <= SIM_GAS_TOL &&
+             err.num_gas > 0);
+  if (!ok) fprintf(stderr, "error exceeds tolerance\n");
+  return (ok ? 0 : 1);
+}